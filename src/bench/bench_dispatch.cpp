@@ -0,0 +1,49 @@
+// Dispatch benchmark of VM::run: instructions per second on a ut-vm.mini-style workload.
+// Build together with every mini/*.cpp except main.cpp, with optimization on and MINI_COUNT_INSTRUCTIONS
+// defined; add MINI_SWITCH_DISPATCH to measure the portable switch loop instead of threaded dispatch.
+// Run from src/test so that std.mini can be imported.
+
+#include "../mini/frontend.h"
+#include "../mini/vm.h"
+
+#include <chrono>
+#include <cstdio>
+
+#ifndef MINI_COUNT_INSTRUCTIONS
+#error "bench_dispatch requires MINI_COUNT_INSTRUCTIONS"
+#endif
+
+using namespace mini;
+
+int main(int argc, char** argv) {
+
+    const char* filename = argc > 1 ? argv[1] : "../bench/bench_dispatch.mini";
+
+    CompilerFrontEnd frontend;
+    IRProgram irprog;
+    frontend.initialize({});
+    frontend.load_file(filename);
+    try {
+        if (frontend.process(irprog) != 0) return 1;
+    }
+    catch (const IOError& e) {
+        StdoutOutputStream output;
+        e.print(output) << '\n';
+        return 1;
+    }
+
+    VM vm;
+    vm.load(irprog);
+    auto t_start = std::chrono::steady_clock::now();
+    vm.run();
+    double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+
+#ifdef MINI_SWITCH_DISPATCH
+    const char* dispatch = "switch";
+#else
+    const char* dispatch = "threaded";
+#endif
+    printf("%s dispatch: %llu instructions in %.3f s: %.2f M instructions/s\n", dispatch,
+        (unsigned long long)vm.instruction_count(), t, vm.instruction_count() / t / 1e6);
+    return vm.error_flag;
+}
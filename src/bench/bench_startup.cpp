@@ -0,0 +1,103 @@
+// Startup benchmark: time from nothing to a VM ready to run, compiling a program from source (with and
+// without the module cache) versus reading its bytecode image versus mapping it. Build together with every mini/*.cpp except main.cpp, with optimization on.
+// Run from src/test so that std.mini can be imported.
+
+#include "../mini/frontend.h"
+#include "../mini/vm.h"
+
+#include <chrono>
+#include <cstdio>
+
+using namespace mini;
+
+static double elapsed(std::chrono::steady_clock::time_point t_start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+}
+
+static bool compile(const char* filename, IRProgram& irprog, const char* cache_dir) {
+    CompilerFrontEnd frontend;
+    frontend.initialize({});
+    if (cache_dir) frontend.enable_module_cache(cache_dir);
+    frontend.load_file(filename);
+    try {
+        return frontend.process(irprog) == 0;
+    }
+    catch (const IOError& e) {
+        StdoutOutputStream output;
+        e.print(output) << '\n';
+        return false;
+    }
+}
+
+int main(int argc, char** argv) {
+
+    const char* filename = argc > 1 ? argv[1] : "ut-vm.mini";
+    const int rounds = argc > 2 ? atoi(argv[2]) : 50;
+    const char* image_name = "bench_startup.mbc";
+    const char* cache_dir = "bench_startup.cache";
+
+    double t_source = 0, t_cached = 0, t_image = 0, t_mapped = 0;
+    size_t image_size = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        auto t_start = std::chrono::steady_clock::now();
+        {
+            IRProgram irprog;
+            if (!compile(filename, irprog, nullptr)) return 1;
+            VM vm;
+            vm.load(irprog);
+
+            if (r == 0) {
+                BinaryStream bs;
+                irprog.serialize(bs);
+                FileLoader::write_binary_file(image_name, bs.buffer);
+                image_size = bs.buffer.size();
+            }
+        }
+        if (r > 0) t_source += elapsed(t_start);     // the first round also writes the image
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        auto t_start = std::chrono::steady_clock::now();
+        {
+            IRProgram irprog;
+            if (!compile(filename, irprog, cache_dir)) return 1;
+            VM vm;
+            vm.load(irprog);
+        }
+        if (r > 0) t_cached += elapsed(t_start);     // the first round fills the cache
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        auto t_start = std::chrono::steady_clock::now();
+        {
+            IRProgram irprog;
+            BinaryStream bs;
+            FileLoader::read_binary_file(image_name, bs.buffer);
+            irprog.deserialize(bs);
+            VM vm;
+            vm.load(irprog);
+        }
+        t_image += elapsed(t_start);
+    }
+
+    for (int r = 0; r < rounds; r++) {
+        auto t_start = std::chrono::steady_clock::now();
+        {
+            IRProgram irprog;
+            irprog.map_image(image_name);
+            VM vm;
+            vm.load(irprog);
+        }
+        t_mapped += elapsed(t_start);
+    }
+    std::remove(image_name);
+    std::filesystem::remove_all(cache_dir);
+
+    printf("%s, %d rounds\n", filename, rounds);
+    printf("  from source: %8.3f ms\n", t_source / (rounds - 1) * 1000);
+    printf("  cached:      %8.3f ms\n", t_cached / (rounds - 1) * 1000);
+    printf("  from image:  %8.3f ms (%zu bytes)\n", t_image / rounds * 1000, image_size);
+    printf("  mapped:      %8.3f ms\n", t_mapped / rounds * 1000);
+    return 0;
+}
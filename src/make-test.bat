@@ -29,9 +29,15 @@ msbuild -p:"Configuration=Debug" -p:"Platform=x64"
 @echo Testing Compiling
 x64\Debug\mini.exe -c ..\test\ut-vm.mini
 if %errorlevel% neq 0 exit /b %errorlevel%
+@echo Testing Bytecode Image
+x64\Debug\mini.exe -p ..\test\ut-vm.mbc
+if %errorlevel% neq 0 exit /b %errorlevel%
 @echo Testing VM
 x64\Debug\mini.exe ..\test\ut-vm.mini
 if %errorlevel% neq 0 exit /b %errorlevel%
+@echo Testing GC
+x64\Debug\mini.exe -g 1 ..\test\ut-vm.mini
+if %errorlevel% neq 0 exit /b %errorlevel%
 
 @echo All tests are successful
 
@@ -0,0 +1,113 @@
+#ifndef MINI_ALLOCATOR_H
+#define MINI_ALLOCATOR_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <vector>
+
+namespace mini {
+
+    // Size-classed slab allocator. Blocks up to max_small_size bytes are carved from 64KB chunks
+    // and recycled through per-class free lists; larger blocks go to the large object space (malloc).
+    // Each thread owns its own instance (see local()), so the free lists need no locking.
+    class SlabAllocator {
+    public:
+
+        static const size_t granularity = 16;
+        static const size_t max_small_size = 512;
+        static const size_t num_classes = max_small_size / granularity;
+        static const size_t chunk_size = 64 << 10;
+
+        struct Statistics {
+            size_t chunks = 0;
+            size_t large_objects = 0;
+            size_t large_bytes = 0;
+        };
+
+        SlabAllocator() : free_list(num_classes, nullptr) {}
+
+        SlabAllocator(const SlabAllocator&) = delete;
+        SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+        ~SlabAllocator() {
+            for (auto c : chunks) {
+                free(c);
+            }
+        }
+
+        // The allocator of current thread.
+        static SlabAllocator& local() {
+            static thread_local SlabAllocator allocator;
+            return allocator;
+        }
+
+        void* allocate(size_t size) {
+            if (size > max_small_size) {
+                stat.large_objects++;
+                stat.large_bytes += size;
+                return malloc(size);
+            }
+            size_t c = size_class(size);
+            FreeBlock* b = free_list[c];
+            if (b) {
+                free_list[c] = b->next;
+                return b;
+            }
+            return carve(block_size(c));
+        }
+
+        // size must be the same as the one passed to allocate()
+        void deallocate(void* p, size_t size) {
+            if (size > max_small_size) {
+                stat.large_objects--;
+                stat.large_bytes -= size;
+                free(p);
+                return;
+            }
+            size_t c = size_class(size);
+            FreeBlock* b = static_cast<FreeBlock*>(p);
+            b->next = free_list[c];
+            free_list[c] = b;
+        }
+
+        const Statistics& statistics()const {
+            return stat;
+        }
+
+    private:
+
+        struct FreeBlock {
+            FreeBlock* next;
+        };
+
+        static size_t size_class(size_t size) {
+            return size == 0 ? 0 : (size - 1) / granularity;
+        }
+        static size_t block_size(size_t c) {
+            return (c + 1) * granularity;
+        }
+
+        // bump-allocate from the current chunk
+        void* carve(size_t size) {
+            if (chunk_cur + size > chunk_end) {
+                char* c = static_cast<char*>(malloc(chunk_size));
+                chunks.push_back(c);
+                stat.chunks++;
+                chunk_cur = c;
+                chunk_end = c + chunk_size;
+            }
+            void* p = chunk_cur;
+            chunk_cur += size;
+            return p;
+        }
+
+        std::vector<FreeBlock*> free_list;
+        std::vector<char*> chunks;
+        char* chunk_cur = nullptr;
+        char* chunk_end = nullptr;
+        Statistics stat;
+    };
+
+}
+
+#endif
@@ -0,0 +1,78 @@
+#include "aotruntime.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <pthread.h>
+#define MINI_AOT_THREAD
+#endif
+
+using namespace mini;
+
+int AotRuntime::run_program(const unsigned char* image, size_t image_size, bool verbose) {
+    IRProgram irprog;
+    BinaryStream bs(reinterpret_cast<const char*>(image), image_size);
+    irprog.deserialize(bs);
+
+    vm.stack.reserve_all();     // translated functions keep pointers into their frames
+    vm.load(irprog);
+    try {
+        run(irprog.entry_index);
+    }
+    catch (const RuntimeError& e) {
+        vm.handle_error(e);
+        vm.error_flag = 1;
+    }
+    if (verbose) {
+        vm.print_gc_statistics(std::cerr);
+    }
+    return vm.error_flag;
+}
+
+int AotRuntime::main(int argc, const char** argv, const unsigned char* image, size_t image_size, const Function* functions) {
+
+    struct Program {
+        const unsigned char* image;
+        size_t image_size;
+        const Function* functions;
+        size_t gc_threshold = MemorySection::default_threshold;
+        bool verbose = false;
+        int exit_code = 1;
+
+        void run() {
+            AotRuntime rt(functions);
+            rt.vm.set_gc_threshold(gc_threshold);
+            exit_code = rt.run_program(image, image_size, verbose);
+        }
+    } program{ image, image_size, functions };
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+            program.gc_threshold = size_t(std::stoul(argv[++i])) << 10;
+        }
+        else if (strcmp(argv[i], "-v") == 0) {
+            program.verbose = true;
+        }
+    }
+
+#ifdef MINI_AOT_THREAD
+    // A call of the program is a call in C++, so the C stack must hold as many frames as the stack of the VM.
+    // Run on a thread whose stack is large enough; it is only reserved, and the pages are used as needed.
+    const size_t c_stack_size = sizeof(void*) >= 8 ? size_t(1) << 30 : size_t(64) << 20;
+    pthread_attr_t attr;
+    pthread_t thread;
+    if (pthread_attr_init(&attr) == 0) {
+        bool started = pthread_attr_setstacksize(&attr, c_stack_size) == 0 &&
+            pthread_create(&thread, &attr, [](void* p) -> void* { static_cast<Program*>(p)->run(); return nullptr; }, &program) == 0;
+        pthread_attr_destroy(&attr);
+        if (started) {
+            pthread_join(thread, nullptr);
+            return program.exit_code;
+        }
+    }
+#endif
+    program.run();
+    return program.exit_code;
+}
@@ -0,0 +1,120 @@
+#ifndef MINI_AOTRUNTIME_H
+#define MINI_AOTRUNTIME_H
+
+#include "vm.h"
+
+#include <cmath>
+#include <utility>
+
+namespace mini {
+
+    // Runtime of a program translated to C++ by CppGenerator. The VM is loaded from the bytecode image
+    // embedded in the program and keeps the heap, the globals, the frames, the native functions and the
+    // tracebacks; its codes are never interpreted. A translated function works on the frame of the VM that
+    // call() has set up and keeps the operand stack in its own variables, writing them to the stack of the VM
+    // only before a code that may look at it (calls, allocations).
+    class AotRuntime {
+    public:
+
+        // Runs the current frame until it returns (returns none) or makes a tail call (returns the function
+        // to go on with, whose frame is already set up).
+        typedef Size_t(*Function)(AotRuntime&);
+
+        static const Size_t none = Size_t(-1);
+
+        // Translated functions, keyed by constant pool index.
+        explicit AotRuntime(const Function* functions) : functions(functions) {}
+
+        // main() of a translated program: load the image, run it and return the exit code.
+        // Options: -g size (as in mini) and -v (print the GC statistics).
+        static int main(int argc, const char** argv, const unsigned char* image, size_t image_size, const Function* functions);
+
+        // Frame of the current function, when it starts; makes room for operand_size elements after its locals.
+        StackElem* frame(Size_t operand_size) {
+            vm.stack.grow(operand_size);
+            vm.stack.shrink(operand_size);
+            return vm.stack.data() + vm.stack.bp;
+        }
+        MemoryObject* globals() {
+            return vm.global_object;
+        }
+        void set_sp(const StackElem* sp) {
+            vm.stack.sp = Size_t(sp - vm.stack.data());
+        }
+        // index of the code being run, plus one (as in the interpreter); for the tracebacks
+        void set_pc(Size_t pc) {
+            vm.pc = pc;
+        }
+
+        // Go on with next, and with the functions it tail-calls, until one returns.
+        void run(Size_t next) {
+            while (next != none) {
+                next = functions[next](*this);
+            }
+        }
+
+        // Set up the frame of a call; the arguments are on the stack top.
+        void call(Size_t f) {
+            vm.call(&vm.functions[f]);
+        }
+        Size_t call_closure(Address addr) {
+            vm.call_closure(addr);
+            return vm.cur_function->index;
+        }
+        Size_t tail_call(Size_t f) {
+            vm.tail_call(&vm.functions[f]);
+            return f;
+        }
+        Size_t tail_call_closure(Address addr) {
+            vm.tail_call_closure(addr);
+            return vm.cur_function->index;
+        }
+        Size_t ret(bool has_value) {
+            vm.ret(has_value);
+            return none;
+        }
+
+        // Allocating codes, on the stack top as in the interpreter; they may collect.
+        void load_constant(Size_t index) {
+            vm.load_constant(vm.irprog->fetch_constant(index)->as<StringConstant>());
+            safe_point();
+        }
+        void allocate_array(Size_t typebit) {
+            vm.allocate_array(vm.stack.pop().iarg, typebit);
+            safe_point();
+        }
+        void allocate_class(Size_t index) {
+            vm.allocate_class(vm.irprog->fetch_constant(index)->as<ClassLayout>(), index);
+            safe_point();
+        }
+        void allocate_closure(Size_t f) {
+            vm.allocate_closure(&vm.functions[f]);
+            safe_point();
+        }
+        void call_native(int index) {
+            vm.call_native(index);
+            safe_point();
+        }
+
+        static int32_t compare(char a, char b) { return a > b ? 1 : (a < b ? -1 : 0); }
+        static int32_t compare(int32_t a, int32_t b) { return a > b ? 1 : (a < b ? -1 : 0); }
+        static int32_t compare(float a, float b) { return a > b ? 1 : (a < b ? -1 : 0); }
+        static int32_t compare(Address a, Address b) { return a > b ? 1 : (a < b ? -1 : 0); }
+
+        VM vm;
+
+    private:
+
+        void safe_point() {
+            if (vm.heap.collect_requested()) vm.collect_garbage();
+        }
+
+        // Load and run from the entry; returns the exit code.
+        int run_program(const unsigned char* image, size_t image_size, bool verbose);
+
+        const Function* functions;
+    };
+
+}
+
+#endif
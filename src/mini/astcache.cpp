@@ -0,0 +1,555 @@
+#include "astcache.h"
+#include "fileloader.h"
+
+#include <random>
+#include <unordered_map>
+
+using namespace mini;
+
+static uint64_t fnv1a(const std::string& s) {
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : s) {
+        h = (h ^ c) * 1099511628211ull;
+    }
+    return h;
+}
+
+// Node tags besides AST::Type_t
+static const uint8_t NULL_NODE = 0xff;
+static const uint8_t SEEN_NODE = 0xfe;      // followed by the index of a node already written
+
+// srcno of the file being written, which gets another number when the entry is used
+static const uint32_t THIS_FILE = 0xfffffffe;
+
+// Writes the AST as produced by the parser; attributes filled later are not kept. A node or symbol
+// shared by several parents is written once and shared again when read.
+class ASTWriter {
+public:
+
+    ASTWriter(BinaryStream& bs, unsigned file_no) : bs(bs), file_no(file_no) {}
+
+    void write_info(const SymbolInfo& info) {
+        bs.write(uint32_t(info.location.srcno == file_no ? THIS_FILE : info.location.srcno));
+        bs.write(uint32_t(info.location.lineno)).write(uint32_t(info.location.colno)).write(uint32_t(info.section_index));
+    }
+
+    void write_symbol(const pSymbol& symbol) {
+        if (!symbol) {
+            bs.write(uint8_t(NULL_NODE));
+            return;
+        }
+        auto r = seen_symbols.find(symbol.get());
+        if (r != seen_symbols.end()) {
+            bs.write(uint8_t(SEEN_NODE)).write(r->second);
+            return;
+        }
+        seen_symbols.insert({ symbol.get(), Size_t(seen_symbols.size()) });
+        bs.write(uint8_t(0)).write_string(symbol->get_name());
+        write_info(symbol->get_info());
+    }
+
+    void write_constant(const Constant& c) {
+        bs.write(uint8_t(c.get_type()));
+        switch (c.get_type())
+        {
+        case Constant::Type_t::NIL: break;
+        case Constant::Type_t::BOOL: bs.write(uint8_t(std::get<bool>(c.data))); break;
+        case Constant::Type_t::CHAR: bs.write(std::get<char>(c.data)); break;
+        case Constant::Type_t::INT: bs.write(int32_t(std::get<int>(c.data))); break;
+        case Constant::Type_t::FLOAT: bs.write(std::get<float>(c.data)); break;
+        case Constant::Type_t::STRING: bs.write_string(std::get<std::string>(c.data)); break;
+        }
+    }
+
+    template<typename T>
+    void write_nodes(const std::vector<Ptr<T>>& nodes) {
+        bs.write(Size_t(nodes.size()));
+        for (const auto& n : nodes) write_node(n.get());
+    }
+
+    void write_quantifiers(const std::vector<std::pair<pSymbol, Ptr<TypeNode>>>& args) {
+        bs.write(Size_t(args.size()));
+        for (const auto& a : args) {
+            write_symbol(a.first);
+            write_node(a.second.get());
+        }
+    }
+
+    void write_node(const AST* node) {
+        if (!node) {
+            bs.write(uint8_t(NULL_NODE));
+            return;
+        }
+        auto r = seen_nodes.find(node);
+        if (r != seen_nodes.end()) {
+            bs.write(uint8_t(SEEN_NODE)).write(r->second);
+            return;
+        }
+        seen_nodes.insert({ node, Size_t(seen_nodes.size()) });
+        bs.write(uint8_t(node->get_type()));
+        write_info(node->get_info());
+
+        switch (node->get_type())
+        {
+        case AST::CONSTANT: write_constant(node->as<ConstantNode>()->value); break;
+        case AST::VAR: write_symbol(node->as<VarNode>()->symbol); break;
+        case AST::TUPLE: write_nodes(node->as<TupleNode>()->children); break;
+        case AST::ARRAY: write_nodes(node->as<ArrayNode>()->children); break;
+        case AST::STRUCT: {
+            auto m = node->as<StructNode>();
+            bs.write(Size_t(m->children.size()));
+            for (const auto& c : m->children) {
+                write_symbol(c.first);
+                write_node(c.second.get());
+            }
+            break;
+        }
+        case AST::LAMBDA: {
+            auto m = node->as<LambdaNode>();
+            write_node(m->ret_type.get());
+            write_quantifiers(m->quantifiers);
+            write_quantifiers(m->args);
+            write_nodes(m->statements);
+            break;
+        }
+        case AST::FUNCALL: {
+            auto m = node->as<FunCallNode>();
+            write_node(m->caller.get());
+            write_nodes(m->args);
+            bs.write(uint8_t(m->is_constructor));
+            break;
+        }
+        case AST::GETFIELD: {
+            auto m = node->as<GetFieldNode>();
+            write_node(m->lhs.get());
+            write_symbol(m->field);
+            break;
+        }
+        case AST::NEW: {
+            auto m = node->as<NewNode>();
+            write_symbol(m->symbol);
+            write_node(m->self_arg.get());
+            write_nodes(m->type_args);
+            break;
+        }
+        case AST::CASE: {
+            auto m = node->as<CaseNode>();
+            write_node(m->lhs.get());
+            bs.write(Size_t(m->cases.size()));
+            for (const auto& c : m->cases) {
+                write_node(c.condition.get());
+                write_node(c.guard.get());
+                write_node(c.expr.get());
+            }
+            break;
+        }
+        case AST::TYPE: {
+            auto m = node->as<TypeNode>();
+            write_symbol(m->symbol);
+            write_nodes(m->args);
+            write_quantifiers(m->quantifiers);
+            break;
+        }
+        case AST::TYPEAPPL: {
+            auto m = node->as<TypeApplNode>();
+            write_node(m->lhs.get());
+            write_nodes(m->args);
+            break;
+        }
+        case AST::LET: {
+            auto m = node->as<LetNode>();
+            write_symbol(m->symbol);
+            write_node(m->vtype.get());
+            write_node(m->expr.get());
+            bs.write(uint8_t(m->has_init));
+            break;
+        }
+        case AST::SET: {
+            auto m = node->as<SetNode>();
+            write_node(m->lhs.get());
+            write_node(m->expr.get());
+            break;
+        }
+        case AST::CLASS: {
+            auto m = node->as<ClassNode>();
+            write_symbol(m->symbol);
+            write_node(m->base.get());
+            write_nodes(m->interfaces);
+            bs.write(Size_t(m->members.size()));
+            for (const auto& c : m->members) {
+                write_node(c.first.get());
+                bs.write(uint8_t(c.second.is_static)).write(uint8_t(c.second.is_virtual));
+            }
+            write_node(m->constructor.get());
+            break;
+        }
+        case AST::INTERFACE: {
+            auto m = node->as<InterfaceNode>();
+            write_symbol(m->symbol);
+            write_nodes(m->members);
+            bs.write(Size_t(m->parents.size()));
+            for (const auto& p : m->parents) write_symbol(p);
+            break;
+        }
+        case AST::IMPORT: {
+            auto m = node->as<ImportNode>();
+            bs.write(Size_t(m->symbols.size()));
+            for (const auto& s : m->symbols) write_symbol(s);
+            break;
+        }
+        default:
+            throw std::runtime_error("Cannot cache the AST node");
+        }
+    }
+
+    // nodes written so far
+    size_t node_count()const {
+        return seen_nodes.size();
+    }
+
+private:
+
+    BinaryStream& bs;
+    unsigned file_no;
+    std::unordered_map<const void*, Size_t> seen_nodes;
+    std::unordered_map<const void*, Size_t> seen_symbols;
+};
+
+// Reads what ASTWriter wrote. Anything malformed raises an IOError.
+class ASTReader {
+public:
+
+    ASTReader(BinaryStream& bs, unsigned file_no) : bs(bs), file_no(file_no) {}
+
+    SymbolInfo read_info() {
+        SymbolInfo info;
+        uint32_t srcno = bs.read<uint32_t>();
+        info.location.srcno = srcno == THIS_FILE ? file_no : srcno;
+        info.location.lineno = bs.read<uint32_t>();
+        info.location.colno = bs.read<uint32_t>();
+        info.section_index = bs.read<uint32_t>();
+        return info;
+    }
+
+    pSymbol read_symbol() {
+        switch (bs.read<uint8_t>())
+        {
+        case NULL_NODE: return nullptr;
+        case SEEN_NODE: {
+            Size_t index = bs.read<Size_t>();
+            if (index >= symbols.size()) malformed();
+            return symbols[index];
+        }
+        case 0: {
+            std::string name = bs.read_string();
+            symbols.push_back(std::make_shared<Symbol>(name, read_info()));
+            return symbols.back();
+        }
+        default:
+            malformed();
+            return nullptr;
+        }
+    }
+
+    Constant read_constant() {
+        switch (Constant::Type_t(bs.read<uint8_t>()))
+        {
+        case Constant::Type_t::NIL: return Constant();
+        case Constant::Type_t::BOOL: return Constant(bs.read<uint8_t>() != 0);
+        case Constant::Type_t::CHAR: return Constant(bs.read<char>());
+        case Constant::Type_t::INT: return Constant(int(bs.read<int32_t>()));
+        case Constant::Type_t::FLOAT: return Constant(bs.read<float>());
+        case Constant::Type_t::STRING: return Constant(bs.read_string());
+        default:
+            malformed();
+            return Constant();
+        }
+    }
+
+    // a node of type T or null; the check tells whether a node can be cast to T
+    template<typename T>
+    Ptr<T> read_as(bool (*check)(const AST*)) {
+        pAST node = read_node();
+        if (node && !check(node.get())) malformed();
+        return std::static_pointer_cast<T>(node);
+    }
+
+    Ptr<ExprNode> read_expr() {
+        return read_as<ExprNode>([](const AST* n) { return n->is_expr(); });
+    }
+    Ptr<TypeNode> read_type() {
+        return read_as<TypeNode>([](const AST* n) { return n->get_type() == AST::TYPE; });
+    }
+    Ptr<LetNode> read_let() {
+        return read_as<LetNode>([](const AST* n) { return n->get_type() == AST::LET; });
+    }
+
+    template<typename T>
+    void read_nodes(std::vector<Ptr<T>>& nodes, Ptr<T>(ASTReader::* read)()) {
+        nodes.resize(bs.read_count(1));
+        for (auto& n : nodes) n = (this->*read)();
+    }
+
+    void read_quantifiers(std::vector<std::pair<pSymbol, Ptr<TypeNode>>>& args) {
+        args.resize(bs.read_count(2));
+        for (auto& a : args) {
+            a.first = read_symbol();
+            a.second = read_type();
+        }
+    }
+
+    pAST read_any() {
+        return read_node();
+    }
+
+    pAST read_node() {
+        uint8_t tag = bs.read<uint8_t>();
+        if (tag == NULL_NODE) {
+            return nullptr;
+        }
+        if (tag == SEEN_NODE) {
+            Size_t index = bs.read<Size_t>();
+            if (index >= nodes.size()) malformed();
+            return nodes[index];
+        }
+
+        pAST node = create(tag);
+        nodes.push_back(node);
+        node->set_info(read_info());
+
+        switch (node->get_type())
+        {
+        case AST::CONSTANT: ast_cast<ConstantNode>(node)->value = read_constant(); break;
+        case AST::VAR: ast_cast<VarNode>(node)->symbol = read_symbol(); break;
+        case AST::TUPLE: read_nodes(ast_cast<TupleNode>(node)->children, &ASTReader::read_expr); break;
+        case AST::ARRAY: read_nodes(ast_cast<ArrayNode>(node)->children, &ASTReader::read_expr); break;
+        case AST::STRUCT: {
+            auto m = ast_cast<StructNode>(node);
+            m->children.resize(bs.read_count(2));
+            for (auto& c : m->children) {
+                c.first = read_symbol();
+                c.second = read_expr();
+            }
+            break;
+        }
+        case AST::LAMBDA: {
+            auto m = ast_cast<LambdaNode>(node);
+            m->ret_type = read_type();
+            read_quantifiers(m->quantifiers);
+            read_quantifiers(m->args);
+            read_nodes(m->statements, &ASTReader::read_any);
+            break;
+        }
+        case AST::FUNCALL: {
+            auto m = ast_cast<FunCallNode>(node);
+            m->caller = read_expr();
+            read_nodes(m->args, &ASTReader::read_expr);
+            m->is_constructor = bs.read<uint8_t>() != 0;
+            break;
+        }
+        case AST::GETFIELD: {
+            auto m = ast_cast<GetFieldNode>(node);
+            m->lhs = read_expr();
+            m->field = read_symbol();
+            break;
+        }
+        case AST::NEW: {
+            auto m = ast_cast<NewNode>(node);
+            m->symbol = read_symbol();
+            m->self_arg = read_as<VarNode>([](const AST* n) { return n->get_type() == AST::VAR; });
+            read_nodes(m->type_args, &ASTReader::read_type);
+            break;
+        }
+        case AST::CASE: {
+            auto m = ast_cast<CaseNode>(node);
+            m->lhs = read_expr();
+            m->cases.resize(bs.read_count(3));
+            for (auto& c : m->cases) {
+                c.condition = read_expr();
+                c.guard = read_expr();
+                c.expr = read_expr();
+            }
+            break;
+        }
+        case AST::TYPE: {
+            auto m = ast_cast<TypeNode>(node);
+            m->symbol = read_symbol();
+            read_nodes(m->args, &ASTReader::read_type);
+            read_quantifiers(m->quantifiers);
+            break;
+        }
+        case AST::TYPEAPPL: {
+            auto m = ast_cast<TypeApplNode>(node);
+            m->lhs = read_expr();
+            read_nodes(m->args, &ASTReader::read_type);
+            break;
+        }
+        case AST::LET: {
+            auto m = ast_cast<LetNode>(node);
+            m->symbol = read_symbol();
+            m->vtype = read_type();
+            m->expr = read_expr();
+            m->has_init = bs.read<uint8_t>() != 0;
+            break;
+        }
+        case AST::SET: {
+            auto m = ast_cast<SetNode>(node);
+            m->lhs = read_expr();
+            m->expr = read_expr();
+            break;
+        }
+        case AST::CLASS: {
+            auto m = ast_cast<ClassNode>(node);
+            m->symbol = read_symbol();
+            m->base = read_type();
+            read_nodes(m->interfaces, &ASTReader::read_type);
+            m->members.resize(bs.read_count(3));
+            for (auto& c : m->members) {
+                c.first = read_let();
+                c.second.is_static = bs.read<uint8_t>() != 0;
+                c.second.is_virtual = bs.read<uint8_t>() != 0;
+            }
+            m->constructor = read_as<LambdaNode>([](const AST* n) { return n->get_type() == AST::LAMBDA; });
+            break;
+        }
+        case AST::INTERFACE: {
+            auto m = ast_cast<InterfaceNode>(node);
+            m->symbol = read_symbol();
+            read_nodes(m->members, &ASTReader::read_let);
+            m->parents.resize(bs.read_count(1));
+            for (auto& p : m->parents) p = read_symbol();
+            break;
+        }
+        case AST::IMPORT: {
+            auto m = ast_cast<ImportNode>(node);
+            m->symbols.resize(bs.read_count(1));
+            for (auto& s : m->symbols) s = read_symbol();
+            break;
+        }
+        default:
+            malformed();
+        }
+        return node;
+    }
+
+private:
+
+    static pAST create(uint8_t tag) {
+        switch (tag)
+        {
+        case AST::CONSTANT: return std::make_shared<ConstantNode>();
+        case AST::VAR: return std::make_shared<VarNode>();
+        case AST::TUPLE: return std::make_shared<TupleNode>();
+        case AST::STRUCT: return std::make_shared<StructNode>();
+        case AST::ARRAY: return std::make_shared<ArrayNode>();
+        case AST::LAMBDA: return std::make_shared<LambdaNode>();
+        case AST::FUNCALL: return std::make_shared<FunCallNode>();
+        case AST::GETFIELD: return std::make_shared<GetFieldNode>();
+        case AST::NEW: return std::make_shared<NewNode>();
+        case AST::CASE: return std::make_shared<CaseNode>();
+        case AST::TYPE: return std::make_shared<TypeNode>();
+        case AST::TYPEAPPL: return std::make_shared<TypeApplNode>();
+        case AST::LET: return std::make_shared<LetNode>();
+        case AST::SET: return std::make_shared<SetNode>();
+        case AST::CLASS: return std::make_shared<ClassNode>();
+        case AST::INTERFACE: return std::make_shared<InterfaceNode>();
+        case AST::IMPORT: return std::make_shared<ImportNode>();
+        default:
+            malformed();
+            return nullptr;
+        }
+    }
+
+    [[noreturn]] static void malformed() {
+        throw IOError("Malformed module cache entry");
+    }
+
+    BinaryStream& bs;
+    unsigned file_no;
+    std::vector<pAST> nodes;
+    std::vector<pSymbol> symbols;
+};
+
+
+std::filesystem::path ModuleCache::entry_path(const std::string& canonical_name)const {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.mast", (unsigned long long)fnv1a(canonical_name));
+    return directory / name;
+}
+
+bool ModuleCache::load(const std::string& canonical_name, const std::string& source, unsigned file_no, std::vector<pAST>& ast_buffer) {
+    std::vector<pAST> entry_nodes;
+    try {
+        BinaryStream bs;
+        FileLoader::read_binary_file(entry_path(canonical_name).string(), bs.buffer);
+        if (bs.read<uint32_t>() != cache_magic || bs.read<uint32_t>() != cache_version
+            || bs.read_string() != canonical_name || bs.read<uint64_t>() != uint64_t(source.size())
+            || bs.read<uint64_t>() != fnv1a(source)) {
+            misses++;
+            return false;
+        }
+        ASTReader reader(bs, file_no);
+        entry_nodes.resize(bs.read_count(1));
+        for (auto& n : entry_nodes) {
+            n = reader.read_node();
+            if (!n) throw IOError("Malformed module cache entry");
+        }
+        if (!bs.eof()) throw IOError("Malformed module cache entry");
+    }
+    catch (const IOError&) {        // no entry, or a broken one that the next store replaces
+        misses++;
+        return false;
+    }
+    ast_buffer.insert(ast_buffer.end(), entry_nodes.begin(), entry_nodes.end());
+    hits++;
+    return true;
+}
+
+void ModuleCache::store(const std::string& canonical_name, const std::string& source, unsigned file_no, const std::vector<pAST>& ast_buffer) {
+    BinaryStream bs;
+    bs.write(cache_magic).write(cache_version).write_string(canonical_name);
+    bs.write(uint64_t(source.size())).write(fnv1a(source));
+    ASTWriter writer(bs, file_no);
+    bs.write(Size_t(ast_buffer.size()));
+    try {
+        for (const auto& n : ast_buffer) {
+            writer.write_node(n.get());
+        }
+    }
+    catch (const std::runtime_error&) {
+        return;
+    }
+
+    // written aside and renamed, so that another process never reads a partial entry
+    std::error_code ec;
+    std::filesystem::create_directories(directory, ec);
+    auto path = entry_path(canonical_name);
+    auto temp_path = path;
+    temp_path += ".tmp" + std::to_string(std::random_device()());
+    try {
+        FileLoader::write_binary_file(temp_path.string(), bs.buffer);
+    }
+    catch (const IOError&) {
+        std::filesystem::remove(temp_path, ec);
+        return;
+    }
+    std::filesystem::rename(temp_path, path, ec);
+    if (ec) std::filesystem::remove(temp_path, ec);
+}
+
+size_t ModuleCache::count_nodes(const std::vector<pAST>& ast_buffer) {
+    BinaryStream bs;
+    ASTWriter writer(bs, 0);
+    try {
+        for (const auto& n : ast_buffer) {
+            writer.write_node(n.get());
+        }
+    }
+    catch (const std::runtime_error&) {
+    }
+    return writer.node_count();
+}
+
+void ModuleCache::print_statistics(std::ostream& os)const {
+    os << "Module cache: " << hits << " hits, " << misses << " misses (" << directory.string() << ")\n";
+}
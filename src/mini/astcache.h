@@ -0,0 +1,46 @@
+#ifndef MINI_ASTCACHE_H
+#define MINI_ASTCACHE_H
+
+#include "ast.h"
+#include "ir.h"
+
+#include <filesystem>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace mini {
+
+    // On-disk cache of parsed modules. An entry is keyed by the canonical name of a file and holds the AST
+    // parsed from it; it is used only if the content hash of the file and the cache version still match.
+    class ModuleCache {
+    public:
+
+        static constexpr uint32_t cache_magic = 0x5453414d;    // "MAST"
+        static constexpr uint32_t cache_version = 1;            // bump when the AST or the parser changes
+
+        explicit ModuleCache(const std::filesystem::path& directory) : directory(directory) {}
+
+        // Fill ast_buffer with the cached AST of the file; returns false if there is no valid entry.
+        bool load(const std::string& canonical_name, const std::string& source, unsigned file_no, std::vector<pAST>& ast_buffer);
+
+        // Write the entry of the file. Failures are ignored, as the cache is only a shortcut.
+        void store(const std::string& canonical_name, const std::string& source, unsigned file_no, const std::vector<pAST>& ast_buffer);
+
+        void print_statistics(std::ostream& os)const;
+
+        // Number of distinct nodes in ast_buffer, as an entry would hold them.
+        static size_t count_nodes(const std::vector<pAST>& ast_buffer);
+
+    private:
+
+        std::filesystem::path entry_path(const std::string& canonical_name)const;
+
+        std::filesystem::path directory;
+        size_t hits = 0;
+        size_t misses = 0;
+    };
+
+}
+
+#endif
@@ -235,115 +235,127 @@ Ptr<ExprNode> make_builtin_funcall_node(const std::string& name, const SymbolInf
 }
 
 
-Ptr<LambdaNode> Attributor::process_case_branch(const CaseNode::Case& m_case, const pSymbol& arg_name, const pSymbol& previous_branch_name, const pType& arg_type, bool is_last_one) {
+Ptr<ExprNode> Attributor::process_case_branch(const CaseNode::Case& m_case, const pSymbol& arg_name, const Ptr<ExprNode>& next_branch, const pType& arg_type, bool is_last_one) {
 
     const auto& condition_info = m_case.condition->get_info();
 
-    auto m_node = std::make_shared<LambdaNode>();
-    m_node->set_info(condition_info);
-    Ptr<ExprNode> condition_expr = nullptr;
-    Ptr<ExprNode> arg_var_node = std::make_shared<VarNode>(
-        std::make_shared<Symbol>(arg_name->get_name(), m_case.condition->get_info())
-        );  // This cannot be attributed, since it may be binded.
-
-    switch (m_case.condition->get_type())
-    {
-    case AST::Type_t::VAR: {        // let var = lhs_var
-        m_node->statements.push_back(make_let_node(m_case.condition->as<VarNode>()->symbol, arg_var_node));
-        break;
-    }
-    case AST::Type_t::CONSTANT: {   // lhs_var.eq(constant)
-        condition_expr = make_equal_node(arg_var_node, m_case.condition);
-        break;
-    }
-    case AST::Type_t::TUPLE: {      // structure binding
-        if (!arg_type->is_primitive() || arg_type->as<PrimitiveType>()->type_name() != PrimitiveTypeMetaData::TUPLE) {
-            m_case.condition->get_info().throw_exception(StringAssembler("Not a tuple type: ")(*arg_type)());
+    // The pattern is expanded into tests (the returned condition) and bindings (lets). Bindings are needed by both
+    // the guard and the expression, which live in different lambdas; since an AST node cannot be attributed in two
+    // scopes, the pattern is expanded again for each of them.
+    auto expand_pattern = [&](std::vector<pAST>& lets) -> Ptr<ExprNode> {
+        Ptr<ExprNode> condition_expr = nullptr;
+        auto arg_var_node = [&]() -> Ptr<ExprNode> {
+            return std::make_shared<VarNode>(
+                std::make_shared<Symbol>(arg_name->get_name(), m_case.condition->get_info())
+                );  // This cannot be attributed, since it may be binded.
+        };
+
+        switch (m_case.condition->get_type())
+        {
+        case AST::Type_t::VAR: {        // let var = lhs_var
+            lets.push_back(make_let_node(m_case.condition->as<VarNode>()->symbol, arg_var_node()));
+            break;
         }
-
-        auto tuple_type = arg_type->as<PrimitiveType>();
-        if (tuple_type->args.size() != m_case.condition->as<TupleNode>()->children.size()) {
-            condition_info.throw_exception(
-                StringAssembler("Number of elements not match: Expect ")(tuple_type->args.size())(", got ")(m_case.condition->as<TupleNode>()->children.size())());
+        case AST::Type_t::CONSTANT: {   // lhs_var.eq(constant)
+            condition_expr = make_equal_node(arg_var_node(), m_case.condition);
+            break;
         }
+        case AST::Type_t::TUPLE: {      // structure binding
+            if (!arg_type->is_primitive() || arg_type->as<PrimitiveType>()->type_name() != PrimitiveTypeMetaData::TUPLE) {
+                m_case.condition->get_info().throw_exception(StringAssembler("Not a tuple type: ")(*arg_type)());
+            }
 
-        for (int i = 0; i < tuple_type->args.size(); i++) {
-            auto& child = m_case.condition->as<TupleNode>()->children[i];
-            auto get_node = make_builtin_funcall_node("@get", child->get_info(), tuple_type->args[i], 
-                { arg_var_node, std::make_shared<ConstantNode>(Constant(i), child->get_info())}, symbol_table);  // get<TYPE>(lhs_var, i)
-
-            if (child->get_type() == AST::Type_t::VAR) {    // let child = get<TYPE>(lhs_var, i);
-                m_node->statements.push_back(make_let_node(child->as<VarNode>()->symbol, get_node));
+            auto tuple_type = arg_type->as<PrimitiveType>();
+            if (tuple_type->args.size() != m_case.condition->as<TupleNode>()->children.size()) {
+                condition_info.throw_exception(
+                    StringAssembler("Number of elements not match: Expect ")(tuple_type->args.size())(", got ")(m_case.condition->as<TupleNode>()->children.size())());
             }
-            else if (child->get_type() == AST::Type_t::CONSTANT) {  // condition_expr = and(condition_expr, get<TYPE>(lhs_var, i).eq(child))
-                auto equal_node = make_equal_node(get_node, child);
-                if (condition_expr) {
-                    auto m = make_builtin_funcall_node("and", child->get_info(), { condition_expr, equal_node}, symbol_table);
-                    condition_expr.swap(m);
+
+            for (int i = 0; i < tuple_type->args.size(); i++) {
+                auto& child = m_case.condition->as<TupleNode>()->children[i];
+                auto get_node = make_builtin_funcall_node("@get", child->get_info(), tuple_type->args[i], 
+                    { arg_var_node(), std::make_shared<ConstantNode>(Constant(i), child->get_info())}, symbol_table);  // get<TYPE>(lhs_var, i)
+
+                if (child->get_type() == AST::Type_t::VAR) {    // let child = get<TYPE>(lhs_var, i);
+                    lets.push_back(make_let_node(child->as<VarNode>()->symbol, get_node));
+                }
+                else if (child->get_type() == AST::Type_t::CONSTANT) {  // condition_expr = and(condition_expr, get<TYPE>(lhs_var, i).eq(child))
+                    auto equal_node = make_equal_node(get_node, child);
+                    if (condition_expr) {
+                        auto m = make_builtin_funcall_node("and", child->get_info(), { condition_expr, equal_node}, symbol_table);
+                        condition_expr.swap(m);
+                    }
+                    else {
+                        condition_expr = equal_node;
+                    }
                 }
                 else {
-                    condition_expr = equal_node;
+                    child->get_info().throw_exception("Unrecognized structure binding");
                 }
             }
-            else {
-                child->get_info().throw_exception("Unrecognized structure binding");
-            }
+            break;
         }
-        break;
-    }
-    case AST::Type_t::STRUCT: {
-        // we don't check the type of getfield. will leave that to getfield.
-        for (const auto& [m_field, child] : m_case.condition->as<StructNode>()->children) {
-            auto get_node = std::make_shared<GetFieldNode>(condition_info, arg_var_node, m_field);   // lhs_var.m_field
-            if (child->get_type() == AST::Type_t::VAR) {  // let child = lhs_var.m_field
-                m_node->statements.push_back(make_let_node(child->as<VarNode>()->symbol, get_node));
-            }
-            else if (child->get_type() == AST::Type_t::CONSTANT) {  // condition_expr = and(condition_expr, lhs_var.m_field.eq(child))
-                auto equal_node = make_equal_node(get_node, child);
-                if (condition_expr) {
-                    auto m = make_builtin_funcall_node("and", child->get_info(), { condition_expr, equal_node }, symbol_table);
-                    condition_expr.swap(m);
+        case AST::Type_t::STRUCT: {
+            // we don't check the type of getfield. will leave that to getfield.
+            for (const auto& [m_field, child] : m_case.condition->as<StructNode>()->children) {
+                auto get_node = std::make_shared<GetFieldNode>(condition_info, arg_var_node(), m_field);   // lhs_var.m_field
+                if (child->get_type() == AST::Type_t::VAR) {  // let child = lhs_var.m_field
+                    lets.push_back(make_let_node(child->as<VarNode>()->symbol, get_node));
+                }
+                else if (child->get_type() == AST::Type_t::CONSTANT) {  // condition_expr = and(condition_expr, lhs_var.m_field.eq(child))
+                    auto equal_node = make_equal_node(get_node, child);
+                    if (condition_expr) {
+                        auto m = make_builtin_funcall_node("and", child->get_info(), { condition_expr, equal_node }, symbol_table);
+                        condition_expr.swap(m);
+                    }
+                    else {
+                        condition_expr = equal_node;
+                    }
                 }
                 else {
-                    condition_expr = equal_node;
+                    child->get_info().throw_exception("Unrecognized structure binding");
                 }
             }
-            else {
-                child->get_info().throw_exception("Unrecognized structure binding");
-            }
+            break;
+        }
+        default:
+            condition_info.throw_exception("Invalid case expression. Must be id/constant/tuple/struct");
+        }
+        return condition_expr;
+    };
+
+    std::vector<pAST> expr_statements;
+    Ptr<ExprNode> condition_expr = expand_pattern(expr_statements);
+    expr_statements.push_back(m_case.expr);
+    auto br_lhs = std::make_shared<LambdaNode>(condition_info, expr_statements);    // \->{bindings, expr}
+
+    if (m_case.guard) {
+        std::vector<pAST> guard_statements;
+        expand_pattern(guard_statements);
+        guard_statements.push_back(m_case.guard);
+        auto cond_lhs = std::make_shared<LambdaNode>(m_case.guard->get_info(), guard_statements);   // \->{bindings, guard}
+
+        if (!condition_expr) {      // (\->_case.guard)()
+            condition_expr = std::make_shared<FunCallNode>(m_case.guard->get_info(), cond_lhs, std::vector<Ptr<ExprNode>>{});
+        }
+        else {      // sel(condition_expr, \->_case.guard, \->False)()
+            auto cond_rhs = std::make_shared<LambdaNode>(m_case.guard->get_info(), std::vector<pAST>{
+                VarNode::make_attributed(symbol_table->find_var("False"), m_case.guard->get_info())
+            });
+            auto sel_call = make_builtin_funcall_node("sel", m_case.guard->get_info(), { condition_expr, cond_lhs, cond_rhs }, symbol_table);
+            condition_expr = std::make_shared<FunCallNode>(m_case.guard->get_info(), sel_call, std::vector<Ptr<ExprNode>>{});
         }
-        break;
-    }
-    default:
-        condition_info.throw_exception("Invalid case expression. Must be id/constant/tuple/struct");
-    }
-
-    if (m_case.guard && !condition_expr) {
-        condition_expr = m_case.guard;
-    }
-    else if (m_case.guard) {    // sel(condition_expr, \->_case.guard, \->False)()
-        auto cond_lhs = std::make_shared<LambdaNode>(m_case.guard->get_info(), std::vector<pAST>{ m_case.guard });
-        auto cond_rhs = std::make_shared<LambdaNode>(m_case.guard->get_info(), std::vector<pAST>{
-            VarNode::make_attributed(symbol_table->find_var("False"), m_case.guard->get_info())
-        });
-        auto sel_call = make_builtin_funcall_node("sel", m_case.guard->get_info(), {condition_expr, cond_lhs, cond_rhs}, symbol_table);
-        Ptr<ExprNode> sel = std::make_shared<FunCallNode>(m_case.guard->get_info(), sel_call, std::vector<Ptr<ExprNode>>{});
-        condition_expr.swap(sel);
     }
 
     if (condition_expr) {
-        /* final_expr = sel(condition_expr, \->expr, next_case )() */
-        auto br_lhs = std::make_shared<LambdaNode>(condition_info, std::vector<pAST>{m_case.expr});
-        auto br_rhs = std::make_shared<VarNode>(previous_branch_name);
-        br_rhs->set_info(condition_info);
-        auto sel_call = make_builtin_funcall_node("sel", condition_info, { condition_expr, br_lhs, br_rhs }, symbol_table);
-        m_node->statements.push_back(std::make_shared<FunCallNode>(condition_info, sel_call, std::vector<Ptr<ExprNode>>{}));
+        /* final_expr = sel(condition_expr, \->expr, next_branch)() */
+        auto sel_call = make_builtin_funcall_node("sel", condition_info, { condition_expr, br_lhs, next_branch }, symbol_table);
+        return std::make_shared<FunCallNode>(condition_info, sel_call, std::vector<Ptr<ExprNode>>{});
     }
     else {  // then that's it -- it always matched.
-        m_node->statements.push_back(m_case.expr);
         if (!is_last_one) {
             condition_info.throw_exception("Next cases will be unreachable");
         }
+        return std::make_shared<FunCallNode>(condition_info, br_lhs, std::vector<Ptr<ExprNode>>{});
     }
-    return m_node;
 }
\ No newline at end of file
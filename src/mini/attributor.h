@@ -429,17 +429,20 @@ namespace mini {
 
         void process_case(CaseNode* m_node) {
             
-            /* The process of case expressions has two stages: (1) split it into separated lambdas;
-            (2) process these lambdas. Here I use (sort of) CPS style to write this -- each lambda looks like
-            \ -> sel(condition, present, future)();
-            All the statements are then moved into a lambda so finally it looks like as a single function call
+            /* The process of case expressions has two stages: (1) split it into nested branches;
+            (2) process the resulting lambda. Here I use (sort of) CPS style to write this -- each branch looks like
+            sel(condition, present, future)(), where future is a nullary lambda holding the next branch.
+            Pattern variables are bound inside the guard and present lambdas only, so they never leak into later cases.
+            All the branches are then moved into a lambda so finally it looks like as a single function call
                 \n:T->{
-                    let Sn = \->sel<function(T)>(Cn, \->En, undefined)(),
-                    ...
-                    let S2 = \->sel<function(T)>(C2, \->E2, S3)(),
-                    let S1 = \->sel<function(T)>(C1, \->E1, S2)(),
-                    S1()
+                    sel<function(T)>(C1, \->E1, \->
+                        sel<function(T)>(C2, \->E2, \->
+                            ...
+                                sel<function(T)>(Cn, \->En, undefined)()
+                        )()
+                    )()
                 }(expr)
+            The code generator turns such sel calls into conditional jumps and inlines the lambdas.
             */
 
             auto m_lambda_node = std::make_shared<LambdaNode>();
@@ -455,19 +458,18 @@ namespace mini {
             }
 
             if (!m_node->cases.empty()) {
-                pSymbol previous_branch_name = std::make_shared<Symbol>("undefined", m_node->get_info());
-                int case_id = m_node->cases.size();
+                Ptr<ExprNode> next_branch = std::make_shared<VarNode>(std::make_shared<Symbol>("undefined", m_node->get_info()));
                 for (auto m_case = m_node->cases.rbegin(); m_case != m_node->cases.rend(); m_case++) { 
-                    // let current_case = m_case_branch [which uses previous_case];
-
-                    auto m_branch = process_case_branch(*m_case, arg_name, previous_branch_name, arg_type, m_case == m_node->cases.rbegin());
-                    auto m_branch_name = std::make_shared<Symbol>("case#" + std::to_string(case_id--), m_node->get_info());
-                    auto m_assignment = std::make_shared<LetNode>(m_case->condition->get_info(), m_branch_name, nullptr, m_branch);
-                    m_lambda_node->statements.push_back(m_assignment);
-                    previous_branch_name.swap(m_branch_name);
+                    // current_branch = sel(condition, \->expr, \->next_branch)()
+                    auto m_branch = process_case_branch(*m_case, arg_name, next_branch, arg_type, m_case == m_node->cases.rbegin());
+                    if (m_case + 1 != m_node->cases.rend()) {
+                        next_branch = std::make_shared<LambdaNode>(m_case->condition->get_info(), std::vector<pAST>{ m_branch });
+                    }
+                    else {
+                        next_branch = m_branch;
+                    }
                 }
-                m_lambda_node->statements.push_back(std::make_shared<FunCallNode>(previous_branch_name->get_info(),
-                    std::make_shared<VarNode>(previous_branch_name), std::vector<Ptr<ExprNode>>{}));   // current_case()
+                m_lambda_node->statements.push_back(next_branch);
 
                 auto m_funcall = std::make_shared<FunCallNode>(m_node->get_info(), m_lambda_node, std::vector<Ptr<ExprNode>>{m_node->lhs}); // <lambda>(expr)
                 process_funcall(m_funcall.get());
@@ -480,7 +482,7 @@ namespace mini {
         }
 
         // Desugaring of case statements. No type attribution here.
-        Ptr<LambdaNode> process_case_branch(const CaseNode::Case& m_case, const pSymbol& arg_name, const pSymbol& previous_branch_name, 
+        Ptr<ExprNode> process_case_branch(const CaseNode::Case& m_case, const pSymbol& arg_name, const Ptr<ExprNode>& next_branch, 
             const pType& arg_type, bool is_last_one);
 
         void process_let(LetNode* m_node) {
@@ -512,6 +514,7 @@ namespace mini {
 
             // usually we need an initialization; unless it's a system lib function
             m_node->ref->has_assigned = (m_node->expr != nullptr);
+            if (m_node->expr) m_node->ref->assignments++;
         }
 
         void process_set(SetNode* m_node) {
@@ -529,6 +532,7 @@ namespace mini {
                     }
 
                     ref->has_assigned = true;
+                    ref->assignments++;
                     lhs->ref = ref;
                     process_expr(m_node->expr, ref->prog_type);
 
@@ -546,6 +550,7 @@ namespace mini {
                 process_getfield(lhs);
                 process_expr(m_node->expr, lhs->prog_type);
                 match_type(lhs->prog_type, m_node->expr->prog_type, m_node->get_info());
+                count_field_assignment(lhs->lhs->get_prog_type().get(), lhs->field->get_name());
             }
             else {
                 throw std::runtime_error("Incorrect AST Type");
@@ -554,6 +559,20 @@ namespace mini {
             
         }
 
+        // Count a set of field name on type tp, at the class that first declares it. Methods are told by these
+        // counts (see IRCodeGenerator::process_class).
+        void count_field_assignment(ConstTypeRef tp, const std::string& name) {
+            if (!tp->is_object()) {
+                symbol_table->untyped_field_assignments.insert(name);
+                return;
+            }
+            auto decl = tp->as<ObjectType>()->ref;
+            while (decl->base && decl->base->is_object() && decl->base->as<ObjectType>()->ref->fields.count(name)) {
+                decl = decl->base->as<ObjectType>()->ref;
+            }
+            const_cast<ObjectTypeMetaData*>(decl)->field_assignments[name]++;
+        }
+
         void process_interface(InterfaceNode* m_node) {
             
             const auto& [r, stack_id] = symbol_table->find_type(m_node->symbol.get());
@@ -17,7 +17,7 @@ namespace mini {
         Address aarg;
 
         StackElem() : iarg(0) {}
-        StackElem(char c) : carg(c) {}
+        StackElem(char c) : iarg(c) {}     // widened, so that it tests as an int too
         StackElem(int32_t i) : iarg(i) {}
         StackElem(float f) : farg(f) {}
         StackElem(Address a) : aarg(a) {}
@@ -35,26 +35,32 @@ namespace mini {
             LOADLI = 0x11,
             LOADLF = 0x12,
             LOADLA = 0x13,
+            LOADG = 0x14,
+            LOADC = 0x15,
             LOADI = 0x16,
             LOADII = 0x17,
             LOADIF = 0x18,
             LOADIA = 0x19,
-            LOADFIELD = 0x1c,
             LOADINTERFACE = 0x1b,
-            LOADG = 0x1d,
-            LOADC = 0x1e,
+            LOADFIELD = 0x1c,
+            LOADFIELDI = 0x1d,
+            LOADFIELDF = 0x1e,
+            LOADFIELDA = 0x1f,
 
             STOREL = 0x20,
             STORELI = 0x21,
             STORELF = 0x22,
             STORELA = 0x23,
+            STOREG = 0x24,
             STOREI = 0x26,
             STOREII = 0x27,
             STOREIF = 0x28,
             STOREIA = 0x29,
-            STOREFIELD = 0x2c,
             STOREINTERFACE = 0x2b,
-            STOREG = 0x2d,
+            STOREFIELD = 0x2c,
+            STOREFIELDI = 0x2d,
+            STOREFIELDF = 0x2e,
+            STOREFIELDA = 0x2f,
 
             ALLOC = 0x30,
             ALLOCI = 0x31,
@@ -71,6 +77,11 @@ namespace mini {
             RETI = 0x45,
             RETF = 0x46,
             RETA = 0x47,
+            TAILCALL = 0x48,
+            TAILCALLA = 0x49,
+            JMP = 0x4c,
+            JZ = 0x4d,
+            JNZ = 0x4e,
 
             CONST = 0x50,
             CONSTI = 0x51,
@@ -148,6 +159,9 @@ namespace mini {
         }
 
         void print(OutputStream&)const;
+
+        // Name of an opcode in the text form; null if there is no such opcode.
+        static const char* name(uint16_t code);
     };
 
     inline OutputStream& operator<<(OutputStream& os, const ByteCode& a) {
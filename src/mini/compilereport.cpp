@@ -0,0 +1,109 @@
+#include "compilereport.h"
+
+#include <cstdio>
+#include <iomanip>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#define MINI_RUSAGE
+#endif
+
+using namespace mini;
+
+CompileReport::Mark CompileReport::Mark::now() {
+    Mark m;
+    m.time = std::chrono::steady_clock::now();
+#ifdef MINI_RUSAGE
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        m.peak_rss_kb = long(usage.ru_maxrss / 1024);     // in bytes
+#else
+        m.peak_rss_kb = long(usage.ru_maxrss);
+#endif
+    }
+#endif
+    return m;
+}
+
+void CompileReport::count_program(const IRProgram& irprog) {
+    constants = irprog.constant_pool.size();
+    functions = 0;
+    codes = 0;
+    for (const auto& c : irprog.constant_pool) {
+        if (c->get_type() == ConstantPoolObject::FUNCTION) {
+            functions++;
+            codes += c->as<Function>()->codes.size();
+        }
+    }
+}
+
+void CompileReport::print(std::ostream& os)const {
+    auto flags = os.flags();
+    auto precision = os.precision();
+    os << std::fixed << std::setprecision(3);
+
+    size_t tokens = 0, ast_nodes = 0;
+    for (const auto& f : files) {
+        tokens += f.tokens;
+        ast_nodes += f.ast_nodes;
+    }
+
+    os << "Compile report: " << files.size() << " files, " << tokens << " tokens, " << ast_nodes << " AST nodes; "
+        << constants << " constants, " << functions << " functions, " << codes << " codes\n";
+
+    double total = 0.0;
+    os << std::setw(20) << "phase" << std::setw(12) << "time (ms)" << std::setw(14) << "peak RSS (KB)" << '\n';
+    for (const auto& p : phases) {
+        os << std::setw(20) << p.name << std::setw(12) << p.seconds * 1e3 << std::setw(14) << p.peak_rss_kb << '\n';
+        total += p.seconds;
+    }
+    os << std::setw(20) << "total" << std::setw(12) << total * 1e3 << '\n';
+
+    os << std::setw(12) << "lex (ms)" << std::setw(12) << "parse (ms)" << std::setw(14) << "peak RSS (KB)"
+        << std::setw(10) << "tokens" << std::setw(10) << "nodes" << "  file\n";
+    for (const auto& f : files) {
+        os << std::setw(12) << f.lex_seconds * 1e3 << std::setw(12) << f.parse_seconds * 1e3 << std::setw(14) << f.peak_rss_kb
+            << std::setw(10) << f.tokens << std::setw(10) << f.ast_nodes << "  " << f.name << (f.from_cache ? " (cached)" : "") << '\n';
+    }
+
+    os.flags(flags);
+    os.precision(precision);
+}
+
+static void write_json_string(std::ostream& os, const std::string& s) {
+    os << '"';
+    for (char c : s) {
+        if (c == '"' || c == '\\') os << '\\' << c;
+        else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", unsigned(c));
+            os << buf;
+        }
+        else os << c;
+    }
+    os << '"';
+}
+
+void CompileReport::write_json(std::ostream& os)const {
+    os << "{\n  \"constants\": " << constants << ",\n  \"functions\": " << functions << ",\n  \"codes\": " << codes << ",\n";
+
+    os << "  \"phases\": [";
+    for (size_t i = 0; i < phases.size(); i++) {
+        os << (i ? ",\n    " : "\n    ") << "{\"name\": ";
+        write_json_string(os, phases[i].name);
+        os << ", \"seconds\": " << phases[i].seconds << ", \"peak_rss_kb\": " << phases[i].peak_rss_kb << '}';
+    }
+    os << "\n  ],\n";
+
+    os << "  \"files\": [";
+    for (size_t i = 0; i < files.size(); i++) {
+        const File& f = files[i];
+        os << (i ? ",\n    " : "\n    ") << "{\"name\": ";
+        write_json_string(os, f.name);
+        os << ", \"lex_seconds\": " << f.lex_seconds << ", \"parse_seconds\": " << f.parse_seconds
+            << ", \"peak_rss_kb\": " << f.peak_rss_kb << ", \"tokens\": " << f.tokens << ", \"ast_nodes\": " << f.ast_nodes
+            << ", \"from_cache\": " << (f.from_cache ? "true" : "false") << '}';
+    }
+    os << "\n  ]\n}\n";
+}
@@ -0,0 +1,82 @@
+#ifndef MINI_COMPILEREPORT_H
+#define MINI_COMPILEREPORT_H
+
+#include "ir.h"
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace mini {
+
+    // Wall time and peak RSS growth of each phase of CompilerFrontEnd::process and of each file it reads, with
+    // the sizes of what they produce. Filled only if set by CompilerFrontEnd::set_report.
+    class CompileReport {
+    public:
+
+        // A point to measure from.
+        struct Mark {
+            std::chrono::steady_clock::time_point time;
+            long peak_rss_kb = 0;
+
+            static Mark now();
+
+            double seconds_since()const {
+                return std::chrono::duration<double>(std::chrono::steady_clock::now() - time).count();
+            }
+            long peak_rss_kb_since()const {
+                return now().peak_rss_kb - peak_rss_kb;
+            }
+        };
+
+        struct Phase {
+            std::string name;
+            double seconds = 0.0;
+            long peak_rss_kb = 0;       // growth of the peak RSS
+        };
+
+        struct File {
+            std::string name;
+            double lex_seconds = 0.0;   // with reading the file
+            double parse_seconds = 0.0;
+            long peak_rss_kb = 0;
+            size_t tokens = 0;
+            size_t ast_nodes = 0;
+            bool from_cache = false;    // loaded from the module cache, not lexed or parsed
+        };
+
+        // Measures a phase until destroyed; does nothing if report is null.
+        class Scope {
+        public:
+            Scope(CompileReport* report, const char* name) : report(report), name(name) {
+                if (report) start = Mark::now();
+            }
+            ~Scope() {
+                if (report) report->phases.push_back({ name, start.seconds_since(), start.peak_rss_kb_since() });
+            }
+        private:
+            CompileReport* report;
+            const char* name;
+            Mark start;
+        };
+
+        std::vector<Phase> phases;
+        std::vector<File> files;        // in the order they are imported
+
+        // of the program generated
+        size_t constants = 0;
+        size_t functions = 0;
+        size_t codes = 0;
+
+        // Count the constants, functions and codes of irprog.
+        void count_program(const IRProgram& irprog);
+
+        void print(std::ostream& os)const;
+
+        void write_json(std::ostream& os)const;
+    };
+
+}
+
+#endif
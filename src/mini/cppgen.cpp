@@ -0,0 +1,530 @@
+#include "cppgen.h"
+#include "errors.h"
+#include "native.h"
+#include "vm.h"
+
+#include <algorithm>
+
+using namespace mini;
+
+namespace {
+
+    // where a code goes on
+    enum class Flow {
+        NEXT,       // the next code
+        JUMP,       // its target
+        BRANCH,     // the next code or its target
+        END,        // nowhere in this function
+    };
+
+    bool is_a(const IRProgram& irprog, Address index, ConstantPoolObject::Type_t type) {
+        return index < irprog.constant_pool.size() && irprog.constant_pool[index]->get_type() == type;
+    }
+
+    // Offset and width of a global, as VM::decode_instruction; false if there is no such global.
+    bool global_location(const IRProgram& irprog, Address index, Size_t& offset, Size_t& width) {
+        const ClassLayout* cl = irprog.fetch_constant(irprog.global_pool_index)->as<ClassLayout>();
+        if (index >= cl->fields.size()) return false;
+        offset = cl->fields[index].offset;
+        width = ClassLayout::width(cl->fields[index].kind);
+        return true;
+    }
+
+    // Stack elements popped and pushed by bc, and where it goes on; false if bc is invalid.
+    bool code_effect(const IRProgram& irprog, const ByteCode& bc, int& pops, int& pushes, Flow& flow) {
+        pops = pushes = 0;
+        flow = Flow::NEXT;
+        Size_t offset, width;
+
+        switch (bc.code)
+        {
+        case ByteCode::NOP: break;
+        case ByteCode::HALT: flow = Flow::END; break;
+        case ByteCode::THROW: pops = 1; flow = Flow::END; break;
+
+        case ByteCode::LOADL: case ByteCode::LOADLI: case ByteCode::LOADLF: case ByteCode::LOADLA: pushes = 1; break;
+        case ByteCode::LOADI: case ByteCode::LOADII: case ByteCode::LOADIF: case ByteCode::LOADIA: pops = 2; pushes = 1; break;
+        case ByteCode::LOADFIELD: case ByteCode::LOADFIELDI: case ByteCode::LOADFIELDF: case ByteCode::LOADFIELDA:
+        case ByteCode::LOADINTERFACE: pops = 1; pushes = 1; break;
+        case ByteCode::LOADG: pushes = 1; return global_location(irprog, bc.arg1.aarg, offset, width);
+        case ByteCode::LOADC: pushes = 1; return is_a(irprog, bc.arg1.aarg, ConstantPoolObject::STRING);
+
+        case ByteCode::STOREL: case ByteCode::STORELI: case ByteCode::STORELF: case ByteCode::STORELA: pops = 1; break;
+        case ByteCode::STOREI: case ByteCode::STOREII: case ByteCode::STOREIF: case ByteCode::STOREIA: pops = 3; break;
+        case ByteCode::STOREFIELD: case ByteCode::STOREFIELDI: case ByteCode::STOREFIELDF: case ByteCode::STOREFIELDA:
+        case ByteCode::STOREINTERFACE: pops = 2; break;
+        case ByteCode::STOREG: pops = 1; return global_location(irprog, bc.arg1.aarg, offset, width);
+
+        case ByteCode::ALLOC: case ByteCode::ALLOCI: case ByteCode::ALLOCF: case ByteCode::ALLOCA: pops = 1; pushes = 1; break;
+        case ByteCode::NEW: pushes = 1; return is_a(irprog, bc.arg1.aarg, ConstantPoolObject::CLASS_LAYOUT);
+        case ByteCode::NEWCLOSURE:
+            if (!is_a(irprog, bc.arg1.aarg, ConstantPoolObject::FUNCTION)) return false;
+            pops = irprog.fetch_constant(bc.arg1.aarg)->as<Function>()->sz_bind;
+            pushes = 1;
+            break;
+
+        case ByteCode::CALL:
+        case ByteCode::TAILCALL: {
+            if (!is_a(irprog, bc.arg1.aarg, ConstantPoolObject::FUNCTION)) return false;
+            const Function* f = irprog.fetch_constant(bc.arg1.aarg)->as<Function>();
+            pops = f->sz_arg + f->sz_bind;
+            if (bc.code == ByteCode::CALL) pushes = 1;
+            else flow = Flow::END;
+            break;
+        }
+        case ByteCode::CALLA: pops = bc.arg1.iarg + 1; pushes = 2; break;      // the closure is left below the result
+        case ByteCode::TAILCALLA: pops = bc.arg1.iarg + 1; flow = Flow::END; break;
+        case ByteCode::CALLNATIVE:
+            if (!native_stack_effect(bc.arg1.iarg, pops, pushes)) {
+                pops = pushes = 0;      // raises an error when run
+            }
+            break;
+        case ByteCode::RETN: flow = Flow::END; break;
+        case ByteCode::RET: case ByteCode::RETI: case ByteCode::RETF: case ByteCode::RETA: pops = 1; flow = Flow::END; break;
+        case ByteCode::JMP: flow = Flow::JUMP; break;
+        case ByteCode::JZ: case ByteCode::JNZ: pops = 1; flow = Flow::BRANCH; break;
+
+        case ByteCode::CONST: case ByteCode::CONSTI: case ByteCode::CONSTF: case ByteCode::CONSTA: pushes = 1; break;
+        case ByteCode::DUP: pops = 1; pushes = 2; break;
+        case ByteCode::POP: pops = 1; break;
+        case ByteCode::SWAP: pops = 2; pushes = 2; break;
+        case ByteCode::SHIFT: pushes = 1; break;
+
+        case ByteCode::ADDI: case ByteCode::ADDF: case ByteCode::SUBI: case ByteCode::SUBF:
+        case ByteCode::MULI: case ByteCode::MULF: case ByteCode::DIVI: case ByteCode::DIVF:
+        case ByteCode::REMI: case ByteCode::REMF: case ByteCode::AND: case ByteCode::OR: case ByteCode::XOR:
+        case ByteCode::CMP: case ByteCode::CMPI: case ByteCode::CMPF: case ByteCode::CMPA:
+            pops = 2; pushes = 1; break;
+        case ByteCode::NEGI: case ByteCode::NEGF: case ByteCode::NOT:
+        case ByteCode::EQ: case ByteCode::NE: case ByteCode::LT: case ByteCode::LE: case ByteCode::GT: case ByteCode::GE:
+        case ByteCode::C2I: case ByteCode::C2F: case ByteCode::I2C: case ByteCode::I2F: case ByteCode::F2C: case ByteCode::F2I:
+            pops = 1; pushes = 1; break;
+
+        default:
+            return false;
+        }
+        return true;
+    }
+
+    // a name safe to put in a comment
+    std::string comment_text(const std::string& s) {
+        std::string r;
+        for (char c : s) {
+            r.push_back(c >= 0x20 && c < 0x7f && c != '\\' ? c : '?');
+        }
+        return r;
+    }
+
+    // a literal of i that does not overflow
+    std::string int_literal(int32_t i) {
+        return i == INT32_MIN ? "INT32_MIN" : std::to_string(i);
+    }
+
+    std::string var(int i) {
+        return "t" + std::to_string(i);
+    }
+
+}
+
+void CppGenerator::generate(const IRProgram& irprog, const std::string& source_name, OutputStream& os) {
+    this->irprog = &irprog;
+
+    os << "// " << comment_text(source_name) << ", translated to C++ by mini -a. Build it together with the runtime in\n";
+    os << "// src/mini (aotruntime.cpp, vm.cpp, memory.cpp, ir.cpp, fileloader.cpp, jit.cpp), which is also the include path.\n\n";
+    os << "#include \"aotruntime.h\"\n\n";
+    os << "using namespace mini;\n\n";
+
+    std::vector<Size_t> function_indices;
+    for (Size_t i = 0; i < irprog.constant_pool.size(); i++) {
+        if (irprog.constant_pool[i]->get_type() == ConstantPoolObject::FUNCTION) {
+            function_indices.push_back(i);
+            os << "static Size_t f" << i << "(AotRuntime& rt);\n";
+        }
+    }
+    os << '\n';
+
+    for (Size_t i : function_indices) {
+        generate_function(i, os);
+    }
+
+    os << "static const AotRuntime::Function functions[] = {";
+    for (Size_t i = 0, j = 0; i < irprog.constant_pool.size(); i++) {
+        os << (i % 8 == 0 ? "\n    " : " ");
+        if (j < function_indices.size() && function_indices[j] == i) {
+            os << 'f' << i << ',';
+            j++;
+        }
+        else {
+            os << "nullptr,";
+        }
+    }
+    os << "\n};\n\n";
+
+    // the program as a bytecode image
+    BinaryStream bs;
+    irprog.serialize(bs);
+    os << "alignas(8) static const unsigned char image[] = {";
+    for (size_t i = 0; i < bs.buffer.size(); i++) {
+        os << (i % 24 == 0 ? "\n    " : "") << unsigned(static_cast<unsigned char>(bs.buffer[i])) << ',';
+    }
+    os << "\n};\n\n";
+
+    os << "int main(int argc, const char** argv) {\n";
+    os << "    return AotRuntime::main(argc, argv, image, sizeof(image), functions);\n";
+    os << "}\n";
+}
+
+std::vector<int> CppGenerator::stack_depths(Size_t findex)const {
+    const Function* f = irprog->fetch_constant(findex)->as<Function>();
+    const Size_t n = f->codes.size();
+
+    std::vector<int> depths(n + 1, -1);     // [n]: running past the last code
+    std::vector<Size_t> pending;
+
+    auto reach = [&](Size_t from, Size_t pc, int depth) {
+        if (depths[pc] == -1) {
+            depths[pc] = depth;
+            pending.push_back(pc);
+        }
+        else if (depths[pc] != depth) {
+            fail(findex, from, "stack depth at code " + std::to_string(pc) + " is not static");
+        }
+    };
+    reach(0, 0, 0);
+
+    while (!pending.empty()) {
+        Size_t pc = pending.back();
+        pending.pop_back();
+        if (pc == n) continue;
+
+        const ByteCode& bc = f->codes[pc];
+        int pops, pushes;
+        Flow flow;
+        if (!code_effect(*irprog, bc, pops, pushes, flow)) {
+            fail(findex, pc, "invalid code");
+        }
+        if (pops > depths[pc]) {
+            fail(findex, pc, "stack underflow");
+        }
+        int depth = depths[pc] - pops + pushes;
+        if (flow == Flow::JUMP || flow == Flow::BRANCH) {
+            if (bc.arg1.aarg > n) {
+                fail(findex, pc, "jump out of the function");
+            }
+            reach(pc, bc.arg1.aarg, depth);
+        }
+        if (flow == Flow::NEXT || flow == Flow::BRANCH) {
+            reach(pc, pc + 1, depth);
+        }
+    }
+    return depths;
+}
+
+void CppGenerator::generate_function(Size_t findex, OutputStream& os) {
+    const Function* f = irprog->fetch_constant(findex)->as<Function>();
+    const Size_t n = f->codes.size();
+    const std::vector<int> depths = stack_depths(findex);
+    const int max_depth = *std::max_element(depths.begin(), depths.end());
+
+    std::vector<bool> targets(n + 1, false);
+    for (Size_t pc = 0; pc < n; pc++) {
+        ByteCode::OpCode code = f->codes[pc].code;
+        if (depths[pc] >= 0 && (code == ByteCode::JMP || code == ByteCode::JZ || code == ByteCode::JNZ)) {
+            targets[f->codes[pc].arg1.aarg] = true;
+        }
+    }
+
+    StringOutputStream body;
+    uses_frame = uses_stack = uses_globals = false;
+    synced.assign(std::max(max_depth, 0), false);
+    for (Size_t pc = 0; pc < n; pc++) {
+        if (depths[pc] < 0) continue;       // unreachable
+        if (targets[pc]) {
+            body << 'L' << pc << ":\n";
+            synced.assign(synced.size(), false);
+        }
+        body << "    // ";
+        f->codes[pc].print(body);
+        body << '\n';
+        generate_code(findex, pc, depths[pc], body);
+    }
+    if (targets[n]) {
+        body << 'L' << n << ":\n";
+    }
+    body << "    rt.set_pc(" << n + 1 << ");\n";
+    body << "    throw RuntimeError(\"Function end without return\");\n";
+
+    const FunctionInfo* fi = irprog->fetch_constant(f->info_index)->as<FunctionInfo>();
+    os << "// " << comment_text(irprog->fetch_string(fi->name_index)) << '\n';
+    os << "static Size_t f" << findex << "(AotRuntime& rt) {\n";
+    if (uses_frame || uses_stack) {
+        os << "    StackElem* const bp = rt.frame(" << (uses_stack ? max_depth : 0) << ");\n";
+    }
+    if (uses_stack) {
+        os << "    StackElem* const s = bp + " << Size_t(VM::frame_header) + f->sz_local << ";     // operand stack\n";
+    }
+    if (uses_globals) {
+        os << "    MemoryObject* const g = rt.globals();\n";
+    }
+    if (max_depth > 0) {
+        os << "    StackElem";
+        for (int i = 0; i < max_depth; i++) {
+            os << (i > 0 ? ", " : " ") << var(i);
+        }
+        os << ";\n";
+    }
+    os << body.str() << "}\n\n";
+}
+
+void CppGenerator::spill(int depth, OutputStream& os) {
+    for (int i = 0; i < depth; i++) {
+        if (!synced[i]) {
+            os << "    s[" << i << "] = " << var(i) << ";\n";
+            synced[i] = true;
+        }
+    }
+    os << "    rt.set_sp(s + " << depth << ");\n";
+    uses_stack = true;
+    spilled = true;
+}
+
+void CppGenerator::reload(int i, OutputStream& os) {
+    os << "    " << var(i) << " = s[" << i << "];\n";
+    synced[i] = true;
+}
+
+void CppGenerator::generate_code(Size_t findex, Size_t pc, int depth, OutputStream& os) {
+    const Function* f = irprog->fetch_constant(findex)->as<Function>();
+    const ByteCode& bc = f->codes[pc];
+    const int d = depth;
+    const int32_t arg = bc.arg1.iarg;
+
+    int pops, pushes;
+    Flow flow;
+    code_effect(*irprog, bc, pops, pushes, flow);
+    spilled = false;
+
+    auto set_pc = [&]() {
+        os << "    rt.set_pc(" << pc + 1 << ");\n";
+    };
+    // the two topmost variables
+    const std::string top = d >= 1 ? var(d - 1) : "";
+    const std::string top2 = d >= 2 ? var(d - 2) : "";
+    // element of the frame for local variable index
+    auto local = [&](int32_t index) {
+        uses_frame = true;
+        Offset_t sz_arg = f->sz_arg + f->sz_bind;
+        return "bp[" + std::to_string(index < sz_arg ? index - sz_arg - 1 : index - sz_arg + VM::frame_header) + "]";
+    };
+    auto binary = [&](const char* field, const std::string& expr) {
+        os << "    " << top2 << field << " = " << expr << ";\n";
+    };
+    auto unary = [&](const std::string& expr) {
+        os << "    " << top << expr << ";\n";
+    };
+
+    switch (bc.code)
+    {
+    case ByteCode::NOP: break;
+    case ByteCode::HALT: os << "    return AotRuntime::none;\n"; break;
+    case ByteCode::THROW:
+        set_pc();
+        os << "    throw RuntimeError(" << top << ".aarg);\n";
+        break;
+
+    case ByteCode::LOADL: case ByteCode::LOADLI: case ByteCode::LOADLF: case ByteCode::LOADLA:
+        if (arg < Offset_t(f->sz_arg + f->sz_bind + f->sz_local)) {
+            os << "    " << var(d) << " = " << local(arg) << ";\n";
+        }
+        else {
+            set_pc();
+            os << "    throw RuntimeError(\"Local variable does not exist\");\n";
+        }
+        break;
+    case ByteCode::STOREL: case ByteCode::STORELI: case ByteCode::STORELF: case ByteCode::STORELA:
+        if (arg < Offset_t(f->sz_arg + f->sz_bind + f->sz_local)) {
+            os << "    " << local(arg) << " = " << top << ";\n";
+        }
+        else {
+            set_pc();
+            os << "    throw RuntimeError(\"Local variable does not exist\");\n";
+        }
+        break;
+
+    case ByteCode::LOADI: case ByteCode::LOADII: case ByteCode::LOADIF: case ByteCode::LOADIA:
+        set_pc();
+        os << "    " << top2 << " = rt.vm.load_index(" << top2 << ".aarg, " << top << ".iarg, " << bc.code - ByteCode::LOADI << ");\n";
+        break;
+    case ByteCode::LOADFIELD: case ByteCode::LOADFIELDI: case ByteCode::LOADFIELDF: case ByteCode::LOADFIELDA:
+        set_pc();
+        os << "    " << top << " = rt.vm.load_field(" << top << ".aarg, " << arg << ", " << bc.code - ByteCode::LOADFIELD << ");\n";
+        break;
+    case ByteCode::LOADINTERFACE:
+        set_pc();
+        os << "    { static InterfaceCache cache; " << top << " = rt.vm.load_interface(" << top << ".aarg, " << arg << ", &cache); }\n";
+        break;
+    case ByteCode::LOADG:
+    case ByteCode::STOREG: {
+        Size_t offset, width;
+        global_location(*irprog, bc.arg1.aarg, offset, width);
+        uses_globals = true;
+        if (bc.code == ByteCode::LOADG) {
+            os << "    " << var(d) << " = g->" << (width == 1 ? "fetch(" : "fetch4(") << offset << ");\n";
+        }
+        else if (width == 1) {
+            os << "    g->store(" << offset << ", " << top << ".carg);\n";
+        }
+        else {
+            os << "    g->store4(" << offset << ", " << top << ");\n";
+        }
+        break;
+    }
+    case ByteCode::STOREI: case ByteCode::STOREII: case ByteCode::STOREIF: case ByteCode::STOREIA:
+        set_pc();
+        os << "    rt.vm.store_index(" << var(d - 3) << ".aarg, " << top2 << ".iarg, " << top << ", " << bc.code - ByteCode::STOREI << ");\n";
+        break;
+    case ByteCode::STOREFIELD: case ByteCode::STOREFIELDI: case ByteCode::STOREFIELDF: case ByteCode::STOREFIELDA:
+        set_pc();
+        os << "    rt.vm.store_field(" << top2 << ".aarg, " << arg << ", " << top << ", " << bc.code - ByteCode::STOREFIELD << ");\n";
+        break;
+    case ByteCode::STOREINTERFACE:
+        set_pc();
+        os << "    { static InterfaceCache cache; rt.vm.store_interface(" << top2 << ".aarg, " << arg << ", " << top << ", &cache); }\n";
+        break;
+
+    // codes working on the stack of the VM
+    case ByteCode::LOADC:
+        spill(d, os);
+        set_pc();
+        os << "    rt.load_constant(" << arg << ");\n";
+        reload(d, os);
+        break;
+    case ByteCode::ALLOC: case ByteCode::ALLOCI: case ByteCode::ALLOCF: case ByteCode::ALLOCA:
+        spill(d, os);
+        set_pc();
+        os << "    rt.allocate_array(" << bc.code - ByteCode::ALLOC << ");\n";
+        reload(d - 1, os);
+        break;
+    case ByteCode::NEW:
+        spill(d, os);
+        set_pc();
+        os << "    rt.allocate_class(" << arg << ");\n";
+        reload(d, os);
+        break;
+    case ByteCode::NEWCLOSURE:
+        spill(d, os);
+        set_pc();
+        os << "    rt.allocate_closure(" << arg << ");\n";
+        reload(d - pops, os);
+        break;
+    case ByteCode::CALL:
+        spill(d, os);
+        set_pc();
+        os << "    rt.call(" << arg << ");\n";
+        os << "    rt.run(f" << arg << "(rt));\n";
+        reload(d - pops, os);
+        break;
+    case ByteCode::CALLA:
+        spill(d, os);
+        set_pc();
+        os << "    rt.run(rt.call_closure(" << var(d - arg - 1) << ".aarg));\n";
+        reload(d - arg, os);
+        synced[d - arg - 1] = true;     // the closure is kept
+        break;
+    case ByteCode::CALLNATIVE:
+        spill(d, os);
+        set_pc();
+        os << "    rt.call_native(" << arg << ");\n";
+        if (pushes > 0) {
+            reload(d - pops, os);
+        }
+        break;
+    case ByteCode::TAILCALL:
+        spill(d, os);
+        set_pc();
+        os << "    return rt.tail_call(" << arg << ");\n";
+        break;
+    case ByteCode::TAILCALLA:
+        spill(d, os);
+        set_pc();
+        os << "    return rt.tail_call_closure(" << var(d - arg - 1) << ".aarg);\n";
+        break;
+    case ByteCode::RETN:
+        os << "    return rt.ret(false);\n";
+        break;
+    case ByteCode::RET: case ByteCode::RETI: case ByteCode::RETF: case ByteCode::RETA:
+        if (!synced[d - 1]) {
+            os << "    s[" << d - 1 << "] = " << top << ";\n";
+        }
+        os << "    rt.set_sp(s + " << d << ");\n";
+        os << "    return rt.ret(true);\n";
+        uses_stack = true;
+        break;
+
+    case ByteCode::JMP: os << "    goto L" << bc.arg1.aarg << ";\n"; break;
+    case ByteCode::JZ: os << "    if (" << top << ".iarg == 0) goto L" << bc.arg1.aarg << ";\n"; break;
+    case ByteCode::JNZ: os << "    if (" << top << ".iarg != 0) goto L" << bc.arg1.aarg << ";\n"; break;
+
+    case ByteCode::CONST: case ByteCode::CONSTI: case ByteCode::CONSTF: case ByteCode::CONSTA:
+        os << "    " << var(d) << ".iarg = " << int_literal(arg) << ";\n";     // the bits of the operand, whatever its type
+        break;
+    case ByteCode::DUP: os << "    " << var(d) << " = " << top << ";\n"; break;
+    case ByteCode::POP: break;
+    case ByteCode::SWAP: os << "    std::swap(" << top2 << ", " << top << ");\n"; break;
+    case ByteCode::SHIFT: os << "    " << var(d) << " = StackElem();\n"; break;
+
+    // integer arithmetics wraps around
+    case ByteCode::ADDI: binary(".iarg", "int32_t(uint32_t(" + top2 + ".iarg) + uint32_t(" + top + ".iarg))"); break;
+    case ByteCode::SUBI: binary(".iarg", "int32_t(uint32_t(" + top2 + ".iarg) - uint32_t(" + top + ".iarg))"); break;
+    case ByteCode::MULI: binary(".iarg", "int32_t(uint32_t(" + top2 + ".iarg) * uint32_t(" + top + ".iarg))"); break;
+    case ByteCode::DIVI: binary(".iarg", top2 + ".iarg / " + top + ".iarg"); break;
+    case ByteCode::REMI: binary(".iarg", top2 + ".iarg % " + top + ".iarg"); break;
+    case ByteCode::NEGI: unary(".iarg = int32_t(0u - uint32_t(" + top + ".iarg))"); break;
+    case ByteCode::AND: binary(".iarg", top2 + ".iarg & " + top + ".iarg"); break;
+    case ByteCode::OR: binary(".iarg", top2 + ".iarg | " + top + ".iarg"); break;
+    case ByteCode::XOR: binary(".iarg", top2 + ".iarg ^ " + top + ".iarg"); break;
+    case ByteCode::NOT: unary(".iarg = !" + top + ".iarg"); break;
+
+    case ByteCode::ADDF: binary(".farg", top2 + ".farg + " + top + ".farg"); break;
+    case ByteCode::SUBF: binary(".farg", top2 + ".farg - " + top + ".farg"); break;
+    case ByteCode::MULF: binary(".farg", top2 + ".farg * " + top + ".farg"); break;
+    case ByteCode::DIVF: binary(".farg", top2 + ".farg / " + top + ".farg"); break;
+    case ByteCode::REMF: binary(".farg", "std::fmod(" + top2 + ".farg, " + top + ".farg)"); break;
+    case ByteCode::NEGF: unary(".farg = -" + top + ".farg"); break;
+
+    case ByteCode::CMP: binary(".iarg", "AotRuntime::compare(" + top2 + ".carg, " + top + ".carg)"); break;
+    case ByteCode::CMPI: binary(".iarg", "AotRuntime::compare(" + top2 + ".iarg, " + top + ".iarg)"); break;
+    case ByteCode::CMPF: binary(".iarg", "AotRuntime::compare(" + top2 + ".farg, " + top + ".farg)"); break;
+    case ByteCode::CMPA: binary(".iarg", "AotRuntime::compare(" + top2 + ".aarg, " + top + ".aarg)"); break;
+    case ByteCode::EQ: unary(".iarg = " + top + ".iarg == 0"); break;
+    case ByteCode::NE: unary(".iarg = " + top + ".iarg != 0"); break;
+    case ByteCode::LT: unary(".iarg = " + top + ".iarg < 0"); break;
+    case ByteCode::LE: unary(".iarg = " + top + ".iarg <= 0"); break;
+    case ByteCode::GT: unary(".iarg = " + top + ".iarg > 0"); break;
+    case ByteCode::GE: unary(".iarg = " + top + ".iarg >= 0"); break;
+
+    // as the interpreter, F2C converts the bits
+    case ByteCode::C2I: unary(".iarg = " + top + ".carg"); break;
+    case ByteCode::C2F: unary(".farg = " + top + ".carg"); break;
+    case ByteCode::I2C: unary(".carg = static_cast<char>(" + top + ".iarg)"); break;
+    case ByteCode::I2F: unary(".farg = static_cast<float>(" + top + ".iarg)"); break;
+    case ByteCode::F2C: unary(".carg = static_cast<char>(" + top + ".iarg)"); break;
+    case ByteCode::F2I: unary(".iarg = static_cast<int32_t>(" + top + ".farg)"); break;
+
+    default:
+        break;      // checked by stack_depths
+    }
+
+    // the variables written; a code working on the stack of the VM has reloaded them
+    if (!spilled) {
+        for (int i = d - pops; i < d - pops + pushes; i++) {
+            synced[i] = false;
+        }
+    }
+}
+
+void CppGenerator::fail(Size_t findex, Size_t pc, const std::string& msg)const {
+    const Function* f = irprog->fetch_constant(findex)->as<Function>();
+    const FunctionInfo* fi = irprog->fetch_constant(f->info_index)->as<FunctionInfo>();
+    throw IOError("Cannot translate " + irprog->fetch_string(fi->name_index) + ", code " + std::to_string(pc) + ": " + msg);
+}
@@ -0,0 +1,49 @@
+#ifndef MINI_CPPGEN_H
+#define MINI_CPPGEN_H
+
+#include "ir.h"
+#include "stream.h"
+
+#include <string>
+#include <vector>
+
+namespace mini {
+
+    // Translates an IRProgram to a C++ program, which runs on AotRuntime (see aotruntime.h) and behaves as the
+    // VM running the program. Each function becomes a C++ function; the operand stack becomes its variables,
+    // which is possible as the depth of the stack is known at each code. The program itself is embedded as a
+    // bytecode image, for the constants, layouts and line numbers.
+    class CppGenerator {
+    public:
+
+        // Write the translation of irprog to os; source_name is only noted in the head.
+        // Throws IOError if a function cannot be translated (a code is invalid, or the stack depth is not static).
+        void generate(const IRProgram& irprog, const std::string& source_name, OutputStream& os);
+
+    private:
+
+        // Depth of the operand stack before each code, or -1 if the code is unreachable.
+        std::vector<int> stack_depths(Size_t findex)const;
+
+        void generate_function(Size_t findex, OutputStream& os);
+
+        // Translate the code at pc, with depth elements on the stack before it.
+        void generate_code(Size_t findex, Size_t pc, int depth, OutputStream& os);
+
+        // Write the variables [0, depth) to the stack of the VM, and set sp after them.
+        void spill(int depth, OutputStream& os);
+
+        // Read the variable i back from the stack of the VM.
+        void reload(int i, OutputStream& os);
+
+        [[noreturn]] void fail(Size_t findex, Size_t pc, const std::string& msg)const;
+
+        const IRProgram* irprog = nullptr;
+        std::vector<bool> synced;       // variable i holds the same as the stack of the VM
+        bool uses_frame = false, uses_stack = false, uses_globals = false;     // by the function being translated
+        bool spilled = false;           // by the code being translated
+    };
+
+}
+
+#endif
@@ -83,12 +83,18 @@ namespace mini {
         int error_uplimit;
         int error_hold = 0;
         std::vector<std::string>* filenames;
+        std::vector<ParsingError>* deferred = nullptr;     // if set, errors are kept there instead of printed
         StdoutOutputStream output;
 
         void reset() { error_hold = 0; }
         bool has_error()const { return error_hold > 0; }
         bool has_enough_errors()const { return error_hold > error_uplimit; }
         void count_and_print_error(const ParsingError& e) { 
+            if (deferred) {
+                deferred->push_back(e);
+                error_hold++;
+                return;
+            }
             e.print(*filenames, output);
             output << '\n';
             error_hold++;
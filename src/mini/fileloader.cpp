@@ -0,0 +1,79 @@
+#include "fileloader.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace mini;
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const std::string& filename) {
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw IOError("Cannot open file: " + filename);
+    }
+    file_handle = file;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        throw IOError("Cannot read file: " + filename);
+    }
+    _size = size_t(size.QuadPart);
+    if (_size == 0) return;     // an empty file cannot be mapped
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    const void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (!view) {
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+        throw IOError("Cannot map file: " + filename);
+    }
+    mapping_handle = mapping;
+    _data = static_cast<const char*>(view);
+}
+
+MappedFile::~MappedFile() {
+    if (_data) UnmapViewOfFile(_data);
+    if (mapping_handle) CloseHandle(mapping_handle);
+    if (file_handle) CloseHandle(file_handle);
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw IOError("Cannot open file: " + filename);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw IOError("Cannot read file: " + filename);
+    }
+    _size = size_t(st.st_size);
+    if (_size == 0) {       // an empty file cannot be mapped
+        close(fd);
+        return;
+    }
+
+    void* view = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);              // the mapping keeps the file open
+    if (view == MAP_FAILED) {
+        throw IOError("Cannot map file: " + filename);
+    }
+    _data = static_cast<const char*>(view);
+}
+
+MappedFile::~MappedFile() {
+    if (_data) munmap(const_cast<char*>(_data), _size);
+}
+
+#endif
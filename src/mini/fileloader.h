@@ -32,6 +32,55 @@ namespace mini {
             std::cout << buffer;*/
         }
 
+        static void read_binary_file(const std::string& filename, std::string& buffer) {
+            std::ifstream fp(filename, std::ios::binary);
+            if (!fp.is_open()) {
+                throw IOError("Cannot open file: " + filename);
+            }
+            std::stringstream sbuffer;
+            sbuffer << fp.rdbuf();
+            buffer = sbuffer.str();
+        }
+
+        static void write_binary_file(const std::string& filename, const std::string& buffer) {
+            std::ofstream fp(filename, std::ios::binary);
+            if (!fp.is_open()) {
+                throw IOError("Cannot open file: " + filename);
+            }
+            fp.write(buffer.data(), buffer.size());
+            if (!fp) {
+                throw IOError("Cannot write file: " + filename);
+            }
+        }
+
+    };
+
+    // A file mapped read-only into memory. Processes mapping the same file share its pages.
+    class MappedFile {
+    public:
+
+        explicit MappedFile(const std::string& filename);
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        ~MappedFile();
+
+        const char* data()const {
+            return _data;
+        }
+        size_t size()const {
+            return _size;
+        }
+
+    private:
+
+        const char* _data = nullptr;
+        size_t _size = 0;
+#ifdef _WIN32
+        void* file_handle = nullptr;
+        void* mapping_handle = nullptr;
+#endif
     };
 
 }
@@ -2,13 +2,18 @@
 #define MINI_FRONTEND_H
 
 #include "fileloader.h"
+#include "astcache.h"
+#include "compilereport.h"
 #include "lexer.h"
 #include "parser.h"
 #include "attributor.h"
 #include "ircodegen.h"
+#include "optimizer.h"
 #include "dependency.h"
 #include "builtin.h"
+#include "threadpool.h"
 
+#include <climits>
 #include <ostream>
 
 #include <filesystem>
@@ -41,10 +46,16 @@ namespace mini {
             }
             else {
                 generate_ir(ir_program);
+                if (report) report->count_program(ir_program);
                 return 0;
             }
         }
 
+        // Measure the phases and the files in report from now on; null (default) to stop.
+        void set_report(CompileReport* report) {
+            this->report = report;
+        }
+
         // load the string as command
         void load_string(const std::string& str) {
             input_from_file = false;
@@ -57,16 +68,40 @@ namespace mini {
         }
 
         void parse() {
-            parse_and_process_dependency(filename_main);
+            {
+                CompileReport::Scope scope(report, "parse");
+                std::unique_ptr<ThreadPool> pool;
+                prefetched.clear();
+                if (parse_threads > 1) {
+                    pool = std::make_unique<ThreadPool>(parse_threads);
+                    std::unordered_map<std::string, unsigned> file_ids;
+                    prefetch_dependency(filename_main, input_from_file, *pool, file_ids);
+                }
+                parse_and_process_dependency(filename_main);
+                prefetched.clear();
+            }
+            CompileReport::Scope scope(report, "spread_dependency");
             dependency_resolver.spread_dependency();
         }
 
+        // Number of threads lexing and parsing imported files ahead of parse_and_process_dependency; 1 parses
+        // them one by one as they are imported.
+        void set_parse_threads(unsigned n) {
+            parse_threads = n > 0 ? n : 1;
+        }
+
         void attribute() {
+            CompileReport::Scope scope(report, "attribute");
             attributor.process(nodes, symbol_table, &error_manager);
         }
 
         void generate_ir(IRProgram& ir_program) {
-            ircodegenerator.process(nodes, symbol_table, ir_program, filenames);
+            {
+                CompileReport::Scope scope(report, "generate_ir");
+                ircodegenerator.process(nodes, symbol_table, ir_program, filenames);
+            }
+            CompileReport::Scope scope(report, "optimize");
+            optimizer.process(ir_program);
         }
 
         // Parse and denendency resolve
@@ -148,6 +183,94 @@ namespace mini {
             return filename_id;
         }
 
+        // A file lexed and parsed by prefetch_dependency
+        struct PrefetchedFile {
+            unsigned file_no = 0;
+            std::string source;
+            std::vector<pAST> ast;
+            std::vector<ParsingError> errors;       // reported by the parser, in order
+            std::exception_ptr exception;           // thrown by the lexer or the parser
+            bool from_cache = false;
+            std::future<void> done;                 // invalid if from cache
+            CompileReport::File measured;           // if there is a report
+        };
+
+        // Number the files as parse_and_process_dependency will, and start lexing and parsing each of them on
+        // the pool once it is found. The imports of a file are guessed by Lexer::scan_imports before it is
+        // parsed. If the guess is wrong, the numbers stop matching those given by parse_and_process_dependency
+        // and parse_file_to_ast parses the files again, so the result is always that of the serial algorithm.
+        void prefetch_dependency(const std::string& filename, bool from_file, ThreadPool& pool, std::unordered_map<std::string, unsigned>& file_ids) {
+
+            std::string full_filename;
+            std::vector<std::string> imports;
+
+            if (from_file) {
+                try {
+                    check_file(filename, full_filename);
+                }
+                catch (const IOError&) {
+                    return;
+                }
+                if (file_ids.count(full_filename) != 0) {
+                    return;
+                }
+                unsigned file_no = file_ids.size();
+                file_ids[full_filename] = file_no;
+
+                auto pf = std::make_shared<PrefetchedFile>();
+                pf->file_no = file_no;
+                CompileReport::Mark start;
+                if (report) start = CompileReport::Mark::now();
+                try {
+                    FileLoader::read_file(full_filename, pf->source);
+                }
+                catch (const IOError&) {
+                    return;
+                }
+                prefetched[full_filename] = pf;
+
+                if (module_cache && module_cache->load(full_filename, pf->source, file_no, pf->ast)) {
+                    pf->from_cache = true;
+                    if (report) measure_file(pf->measured, full_filename, start, start.seconds_since(), 0, pf->ast, true);
+                    for (const pAST& node : pf->ast) {
+                        if (node->get_type() == AST::IMPORT) imports.push_back(node->as<ImportNode>()->get_filename());
+                    }
+                }
+                else {
+                    Lexer::scan_imports(pf->source, imports);
+                    bool measure = report != nullptr;
+                    pf->done = pool.submit([pf, full_filename, measure]() {
+                        std::vector<Token> token_buffer;
+                        ErrorManager errors;
+                        errors.error_uplimit = INT_MAX;     // the limit is applied when the errors are replayed
+                        errors.deferred = &pf->errors;
+                        try {
+                            CompileReport::Mark start;
+                            if (measure) start = CompileReport::Mark::now();
+                            Lexer().tokenize(pf->source, token_buffer, pf->file_no);
+                            double lex_seconds = measure ? start.seconds_since() : 0.0;
+                            Parser().parse(token_buffer, pf->ast, &errors);
+                            if (measure) measure_file(pf->measured, full_filename, start, lex_seconds, token_buffer.size(), pf->ast, false);
+                        }
+                        catch (...) {
+                            pf->exception = std::current_exception();
+                        }
+                    });
+                }
+                paths.push_back(std::filesystem::weakly_canonical(std::filesystem::path(filename).parent_path()));
+            }
+            else {
+                file_ids["<input>"] = file_ids.size();
+                Lexer::scan_imports(filename, imports);
+            }
+
+            for (const auto& name : imports) {
+                prefetch_dependency(name + ".mini", true, pool, file_ids);
+            }
+
+            if (from_file) paths.pop_back();
+        }
+
         // check and return the absolute form of filename
         void check_file(const std::string& filename, std::string& canonical_name) {
 
@@ -173,19 +296,83 @@ namespace mini {
 
         void parse_file_to_ast(const std::string& filename, std::vector<Ptr<AST>>& ast_buffer, unsigned file_no) {
 
+            auto r = prefetched.find(filename);
+            if (r != prefetched.end() && r->second->file_no == file_no) {
+                take_prefetched(filename, *r->second, ast_buffer);
+                return;
+            }
+
             std::string buffer;
             std::vector<Token> token_buffer;
+            CompileReport::Mark start;
+            if (report) start = CompileReport::Mark::now();
             
             FileLoader::read_file(filename, buffer);
+            if (module_cache && module_cache->load(filename, buffer, file_no, ast_buffer)) {
+                if (report) {
+                    report->files.emplace_back();
+                    measure_file(report->files.back(), filename, start, start.seconds_since(), 0, ast_buffer, true);
+                }
+                return;
+            }
+            int errors_before = error_manager.error_hold;
             lexer.tokenize(buffer, token_buffer, file_no);
+            double lex_seconds = report ? start.seconds_since() : 0.0;
             parser.parse(token_buffer, ast_buffer, &error_manager);
+            if (report) {
+                report->files.emplace_back();
+                measure_file(report->files.back(), filename, start, lex_seconds, token_buffer.size(), ast_buffer, false);
+            }
+            if (module_cache && error_manager.error_hold == errors_before) {     // before attribution modifies it
+                module_cache->store(filename, buffer, file_no, ast_buffer);
+            }
+        }
+
+        // Use the result of prefetch_dependency, reporting its errors as if the file was parsed now.
+        void take_prefetched(const std::string& filename, PrefetchedFile& pf, std::vector<Ptr<AST>>& ast_buffer) {
+            if (pf.done.valid()) {
+                pf.done.get();
+            }
+            for (const auto& e : pf.errors) {
+                if (error_manager.has_enough_errors()) {
+                    throw e;
+                }
+                error_manager.count_and_print_error(e);
+            }
+            if (pf.exception) {
+                std::rethrow_exception(pf.exception);
+            }
+            if (report) report->files.push_back(pf.measured);
+            ast_buffer.insert(ast_buffer.end(), pf.ast.begin(), pf.ast.end());
+            if (module_cache && !pf.from_cache && pf.errors.empty()) {
+                module_cache->store(filename, pf.source, pf.file_no, pf.ast);
+            }
         }
 
         void parse_string_to_ast(const std::string& str, std::vector<Ptr<AST>>& ast_buffer) {
             std::vector<Token> token_buffer;
+            CompileReport::Mark start;
+            if (report) start = CompileReport::Mark::now();
 
             lexer.tokenize(str, token_buffer, 0);
+            double lex_seconds = report ? start.seconds_since() : 0.0;
             parser.parse(token_buffer, ast_buffer, &error_manager);
+            if (report) {
+                report->files.emplace_back();
+                measure_file(report->files.back(), "<input>", start, lex_seconds, token_buffer.size(), ast_buffer, false);
+            }
+        }
+
+        // Fill f with the measures of a file whose reading (and lexing) took lex_seconds since start.
+        static void measure_file(CompileReport::File& f, const std::string& name, const CompileReport::Mark& start,
+            double lex_seconds, size_t tokens, const std::vector<pAST>& ast, bool from_cache) {
+            f.name = name;
+            f.lex_seconds = lex_seconds;
+            f.parse_seconds = start.seconds_since() - lex_seconds;
+            f.peak_rss_kb = start.peak_rss_kb_since();
+            f.tokens = tokens;
+            f.ast_nodes = ModuleCache::count_nodes(ast);
+            f.from_cache = from_cache;
         }
 
         // get the filename table
@@ -197,6 +384,20 @@ namespace mini {
             return this->symbol_table;
         }
 
+        const BytecodeOptimizer& bytecode_optimizer()const {
+            return this->optimizer;
+        }
+
+        // Keep the parsed imports in the directory and reuse them while the files are unchanged.
+        void enable_module_cache(const std::filesystem::path& directory) {
+            module_cache = std::make_unique<ModuleCache>(directory);
+        }
+
+        // null if not enabled
+        const ModuleCache* get_module_cache()const {
+            return this->module_cache.get();
+        }
+
     private:
         friend class FrontEndDisplayer;
 
@@ -208,7 +409,12 @@ namespace mini {
         Parser parser;
         Attributor attributor;
         IRCodeGenerator ircodegenerator;
+        BytecodeOptimizer optimizer;
         ErrorManager error_manager;
+        std::unique_ptr<ModuleCache> module_cache;
+        CompileReport* report = nullptr;
+        unsigned parse_threads = 1;
+        std::unordered_map<std::string, std::shared_ptr<PrefetchedFile>> prefetched;  // by canonical name
 
         bool input_from_file = true;    // false means input from string.
         std::string filename_main;
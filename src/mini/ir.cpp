@@ -1,5 +1,6 @@
 #include "ir.h"
 #include "stream.h"
+#include "fileloader.h"
 
 #include <unordered_map>
 #include <algorithm>
@@ -20,6 +21,9 @@ const std::unordered_map<ByteCode::OpCode, std::string> code_backmap = {
     {ByteCode::LOADIF, "loadindexf"},
     {ByteCode::LOADIA, "loadindexa"},
     {ByteCode::LOADFIELD, "loadfield"},
+    {ByteCode::LOADFIELDI, "loadfieldi"},
+    {ByteCode::LOADFIELDF, "loadfieldf"},
+    {ByteCode::LOADFIELDA, "loadfielda"},
     {ByteCode::LOADINTERFACE, "loadinterface"},
     {ByteCode::LOADG, "loadglobal"},
     {ByteCode::LOADC, "loadconst"},
@@ -33,6 +37,9 @@ const std::unordered_map<ByteCode::OpCode, std::string> code_backmap = {
     {ByteCode::STOREIF, "storeindexf"},
     {ByteCode::STOREIA, "storeindexa"},
     {ByteCode::STOREFIELD, "storefield"},
+    {ByteCode::STOREFIELDI, "storefieldi"},
+    {ByteCode::STOREFIELDF, "storefieldf"},
+    {ByteCode::STOREFIELDA, "storefielda"},
     {ByteCode::STOREINTERFACE, "storeinterface"},
     {ByteCode::STOREG, "storeglobal"},
 
@@ -51,6 +58,11 @@ const std::unordered_map<ByteCode::OpCode, std::string> code_backmap = {
     {ByteCode::RETI, "reti"},
     {ByteCode::RETF, "retf"},
     {ByteCode::RETA, "reta"},
+    {ByteCode::TAILCALL, "tailcall"},
+    {ByteCode::TAILCALLA, "tailcalla"},
+    {ByteCode::JMP, "jmp"},
+    {ByteCode::JZ, "jz"},
+    {ByteCode::JNZ, "jnz"},
 
     {ByteCode::CONST, "const"},
     {ByteCode::CONSTI, "consti"},
@@ -104,6 +116,11 @@ void appendbuffer_with_indent(OutputStream& os, const std::string& s) {
     os.write_white(20 - s.length());
 }
 
+const char* ByteCode::name(uint16_t code) {
+    auto r = code_backmap.find(ByteCode::OpCode(code));
+    return r == code_backmap.end() ? nullptr : r->second.c_str();
+}
+
 void ByteCode::print(OutputStream& os)const {
     const std::string& s = code_backmap.at(code);
     
@@ -118,21 +135,32 @@ void ByteCode::print(OutputStream& os)const {
     case ByteCode::STORELF:
     case ByteCode::STORELA:
     case ByteCode::CALLA:
+    case ByteCode::TAILCALLA:
+    case ByteCode::JMP:
+    case ByteCode::JZ:
+    case ByteCode::JNZ:
     {
         appendbuffer_with_indent(os, s);
         os << arg1.aarg;
         break;
     }
     case ByteCode::LOADFIELD:
+    case ByteCode::LOADFIELDI:
+    case ByteCode::LOADFIELDF:
+    case ByteCode::LOADFIELDA:
     case ByteCode::LOADINTERFACE:
     case ByteCode::LOADG:
     case ByteCode::LOADC:
     case ByteCode::STOREG:
     case ByteCode::STOREFIELD:
+    case ByteCode::STOREFIELDI:
+    case ByteCode::STOREFIELDF:
+    case ByteCode::STOREFIELDA:
     case ByteCode::STOREINTERFACE:
     case ByteCode::NEW:
     case ByteCode::NEWCLOSURE:
     case ByteCode::CALL:
+    case ByteCode::TAILCALL:
     case ByteCode::CALLNATIVE:
     {
         appendbuffer_with_indent(os, s);
@@ -165,8 +193,12 @@ OutputStream& Function::print_code(OutputStream& os, const IRProgram& irprog) co
         os << (const char*)sbuffer << codes[i];
         switch (codes[i].code) {
         case ByteCode::LOADINTERFACE:
-        case ByteCode::LOADC:
         case ByteCode::STOREINTERFACE:
+            if (codes[i].arg1.aarg < irprog.interface_fields.size()) {
+                os.write_white(10) << "; " << *irprog.constant_pool[irprog.interface_fields[codes[i].arg1.aarg]];
+            }
+            break;
+        case ByteCode::LOADC:
         case ByteCode::NEW:
         case ByteCode::NEWCLOSURE:
         case ByteCode::CALL:
@@ -193,14 +225,25 @@ OutputStream& Function::print_code(OutputStream& os, const IRProgram& irprog) co
 OutputStream& ClassLayout::print(OutputStream& os, const IRProgram& irprog)const {
     auto info = irprog.constant_pool[info_index]->as<ClassInfo>();
     os << "Class " << irprog.fetch_string(info->name_index) << " [";
-    irprog.print_symbolinfo(os, info->symbol_info) <<  "]\n";
+    irprog.print_symbolinfo(os, info->symbol_info) <<  "] " << instance_size << " bytes\n";
 
-    for (size_t i = 0; i < offset.size()-1; i++) {
+    for (size_t i = 0; i < fields.size(); i++) {
         os.write_lspace("#" + std::to_string(i), 8) << ": ";
-        os.write_lspace("+" + std::to_string(offset[i]), 5);
+        os.write_lspace("+" + std::to_string(fields[i].offset), 5);
         os.write_white(2) << irprog.fetch_string(info->field_info[i].name_index) << ':';
         irprog.constant_pool[info->field_info[i].type_index]->as<ClassInfo>()->print_simple(os, irprog) << '\n';
     }
+    for (const auto& m : methods) {
+        os.write_lspace("method", 15);
+        os.write_white(2) << irprog.fetch_string(m.name_index) << " = #" << m.function_index << '\n';
+    }
+    for (size_t i = 0; i < itable.size(); i++) {
+        if (itable[i].width == absent) continue;
+        os.write_lspace("itable " + std::to_string(i), 15);
+        os.write_white(2) << irprog.fetch_string(irprog.interface_fields[i]);
+        if (itable[i].width == 0) os << " = #" << itable[i].offset << '\n';
+        else os << " = +" << itable[i].offset << '\n';
+    }
     return os;
 }
 
@@ -229,17 +272,13 @@ OutputStream& ClassInfo::print_simple(OutputStream& os, const IRProgram& irprog)
 
 const LineNumberTable::LineNumberPair& LineNumberTable::query(Size_t function_addr, Size_t pc) const {
 
-    auto r = std::lower_bound(line_number_table.begin(), line_number_table.end(), LineNumberPair{ function_addr, pc });
-    if (r == line_number_table.end()) {
-        if (line_number_table.back().function_index == function_addr) {  // happen to be the last one, without multiple lines
-            return line_number_table.back();
-        }
-        else {
-            throw std::runtime_error("Corresponding line number does not exist");
-        }
+    // the last entry starting at or before pc
+    auto r = std::upper_bound(line_number_table.begin(), line_number_table.end(), LineNumberPair{ function_addr, pc });
+    if (r == line_number_table.begin() || (r - 1)->function_index != function_addr) {
+        throw std::runtime_error("Corresponding line number does not exist");
     }
     else {
-        return *r;
+        return *(r - 1);
     }
 }
 
@@ -318,3 +357,230 @@ OutputStream& IRProgram::print_full(OutputStream& os)const {
 }
 
 
+
+static void serialize_symbol_info(BinaryStream& bs, const SymbolInfo& info) {
+    bs.write(uint32_t(info.location.lineno)).write(uint32_t(info.location.colno)).write(uint32_t(info.location.srcno));
+    bs.write(uint32_t(info.section_index));
+}
+
+static SymbolInfo deserialize_symbol_info(BinaryStream& bs) {
+    SymbolInfo info;
+    info.location.lineno = bs.read<uint32_t>();
+    info.location.colno = bs.read<uint32_t>();
+    info.location.srcno = bs.read<uint32_t>();
+    info.section_index = bs.read<uint32_t>();
+    return info;
+}
+
+// arrays of these are written as they are in memory, so that a mapped image can be used in place
+static_assert(sizeof(ByteCode) == 8 && alignof(ByteCode) == 4, "Unexpected layout of ByteCode");
+static_assert(sizeof(LineNumberTable::LineNumberPair) == 3 * sizeof(Size_t), "Unexpected layout of LineNumberPair");
+
+void Function::serialize(BinaryStream& bs)const {
+    bs.write(sz_arg).write(sz_bind).write(sz_local).write(info_index);
+    bs.write_array(codes);
+}
+
+void Function::deserialize(BinaryStream& bs) {
+    sz_arg = bs.read<Size_t>();
+    sz_bind = bs.read<Size_t>();
+    sz_local = bs.read<Size_t>();
+    info_index = bs.read<Size_t>();
+    bs.read_array(codes);
+}
+
+void ClassLayout::serialize(BinaryStream& bs)const {
+    bs.write(info_index).write(instance_size).write_array(fields).write_array(methods).write_array(itable);
+}
+
+void ClassLayout::deserialize(BinaryStream& bs) {
+    info_index = bs.read<Size_t>();
+    instance_size = bs.read<Size_t>();
+    bs.read_array(fields);
+    bs.read_array(methods);
+    bs.read_array(itable);
+    if (instance_size < 4) {
+        throw IOError("Invalid class layout in bytecode image");
+    }
+    for (const auto& f : fields) {
+        if (f.kind > 3 || f.offset < 4 || f.offset % width(f.kind) != 0 || f.offset + width(f.kind) > instance_size) {
+            throw IOError("Invalid class layout in bytecode image");
+        }
+    }
+}
+
+void ClassLayout::pack() {
+    Size_t next = 4;
+    for (Size_t w : { 4, 1 }) {
+        for (auto& f : fields) {
+            if (width(f.kind) != w) continue;
+            f.offset = next;
+            next += w;
+        }
+    }
+    instance_size = next;
+}
+
+void FunctionInfo::serialize(BinaryStream& bs)const {
+    bs.write(name_index);
+    serialize_symbol_info(bs, symbol_info);
+    bs.write(Size_t(arg_index.size()));
+    for (const auto& a : arg_index) {
+        bs.write(a);
+    }
+    bs.write(ret_index);
+}
+
+void FunctionInfo::deserialize(BinaryStream& bs) {
+    name_index = bs.read<Size_t>();
+    symbol_info = deserialize_symbol_info(bs);
+    arg_index.resize(bs.read_count(sizeof(Size_t)));
+    for (auto& a : arg_index) {
+        a = bs.read<Size_t>();
+    }
+    ret_index = bs.read<Size_t>();
+}
+
+void ClassInfo::serialize(BinaryStream& bs)const {
+    bs.write(name_index);
+    serialize_symbol_info(bs, symbol_info);
+    bs.write(Size_t(field_info.size()));
+    for (const auto& f : field_info) {
+        bs.write(f.name_index).write(f.type_index);
+    }
+}
+
+void ClassInfo::deserialize(BinaryStream& bs) {
+    name_index = bs.read<Size_t>();
+    symbol_info = deserialize_symbol_info(bs);
+    field_info.resize(bs.read_count(2 * sizeof(Size_t)));
+    for (auto& f : field_info) {
+        f.name_index = bs.read<Size_t>();
+        f.type_index = bs.read<Size_t>();
+    }
+}
+
+void LineNumberTable::serialize(BinaryStream& bs)const {
+    bs.write_array(line_number_table);
+}
+
+void LineNumberTable::deserialize(BinaryStream& bs) {
+    bs.read_array(line_number_table);
+    const auto& table = line_number_table;
+    if (!std::is_sorted(table.begin(), table.end())) {
+        throw IOError("Invalid line number table in bytecode image");
+    }
+}
+
+void IRProgram::serialize(BinaryStream& bs)const {
+    bs.write(image_magic).write(image_version);
+    bs.write(source_index).write(entry_index).write(global_pool_index).write(line_number_table_index);
+    bs.write_array(interface_fields);
+    bs.write(Size_t(constant_pool.size()));
+    for (const auto& cp : constant_pool) {
+        bs.write(uint8_t(cp->get_type()));
+        cp->serialize(bs);
+    }
+}
+
+void IRProgram::map_image(const std::string& filename) {
+    auto mapped = std::make_shared<const MappedFile>(filename);
+    BinaryStream bs(mapped->data(), mapped->size());
+    image = mapped;
+    deserialize(bs);
+}
+
+void IRProgram::deserialize(BinaryStream& bs) {
+    if (bs.read<uint32_t>() != image_magic) {
+        throw IOError("Not a bytecode image");
+    }
+    if (bs.read<uint32_t>() != image_version) {
+        throw IOError("Unsupported bytecode image version");
+    }
+    source_index = bs.read<Size_t>();
+    entry_index = bs.read<Size_t>();
+    global_pool_index = bs.read<Size_t>();
+    line_number_table_index = bs.read<Size_t>();
+    bs.read_array(interface_fields);
+
+    Size_t count = bs.read_count(1);
+    constant_pool.reserve(count);
+    for (Size_t i = 0; i < count; i++) {
+        ConstantPoolObject* cp;
+        switch (bs.read<uint8_t>())
+        {
+        case ConstantPoolObject::STRING: cp = new StringConstant(); break;
+        case ConstantPoolObject::FUNCTION: cp = new Function(); break;
+        case ConstantPoolObject::CLASS_LAYOUT: cp = new ClassLayout(); break;
+        case ConstantPoolObject::FUNCTION_INFO: cp = new FunctionInfo(); break;
+        case ConstantPoolObject::CLASS_INFO: cp = new ClassInfo(); break;
+        case ConstantPoolObject::LINE_NUMBER_TABLE: cp = new LineNumberTable(); break;
+        default:
+            throw IOError("Invalid constant in bytecode image");
+        }
+        constant_pool.push_back(cp);
+        cp->deserialize(bs);
+    }
+
+    // references followed before the VM decodes the codes
+    auto require = [this](Size_t index, ConstantPoolObject::Type_t type) {
+        if (index >= constant_pool.size() || constant_pool[index]->get_type() != type) {
+            throw IOError("Invalid constant reference in bytecode image");
+        }
+    };
+    require(source_index, ConstantPoolObject::STRING);
+    require(entry_index, ConstantPoolObject::FUNCTION);
+    require(global_pool_index, ConstantPoolObject::CLASS_LAYOUT);
+    require(line_number_table_index, ConstantPoolObject::LINE_NUMBER_TABLE);
+    for (const auto& f : interface_fields) {
+        require(f, ConstantPoolObject::STRING);
+    }
+    for (const auto& cp : constant_pool) {
+        switch (cp->get_type())
+        {
+        case ConstantPoolObject::FUNCTION: require(cp->as<Function>()->info_index, ConstantPoolObject::FUNCTION_INFO); break;
+        case ConstantPoolObject::CLASS_LAYOUT: {
+            auto cl = cp->as<ClassLayout>();
+            require(cl->info_index, ConstantPoolObject::CLASS_INFO);
+            if (cl->fields.size() != constant_pool[cl->info_index]->as<ClassInfo>()->field_info.size()) {
+                throw IOError("Invalid class layout in bytecode image");
+            }
+            for (const auto& m : cl->methods) {
+                require(m.name_index, ConstantPoolObject::STRING);
+                require(m.function_index, ConstantPoolObject::FUNCTION);
+            }
+            if (cl->itable.size() != interface_fields.size()) {
+                throw IOError("Invalid class layout in bytecode image");
+            }
+            for (const auto& e : cl->itable) {
+                if (e.width == 0) require(e.offset, ConstantPoolObject::FUNCTION);
+                else if (e.width != ClassLayout::absent && e.offset + e.width > cl->instance_size) {
+                    throw IOError("Invalid class layout in bytecode image");
+                }
+            }
+            break;
+        }
+        case ConstantPoolObject::FUNCTION_INFO: {
+            auto fi = cp->as<FunctionInfo>();
+            require(fi->name_index, ConstantPoolObject::STRING);
+            if (!fi->symbol_info.is_absolute()) require(fi->symbol_info.location.srcno, ConstantPoolObject::STRING);
+            for (const auto& a : fi->arg_index) {
+                require(a, ConstantPoolObject::CLASS_INFO);
+            }
+            require(fi->ret_index, ConstantPoolObject::CLASS_INFO);
+            break;
+        }
+        case ConstantPoolObject::CLASS_INFO: {
+            auto ci = cp->as<ClassInfo>();
+            require(ci->name_index, ConstantPoolObject::STRING);
+            for (const auto& f : ci->field_info) {
+                require(f.name_index, ConstantPoolObject::STRING);
+                require(f.type_index, ConstantPoolObject::CLASS_INFO);
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
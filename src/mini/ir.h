@@ -5,14 +5,168 @@
 #include "symbol.h"
 #include "type.h"
 
-namespace mini {
+#include <cstring>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <vector>
 
-    //class BinaryStream;
+namespace mini {
 
     typedef uint32_t Size_t;
     typedef int32_t Offset_t;
 
+    // Elements of a constant. They are either owned, or borrowed from a mapped bytecode image that outlives
+    // them; modifying borrowed elements copies them first.
+    template<typename T>
+    class ImageVector {
+    public:
+
+        ImageVector() {}
+        ImageVector(std::vector<T> v) : owned(std::move(v)) {}
+
+        const T* data()const { return borrowed ? borrowed : owned.data(); }
+        size_t size()const { return borrowed ? sz_borrowed : owned.size(); }
+        bool empty()const { return size() == 0; }
+        bool is_borrowed()const { return borrowed != nullptr; }
+
+        const T* begin()const { return data(); }
+        const T* end()const { return data() + size(); }
+        const T& operator[](size_t i)const { return data()[i]; }
+        const T& back()const { return data()[size() - 1]; }
+
+        // the owned elements, copied first if borrowed
+        std::vector<T>& edit() {
+            if (borrowed) {
+                owned.assign(borrowed, borrowed + sz_borrowed);
+                borrowed = nullptr;
+                sz_borrowed = 0;
+            }
+            return owned;
+        }
+
+        T* begin() { return edit().data(); }
+        T* end() { return edit().data() + owned.size(); }
+        T& operator[](size_t i) { return edit()[i]; }
+        T& back() { return edit().back(); }
+        void push_back(const T& value) { edit().push_back(value); }
+        void resize(size_t size) { edit().resize(size); }
+
+        void borrow(const T* data, size_t size) {
+            owned.clear();
+            borrowed = data;
+            sz_borrowed = size;
+        }
+
+    private:
+
+        std::vector<T> owned;
+        const T* borrowed = nullptr;
+        size_t sz_borrowed = 0;
+    };
+
+    // Byte buffer of a bytecode image. Values are written in the byte order of the host; reading past
+    // the end raises an IOError. The bytes read are either the buffer, or memory owned elsewhere (a mapped
+    // file), in which case arrays read are borrowed instead of copied.
+    class BinaryStream {
+    public:
+
+        std::string buffer;
+        size_t pos = 0;     // read position
+
+        BinaryStream() {}
+        explicit BinaryStream(std::string data) : buffer(std::move(data)) {}
+        BinaryStream(const char* data, size_t size) : external(data), sz_external(size) {}
+
+        template<typename T>
+        BinaryStream& write(const T& value) {
+            static_assert(std::is_trivially_copyable<T>::value);
+            buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+            return *this;
+        }
+
+        BinaryStream& write_string(const std::string& s) {
+            write(Size_t(s.size()));
+            buffer.append(s);
+            return *this;
+        }
+
+        // elements are aligned to T, relative to the start of the image
+        template<typename T>
+        BinaryStream& write_array(const ImageVector<T>& values) {
+            static_assert(std::is_trivially_copyable<T>::value);
+            write(Size_t(values.size()));
+            buffer.resize((buffer.size() + alignof(T) - 1) / alignof(T) * alignof(T), '\0');
+            buffer.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+            return *this;
+        }
+
+        template<typename T>
+        T read() {
+            static_assert(std::is_trivially_copyable<T>::value);
+            T value;
+            require(sizeof(T));
+            memcpy(&value, data() + pos, sizeof(T));
+            pos += sizeof(T);
+            return value;
+        }
+
+        std::string read_string() {
+            Size_t size = read<Size_t>();
+            require(size);
+            std::string s(data() + pos, size);
+            pos += size;
+            return s;
+        }
+
+        template<typename T>
+        void read_array(ImageVector<T>& values) {
+            Size_t count = read<Size_t>();
+            pos = (pos + alignof(T) - 1) / alignof(T) * alignof(T);
+            require(size_t(count) * sizeof(T));
+            if (external && reinterpret_cast<uintptr_t>(data() + pos) % alignof(T) == 0) {
+                values.borrow(reinterpret_cast<const T*>(data() + pos), count);
+            }
+            else {
+                auto& v = values.edit();
+                v.resize(count);
+                memcpy(v.data(), data() + pos, size_t(count) * sizeof(T));
+            }
+            pos += size_t(count) * sizeof(T);
+        }
+
+        // read the element count of a sequence, each element taking at least min_size bytes
+        Size_t read_count(size_t min_size) {
+            Size_t count = read<Size_t>();
+            require(size_t(count) * min_size);
+            return count;
+        }
+
+        bool eof()const {
+            return pos >= size();
+        }
+
+    private:
+
+        const char* data()const {
+            return external ? external : buffer.data();
+        }
+        size_t size()const {
+            return external ? sz_external : buffer.size();
+        }
+
+        void require(size_t size)const {
+            if (pos > this->size() || size > this->size() - pos) {
+                throw IOError("Unexpected end of bytecode image");
+            }
+        }
+
+        const char* external = nullptr;
+        size_t sz_external = 0;
+    };
+
     class IRProgram;
+    class MappedFile;
 
     class ConstantPoolObject {
     public:
@@ -31,9 +185,11 @@ namespace mini {
 
         virtual Size_t size()const { return 0;}    // the size after serialization
 
-      //  virtual void serialize(BinaryStream&)const;
+        virtual void serialize(BinaryStream&)const = 0;
 
-      //  virtual void deserialize(BinaryStream&);
+        virtual void deserialize(BinaryStream&) = 0;
+
+        virtual ~ConstantPoolObject() {}
 
         virtual OutputStream& print(OutputStream& os)const {
             return os;
@@ -71,6 +227,14 @@ namespace mini {
             return value.size() + sizeof(Size_t);
         }
 
+        void serialize(BinaryStream& bs)const {
+            bs.write_string(value);
+        }
+
+        void deserialize(BinaryStream& bs) {
+            value = bs.read_string();
+        }
+
         OutputStream& print(OutputStream& os)const {
             return os << value;
         }
@@ -79,7 +243,7 @@ namespace mini {
     class Function : public ConstantPoolObject {
     public:
 
-        std::vector<ByteCode> codes;
+        ImageVector<ByteCode> codes;
         Size_t sz_arg;
         Size_t sz_bind;
         Size_t sz_local;
@@ -87,6 +251,10 @@ namespace mini {
 
         Function() : ConstantPoolObject(Type_t::FUNCTION) {}
 
+        void serialize(BinaryStream& bs)const;
+
+        void deserialize(BinaryStream& bs);
+
         OutputStream& print(OutputStream& os, const IRProgram& irprog)const;
 
         OutputStream& print(OutputStream& os)const {
@@ -99,13 +267,50 @@ namespace mini {
     class ClassLayout : public ConstantPoolObject {
     public:
 
-        std::vector<Size_t> offset;
+        // A method is shared by all instances instead of taking a field of each: its function takes self as
+        // the only binding.
+        struct Method {
+            Size_t name_index;
+            Size_t function_index;
+        };
+
+        // Where an interface field (IRProgram::interface_fields) is in the layout: a field at offset of width
+        // bytes, or a method with offset as its function if width is 0.
+        struct InterfaceEntry {
+            Size_t offset;
+            Size_t width;
+        };
+        static constexpr Size_t absent = ~Size_t(0);    // width of an interface field not in the layout
+
+        // A field: its offset in bytes and its kind, the typebit of its type (0 char, 1 int, 2 float, 3 address),
+        // which gives its width. Only address fields may refer to heap objects.
+        struct Field {
+            Size_t offset;
+            Size_t kind;
+        };
+
+        static Size_t width(Size_t kind) {
+            return kind == 0 ? 1 : 4;
+        }
+
+        ImageVector<Field> fields;              // in the order of ClassInfo::field_info
+        ImageVector<Method> methods;
+        ImageVector<InterfaceEntry> itable;     // indexed by interface field id
         Size_t info_index;
+        Size_t instance_size = 4;               // in bytes, with the layout index at offset 0
 
         ClassLayout() : ConstantPoolObject(ConstantPoolObject::CLASS_LAYOUT) {}
+
+        void serialize(BinaryStream& bs)const;
+
+        void deserialize(BinaryStream& bs);
+
+        // Place the fields after the layout index: those of 4 bytes first, then those of 1 byte, each in
+        // declaration order, so that every field is aligned to its width without padding.
+        void pack();
         
         Size_t size()const {
-            return offset.size() * sizeof(Size_t) + 2 * sizeof(Size_t);
+            return fields.size() * sizeof(Field) + 3 * sizeof(Size_t);
         }
 
         OutputStream& print(OutputStream& os)const {
@@ -125,6 +330,10 @@ namespace mini {
 
         FunctionInfo() : ConstantPoolObject(Type_t::FUNCTION_INFO) {}
 
+        void serialize(BinaryStream& bs)const;
+
+        void deserialize(BinaryStream& bs);
+
         Size_t size()const {
             return arg_index.size() * sizeof(Size_t) + 3 * sizeof(Size_t);
         }
@@ -157,6 +366,10 @@ namespace mini {
 
         ClassInfo() : ConstantPoolObject(Type_t::CLASS_INFO) {}
 
+        void serialize(BinaryStream& bs)const;
+
+        void deserialize(BinaryStream& bs);
+
         // just print the name
         OutputStream& print_simple(OutputStream& os, const IRProgram& irprog)const;
 
@@ -185,10 +398,14 @@ namespace mini {
                 return function_index < other.function_index ? true : (function_index > other.function_index ? false : pc < other.pc);
             }
         };
-        std::vector<LineNumberPair> line_number_table;
+        ImageVector<LineNumberPair> line_number_table;
 
         LineNumberTable() : ConstantPoolObject(ConstantPoolObject::LINE_NUMBER_TABLE) {}
 
+        void serialize(BinaryStream& bs)const;
+
+        void deserialize(BinaryStream& bs);
+
         void add_entry(Size_t function_addr, Size_t pc, Size_t line_number) {
             line_number_table.push_back({ function_addr, pc, line_number });
         }
@@ -211,6 +428,21 @@ namespace mini {
         Size_t entry_index;
         Size_t global_pool_index;
         Size_t line_number_table_index;
+        ImageVector<Size_t> interface_fields;   // names of the fields accessed through interfaces, by id
+
+        // Binary image: "MINI", version, entry indices, interface fields, then the constant pool. Loading checks that the
+        // indices refer to constants of the right type; the codes are checked by the VM. Codes, layouts and
+        // the line number table are stored as in memory, so that a mapped image is used without copying them.
+        static constexpr uint32_t image_magic = 0x494e494d;    // "MINI"
+        static constexpr uint32_t image_version = 5;
+
+        void serialize(BinaryStream& bs)const;
+
+        void deserialize(BinaryStream& bs);
+
+        // Map an image read-only and deserialize it; the constants borrow from the mapping, which is kept
+        // as long as the program.
+        void map_image(const std::string& filename);
 
         OutputStream& print_full(OutputStream& os)const;
 
@@ -248,6 +480,9 @@ namespace mini {
             }
         }
 
+    private:
+
+        std::shared_ptr<const MappedFile> image;   // borrowed from by the constants, if mapped
     };
     inline OutputStream& operator<<(OutputStream& os, const IRProgram& a) {
         a.print(os); return os;
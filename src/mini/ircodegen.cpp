@@ -3,9 +3,72 @@
 
 using namespace mini;
 
+// strip the type application of a callee: sel<X> => sel
+static const ExprNode* strip_type_appl(const Ptr<ExprNode>& node) {
+    return node->get_type() == AST::TYPEAPPL ? node->as<TypeApplNode>()->lhs.get() : node.get();
+}
+
+static bool is_arg(const Ptr<ExprNode>& node, unsigned index) {
+    return node->get_type() == AST::VAR && node->as<VarNode>()->ref->source == VarMetaData::ARG
+        && node->as<VarNode>()->ref->index == index;
+}
+
+// \<X>(cond:Bool, pass:X, fail:X)->@get<X>([fail, pass], cond.__value)
+static bool is_selector(const Ptr<ExprNode>& node) {
+    if (node->get_type() != AST::LAMBDA) return false;
+    auto lambda = node->as<LambdaNode>();
+    if (lambda->args.size() != 3 || lambda->statements.size() != 1 || lambda->statements[0]->get_type() != AST::FUNCALL) return false;
+
+    auto body = lambda->statements[0]->as<FunCallNode>();
+    auto callee = strip_type_appl(body->caller);
+    if (callee->get_type() != AST::VAR || callee->as<VarNode>()->symbol->get_name() != "@get" || body->args.size() != 2) return false;
+
+    const auto& arr = body->args[0];
+    const auto& index = body->args[1];
+    return arr->get_type() == AST::ARRAY && arr->as<ArrayNode>()->children.size() == 2
+        && is_arg(arr->as<ArrayNode>()->children[0], 2) && is_arg(arr->as<ArrayNode>()->children[1], 1)
+        && index->get_type() == AST::GETFIELD && index->as<GetFieldNode>()->field->get_name() == "__value"
+        && is_arg(index->as<GetFieldNode>()->lhs, 0);
+}
+
+// lambdas that can be expanded in place when applied
+static bool is_inlinable(const Ptr<ExprNode>& node) {
+    return node->get_type() == AST::LAMBDA && node->as<LambdaNode>()->quantifiers.empty();
+}
+
+// Split the codes of a builtin function into loading its args in order, a body and a return. Only the body is
+// kept, so that it can be placed right after the args are evaluated at a call site. Fails for builtins that
+// do not return (@throw, @exit).
+static bool split_intrinsic(const std::vector<ByteCode>& codes, Size_t nargs, std::vector<ByteCode>& body) {
+    if (codes.size() <= nargs) return false;
+    for (Size_t i = 0; i < nargs; i++) {
+        if (codes[i].code < ByteCode::LOADL || codes[i].code > ByteCode::LOADLA || codes[i].arg1.aarg != i) return false;
+    }
+    for (Size_t i = nargs; i + 1 < codes.size(); i++) {
+        switch (codes[i].code)
+        {
+        case ByteCode::LOADL: case ByteCode::LOADLI: case ByteCode::LOADLF: case ByteCode::LOADLA:
+        case ByteCode::HALT: case ByteCode::THROW:
+        case ByteCode::RETN: case ByteCode::RET: case ByteCode::RETI: case ByteCode::RETF: case ByteCode::RETA:
+            return false;
+        default:
+            body.push_back(codes[i]);
+        }
+    }
+    switch (codes.back().code)
+    {
+    case ByteCode::RETN: body.push_back(ByteCode::na_code(ByteCode::SHIFT)); return true;
+    case ByteCode::RET: case ByteCode::RETI: case ByteCode::RETF: case ByteCode::RETA: return true;
+    default:
+        body.clear();
+        return false;
+    }
+}
+
 void IRCodeGenerator::process(const std::vector<pAST>& nodes, const SymbolTable& sym_table, IRProgram& irprog, const std::vector<std::string>& filename_table) {
 
     this->irprog = &irprog;
+    this->symbol_table = &sym_table;
 
     // put the filenames
     for (const auto& fn : filename_table) {
@@ -31,6 +94,8 @@ void IRCodeGenerator::process(const std::vector<pAST>& nodes, const SymbolTable&
     // build the <main> class
     irprog.global_pool_index = push_class_env("<main>", info_main, type_addr.size() - 1);
     build_system_lib(sym_table);
+    emit(ByteCode::sa_code_a(ByteCode::CALL, builtin_init_index), info_main);
+    emit(ByteCode::na_code(ByteCode::POP), info_main);
 
     for (const auto& node : nodes) {
         if (node->is_expr()) {
@@ -57,15 +122,19 @@ void IRCodeGenerator::process(const std::vector<pAST>& nodes, const SymbolTable&
     }
     pop_class_env();
     emit(ByteCode::na_code(ByteCode::HALT), info_main);    // may support return in main in the future
+    cur_function()->sz_local += inline_envs.back().max_inlined_locals;
     pop_lambda_env();
+    build_system_closures();
+    build_layouts();
 
     LineNumberTable* lnt = irprog.fetch_constant(irprog.line_number_table_index)->as<LineNumberTable>();
     std::sort(lnt->line_number_table.begin(), lnt->line_number_table.end());
 
     this->irprog = nullptr;
+    this->symbol_table = nullptr;
 }
 
-void IRCodeGenerator::process_expr(const Ptr<ExprNode>& node, const std::string& name) {
+void IRCodeGenerator::process_expr(const Ptr<ExprNode>& node, const std::string& name, bool tail) {
     switch (node->get_type())
     {
     case AST::CONSTANT: process_constant(node->as<ConstantNode>()); break;
@@ -73,10 +142,10 @@ void IRCodeGenerator::process_expr(const Ptr<ExprNode>& node, const std::string&
     case AST::ARRAY: process_array(node->as<ArrayNode>()); break;
     case AST::TUPLE: process_tuple(node->as<TupleNode>()); break;
     case AST::STRUCT: process_struct(node->as<StructNode>()); break;
-    case AST::FUNCALL: process_funcall(node->as<FunCallNode>()); break;
+    case AST::FUNCALL: process_funcall(node->as<FunCallNode>(), tail); break;
     case AST::GETFIELD: process_getfield(node->as<GetFieldNode>(), nullptr); break;
     case AST::NEW: process_new(node->as<NewNode>()); break;
-    case AST::CASE: process_expr(node->as<CaseNode>()->parsed_expr); break;
+    case AST::CASE: process_expr(node->as<CaseNode>()->parsed_expr, "", tail); break;
     case AST::TYPEAPPL: process_expr(node->as<TypeApplNode>()->lhs); break;
     case AST::LAMBDA: process_lambda(node->as<LambdaNode>(), name); break;
     default:
@@ -113,13 +182,14 @@ void IRCodeGenerator::process_var(const VarNode* node) {
     switch (node->ref->source)
     {
     case VarMetaData::ARG:
-        emit(ByteCode::sa_code_a(ByteCode::LOADL, argindex2addr(node->ref->index), get_typebit(node->prog_type)), node->get_info()); break;
     case VarMetaData::BINDING:
-        emit(ByteCode::sa_code_a(ByteCode::LOADL, bindindex2addr(node->ref->index), get_typebit(node->prog_type)), node->get_info()); break;
     case VarMetaData::LOCAL:
-        emit(ByteCode::sa_code_a(ByteCode::LOADL, localindex2addr(node->ref->index), get_typebit(node->prog_type)), node->get_info()); break;
-    case VarMetaData::GLOBAL:
+        emit(ByteCode::sa_code_a(ByteCode::LOADL, var2addr(node->ref), get_typebit(node->prog_type)), node->get_info()); break;
+    case VarMetaData::GLOBAL: {
+        auto builtin = builtin_indices.find(node->ref);
+        if (builtin != builtin_indices.end()) builtin_closures[builtin->second].used = true;
         emit(ByteCode::sa_code_a(ByteCode::LOADG, node->ref->index), node->get_info()); break;
+    }
     default:
         break;
     }
@@ -158,36 +228,203 @@ void IRCodeGenerator::process_struct(const StructNode* node) {
     emit(ByteCode::sa_code_a(ByteCode::NEW, layout), node->get_info());
     for (const auto& f : node->children) {
         emit(ByteCode::na_code(ByteCode::DUP), node->get_info());
-        Size_t field_offset = lookup_field_index(info, field_ids.at(f.first->get_name()));
+        const auto& field = lookup_field(info, field_ids.at(f.first->get_name()));
         process_expr(f.second);
-        emit(ByteCode::sa_code_a(ByteCode::STOREFIELD, field_offset), node->get_info());
+        emit(ByteCode::sa_code_a(ByteCode::STOREFIELD, field.index, field.kind), node->get_info());
     }
 }
 
-void IRCodeGenerator::process_funcall(const FunCallNode* node) {
+void IRCodeGenerator::process_funcall(const FunCallNode* node, bool tail) {
     // call...
 
+    if (is_inlinable(node->caller)) {
+        process_inline_lambda(node->caller->as<LambdaNode>(), node->args, tail);
+        return;
+    }
+    if (node->args.empty() && process_selector_call(node, tail)) {
+        return;
+    }
+
+    auto callee = strip_type_appl(node->caller);
+    auto intrinsic = callee->get_type() == AST::VAR ? intrinsics.find(callee->as<VarNode>()->ref) : intrinsics.end();
+    if (intrinsic != intrinsics.end()) {
+        for (const auto& a : node->args) {
+            process_expr(a);
+        }
+        for (const auto& b : intrinsic->second) {
+            emit(b, node->get_info());
+        }
+        return;
+    }
+    auto direct = callee->get_type() == AST::VAR ? direct_functions.find(callee->as<VarNode>()->ref) : direct_functions.end();
+    if (direct != direct_functions.end()) {     // no closure => nothing to remove after call
+        for (const auto& a : node->args) {
+            process_expr(a);
+        }
+        emit(ByteCode::sa_code_a(tail ? ByteCode::TAILCALL : ByteCode::CALL, direct->second), node->get_info());
+        return;
+    }
+    Size_t method;
+    if (callee->get_type() == AST::GETFIELD && find_method(callee->as<GetFieldNode>()->lhs->prog_type, callee->as<GetFieldNode>()->field->get_name(), method)) {
+        process_method_call(node, method, tail);
+        return;
+    }
+
     process_expr(node->caller);
     for (const auto& a : node->args) {
         process_expr(a);
     }
+    if (tail) {     // the frame is reused; the function itself goes with it
+        emit(ByteCode::sa_code_i(ByteCode::TAILCALLA, node->args.size()), node->get_info());
+        return;
+    }
     emit(ByteCode::sa_code_i(ByteCode::CALLA, node->args.size()), node->get_info());
     emit(ByteCode::na_code(ByteCode::SWAP), node->get_info());      // remove the function itself
     emit(ByteCode::na_code(ByteCode::POP), node->get_info());
 }
 
+void IRCodeGenerator::process_method_call(const FunCallNode* node, Size_t findex, bool tail) {
+
+    // self goes after the args, where the binding of a closure is. A variable can be loaded there; anything
+    // else is evaluated first, as the callee would be, and kept in a spare local meanwhile.
+    const auto& self = strip_type_appl(node->caller)->as<GetFieldNode>()->lhs;
+    auto& env = inline_envs.back();
+    Size_t spare = 0;
+    if (self->get_type() != AST::VAR) {
+        process_expr(self);
+        spare = localindex2addr(env.own_locals + env.inlined_locals);
+        env.inlined_locals++;
+        env.max_inlined_locals = std::max(env.max_inlined_locals, env.inlined_locals);
+        emit(ByteCode::sa_code_a(ByteCode::STOREL, spare, get_typebit(self->prog_type)), node->get_info());
+    }
+    for (const auto& a : node->args) {
+        process_expr(a);
+    }
+    if (self->get_type() != AST::VAR) {
+        emit(ByteCode::sa_code_a(ByteCode::LOADL, spare, get_typebit(self->prog_type)), node->get_info());
+        env.inlined_locals--;
+    }
+    else {
+        process_expr(self);
+    }
+    emit(ByteCode::sa_code_a(tail ? ByteCode::TAILCALL : ByteCode::CALL, findex), node->get_info());
+}
+
+void IRCodeGenerator::process_inline_lambda(const LambdaNode* node, const std::vector<Ptr<ExprNode>>& args, bool tail) {
+
+    InlineFrame frame;
+    for (const auto& ref : node->bindings) {
+        frame.binding_addr.push_back(var2addr(ref));
+    }
+    for (const auto& a : args) {
+        process_expr(a);
+    }
+
+    // reserve slots for args and locals, then move the args into them
+    auto& env = inline_envs.back();
+    Size_t sz_local = std::count_if(node->statements.begin(), node->statements.end(), [](const pAST& s) { return s->get_type() == AST::LET; });
+    Size_t first = localindex2addr(env.own_locals + env.inlined_locals);
+    env.inlined_locals += args.size() + sz_local;
+    env.max_inlined_locals = std::max(env.max_inlined_locals, env.inlined_locals);
+
+    for (Size_t i = 0; i < args.size(); i++) {
+        frame.arg_addr.push_back(first + i);
+    }
+    frame.local_base = first + args.size();
+    for (Size_t i = args.size(); i-- > 0;) {
+        emit(ByteCode::sa_code_a(ByteCode::STOREL, frame.arg_addr[i], get_typebit(node->args[i].second->prog_type)), node->get_info());
+    }
+
+    // as a function body, except that only the value of last statement is kept.
+    env.frames.push_back(std::move(frame));
+    for (size_t i = 0; i < node->statements.size(); i++) {
+        const auto& s = node->statements[i];
+        if (s->is_expr()) {
+            bool last = i + 1 == node->statements.size();
+            process_expr(std::static_pointer_cast<ExprNode>(s), "", tail && last);
+            if (!last) emit(ByteCode::na_code(ByteCode::POP), s->get_info());
+        }
+        else if (s->get_type() == AST::LET) {
+            process_let(const_ast_cast<LetNode>(s), false);
+        }
+        else if (s->get_type() == AST::SET) {
+            process_set(const_ast_cast<SetNode>(s));
+        }
+        else {
+            throw std::runtime_error("Incorrect AST Type");
+        }
+    }
+    if (node->statements.empty() || !node->statements.back()->is_expr()) {
+        emit(ByteCode::na_code(ByteCode::SHIFT), node->get_info());     // returns nil
+    }
+
+    inline_envs.back().frames.pop_back();
+    inline_envs.back().inlined_locals -= args.size() + sz_local;
+}
+
+bool IRCodeGenerator::process_selector_call(const FunCallNode* node, bool tail) {
+
+    if (node->caller->get_type() != AST::FUNCALL) return false;
+    auto sel_call = node->caller->as<FunCallNode>();
+    auto callee = strip_type_appl(sel_call->caller);
+    if (callee->get_type() != AST::VAR || !selectors.count(callee->as<VarNode>()->ref) || sel_call->args.size() != 3) return false;
+
+    // the branches are evaluated lazily, so they must not have side effects before being called
+    for (size_t i = 1; i < 3; i++) {
+        const auto& br = sel_call->args[i];
+        if (!(is_inlinable(br) && br->as<LambdaNode>()->args.empty()) && br->get_type() != AST::VAR) return false;
+    }
+    const auto& cond = sel_call->args[0];
+    if (!cond->prog_type->is_object()) return false;
+    auto value_id = field_ids.find("__value");
+    if (value_id == field_ids.end()) return false;
+    auto value_index = field_indices.find((size_t(type2infoaddr(cond->prog_type)) << 32) + value_id->second);
+    if (value_index == field_indices.end()) return false;
+
+    auto branch = [&](const Ptr<ExprNode>& br) {
+        if (br->get_type() == AST::LAMBDA) {
+            process_inline_lambda(br->as<LambdaNode>(), {}, tail);
+        }
+        else if (tail) {
+            process_expr(br);
+            emit(ByteCode::sa_code_i(ByteCode::TAILCALLA, 0), node->get_info());
+        }
+        else {
+            process_expr(br);
+            emit(ByteCode::sa_code_i(ByteCode::CALLA, 0), node->get_info());
+            emit(ByteCode::na_code(ByteCode::SWAP), node->get_info());
+            emit(ByteCode::na_code(ByteCode::POP), node->get_info());
+        }
+    };
+
+    process_expr(cond);
+    emit(ByteCode::sa_code_a(ByteCode::LOADFIELD, value_index->second.index, value_index->second.kind), cond->get_info());
+    Size_t jz = emit_jump(ByteCode::JZ, cond->get_info());
+    branch(sel_call->args[1]);
+    Size_t jmp = emit_jump(ByteCode::JMP, node->get_info());
+    place_label(jz);
+    branch(sel_call->args[2]);
+    place_label(jmp);
+    return true;
+}
+
 void IRCodeGenerator::process_getfield(const GetFieldNode* node, const std::shared_ptr<ExprNode>& assignment_expr) {
     process_expr(node->lhs);
     if (assignment_expr) process_expr(assignment_expr);
 
-    if (node->lhs->prog_type->is_concrete()) {
+    Size_t method;
+    if (find_method(node->lhs->prog_type, node->field->get_name(), method)) {
+        if (assignment_expr) throw std::runtime_error("Assignment to method");
+        emit(ByteCode::sa_code_a(ByteCode::NEWCLOSURE, method), node->get_info());     // bound to self
+    }
+    else if (node->lhs->prog_type->is_concrete()) {
         // concrete => find class => get field ref 
         Size_t infoaddr = type2infoaddr(node->lhs->prog_type);
-        Size_t field_index = lookup_field_index(infoaddr, field_ids.at(node->field->get_name()));
-        emit(ByteCode::sa_code_a(assignment_expr ? ByteCode::STOREFIELD : ByteCode::LOADFIELD, field_index), node->get_info());
+        const auto& field = lookup_field(infoaddr, field_ids.at(node->field->get_name()));
+        emit(ByteCode::sa_code_a(assignment_expr ? ByteCode::STOREFIELD : ByteCode::LOADFIELD, field.index, field.kind), node->get_info());
     }
     else if (node->lhs->prog_type->is_universal_variable()) {
-        emit(ByteCode::sa_code_a(assignment_expr ? ByteCode::STOREINTERFACE : ByteCode::LOADINTERFACE, field_ids.at(node->field->get_name())), node->get_info());
+        emit(ByteCode::sa_code_a(assignment_expr ? ByteCode::STOREINTERFACE : ByteCode::LOADINTERFACE, interface_id(node->field->get_name())), node->get_info());
     }
     else {
         throw std::runtime_error("Incorrect type in getfield");
@@ -198,7 +435,10 @@ void IRCodeGenerator::process_new(const NewNode* node) {
     // as a funcall.
 
     // Load the new_A: A->(...->A)
-    emit(ByteCode::sa_code_a(ByteCode::LOADG, node->constructor_ref->index), node->get_info());
+    auto direct = direct_functions.find(node->constructor_ref);
+    if (direct == direct_functions.end()) {
+        emit(ByteCode::sa_code_a(ByteCode::LOADG, node->constructor_ref->index), node->get_info());
+    }
     if (node->self_arg) {
         process_var(node->self_arg.get());
     }
@@ -206,6 +446,10 @@ void IRCodeGenerator::process_new(const NewNode* node) {
         auto layout = type_addr[node->type_ref->index];
         emit(ByteCode::sa_code_a(ByteCode::NEW, layout), node->get_info());
     }
+    if (direct != direct_functions.end()) {
+        emit(ByteCode::sa_code_a(ByteCode::CALL, direct->second), node->get_info());
+        return;
+    }
     emit(ByteCode::sa_code_i(ByteCode::CALLA, 1), node->get_info());
     emit(ByteCode::na_code(ByteCode::SWAP), node->get_info());      // remove the function itself
     emit(ByteCode::na_code(ByteCode::POP), node->get_info());
@@ -222,17 +466,19 @@ void IRCodeGenerator::process_let(const LetNode* node, bool create_field) {
     }
 
     if (node->expr) {
+        if (node->ref->source == VarMetaData::GLOBAL) prepare_direct_function(node->ref, node->expr);
         process_expr(node->expr, node->symbol->get_name());
     }
 
     switch (node->ref->source)
     {
     case VarMetaData::LOCAL:
-        if (node->expr) emit(ByteCode::sa_code_a(ByteCode::STOREL, localindex2addr(node->ref->index), get_typebit(node->ref->prog_type)), node->get_info());
-        cur_function()->sz_local++;
+        if (node->expr) emit(ByteCode::sa_code_a(ByteCode::STOREL, var2addr(node->ref), get_typebit(node->ref->prog_type)), node->get_info());
+        if (inline_envs.back().frames.empty()) cur_function()->sz_local++;     // otherwise already reserved
         break;
     case VarMetaData::GLOBAL:
         if (node->expr) emit(ByteCode::sa_code_a(ByteCode::STOREG, node->ref->index), node->get_info());
+        if (node->expr && node->ref->assignments == 1 && is_selector(node->expr)) selectors.insert(node->ref);
         break;
     default:
         throw std::runtime_error("Incorrect source in let");
@@ -242,17 +488,18 @@ void IRCodeGenerator::process_let(const LetNode* node, bool create_field) {
 void IRCodeGenerator::process_set(const SetNode* node) {
     // storel/storeg/storefield
 
+    if (method_assignments.count(node)) return;
+
     // set variable
     if (node->lhs->get_type() == AST::VAR) {
         auto lhs = node->lhs->as<VarNode>();
+        if (lhs->ref->source == VarMetaData::GLOBAL) prepare_direct_function(lhs->ref, node->expr);
         process_expr(node->expr, lhs->symbol->get_name());
         switch (lhs->ref->source)
         {
         case VarMetaData::ARG:  // set to argument is allowed; However it won't modify the external one (except for pointer)
-            emit(ByteCode::sa_code_a(ByteCode::STOREL, argindex2addr(lhs->ref->index), get_typebit(lhs->ref->prog_type)), node->get_info());
-            break;
         case VarMetaData::LOCAL:
-            emit(ByteCode::sa_code_a(ByteCode::STOREL, localindex2addr(lhs->ref->index), get_typebit(lhs->ref->prog_type)), node->get_info());
+            emit(ByteCode::sa_code_a(ByteCode::STOREL, var2addr(lhs->ref), get_typebit(lhs->ref->prog_type)), node->get_info());
             break;
         case VarMetaData::GLOBAL:
             emit(ByteCode::sa_code_a(ByteCode::STOREG, lhs->ref->index), node->get_info());
@@ -272,10 +519,34 @@ void IRCodeGenerator::process_lambda(const LambdaNode* node, const std::string&
     // findex is for constant pool
     Size_t findex = push_lambda_env(node->args.size(), node->bindings.size(), name.empty() ? "<lambda>" : name,
         node->get_info(), node->prog_type);
+    if (defining_global) {
+        direct_functions[defining_global] = findex;
+        defining_global = nullptr;
+    }
+    process_lambda_body(node);
+    pop_lambda_env();
+
+    // evaluate the binding variables. Note: binding variables are not changed
+    // even if they are modified externally. Use boxes to avoid such problem.
+    for (const auto& ref : node->bindings) {
+        switch (ref->source) {
+        case VarMetaData::LOCAL:
+        case VarMetaData::BINDING:
+        case VarMetaData::ARG:
+            emit(ByteCode::sa_code_a(ByteCode::LOADL, var2addr(ref), get_typebit(ref->prog_type)), node->get_info()); break;
+        default:
+            throw std::runtime_error("Incorrect binding variable source");
+        }
+    }
+    emit(ByteCode::sa_code_a(ByteCode::NEWCLOSURE, findex), node->get_info());
+}
+
+void IRCodeGenerator::process_lambda_body(const LambdaNode* node) {
+    inline_envs.back().own_locals = std::count_if(node->statements.begin(), node->statements.end(), [](const pAST& s) { return s->get_type() == AST::LET; });
 
     for (const auto& s : node->statements) {
-        if (s->is_expr()) {
-            process_expr(std::static_pointer_cast<ExprNode>(s));
+        if (s->is_expr()) {     // a call as last statement does not come back
+            process_expr(std::static_pointer_cast<ExprNode>(s), "", s == node->statements.back());
         }
         else if (s->get_type() == AST::LET) {
             process_let(const_ast_cast<LetNode>(s), false);
@@ -295,37 +566,57 @@ void IRCodeGenerator::process_lambda(const LambdaNode* node, const std::string&
     else {
         emit(ByteCode::na_code(ByteCode::RET, get_typebit(ret_type)), node->get_info());
     }
-
-
-    pop_lambda_env();
-
-    // evaluate the binding variables. Note: binding variables are not changed
-    // even if they are modified externally. Use boxes to avoid such problem.
-    for (const auto& ref : node->bindings) {
-        switch (ref->source) {
-        case VarMetaData::LOCAL:
-            emit(ByteCode::sa_code_a(ByteCode::LOADL, localindex2addr(ref->index), get_typebit(ref->prog_type)), node->get_info()); break;
-        case VarMetaData::BINDING:
-            emit(ByteCode::sa_code_a(ByteCode::LOADL, bindindex2addr(ref->index), get_typebit(ref->prog_type)), node->get_info()); break;
-        case VarMetaData::ARG:
-            emit(ByteCode::sa_code_a(ByteCode::LOADL, argindex2addr(ref->index), get_typebit(ref->prog_type)), node->get_info()); break;
-        default:
-            throw std::runtime_error("Incorrect binding variable source");
-        }
-    }
-    emit(ByteCode::sa_code_a(ByteCode::NEWCLOSURE, findex), node->get_info());
+    cur_function()->sz_local += inline_envs.back().max_inlined_locals;
 }
 
 void IRCodeGenerator::process_class(const ClassNode* node) {
     auto rref = node->ref->as<ObjectTypeMetaData>();
+
     push_class_env(node->symbol->get_name(), node->get_info(), rref->index);
+
+    // Find the methods: node->constructor is \self->{ctor} (see Attributor::process_class), and ctor ends with self.
+    std::vector<std::pair<Size_t, const LambdaNode*>> own_methods;
+    auto ctor = node->constructor->statements[0]->as<LambdaNode>();
+    auto self_ref = ctor->statements.back()->as<VarNode>()->ref;
+    for (const auto& s : ctor->statements) {
+        if (s->get_type() != AST::SET) continue;
+        auto set = s->as<SetNode>();
+        if (set->lhs->get_type() != AST::GETFIELD || set->expr->get_type() != AST::LAMBDA) continue;
+        auto field = set->lhs->as<GetFieldNode>();
+        auto lambda = set->expr->as<LambdaNode>();
+        const auto& name = field->field->get_name();
+        auto assignments = rref->field_assignments.find(name);  // only fields declared here
+        if (field->lhs->get_type() != AST::VAR || field->lhs->as<VarNode>()->ref != self_ref
+            || assignments == rref->field_assignments.end() || assignments->second != 1
+            || symbol_table->untyped_field_assignments.count(name)
+            || lambda->bindings.size() != 1 || lambda->bindings[0] != self_ref) continue;
+
+        Size_t findex = add_function(lambda->args.size(), 1, node->symbol->get_name() + "." + name, lambda->get_info(), lambda->prog_type);
+        methods[{ rref, name }] = findex;
+        method_assignments.insert(set);
+        own_methods.push_back({ findex, lambda });
+    }
+
     for (const auto& name : rref->field_names) {
-        add_field(name, rref->fields[name]);
+        Size_t method;
+        if (find_method(rref, name, method)) {
+            cur_class()->methods.push_back({ field_id(name), method });
+        }
+        else {
+            add_field(name, rref->fields[name], field_kind(rref, name));
+        }
     }
     pop_class_env();
+
+    for (const auto& [findex, lambda] : own_methods) {
+        push_function_env(findex);
+        process_lambda_body(lambda);
+        pop_lambda_env();
+    }
     
     // constuctor: a global function
     add_field(SymbolTable::constructor_name(node->symbol->name), node->constructor->prog_type);
+    if (node->constructor->bindings.empty()) defining_global = node->constructor_ref;     // never reassigned
     process_lambda(node->constructor.get(), SymbolTable::constructor_name(node->symbol->get_name()));
     emit(ByteCode::sa_code_a(ByteCode::STOREG, node->constructor_ref->index), node->get_info());
 }
@@ -338,12 +629,55 @@ void IRCodeGenerator::build_system_lib(const SymbolTable& symbol_table) {
         auto gindex = add_field(f.name, prog_type);
         auto findex = push_lambda_env(nargs, 0, f.name, SymbolInfo::absolute(), prog_type);
         cur_function()->codes = f.codes;
+        auto ref = symbol_table.find_var(f.name);
+        direct_functions[ref] = findex;      // system symbols cannot be redefined
+        std::vector<ByteCode> body;
+        if (split_intrinsic(f.codes, nargs, body)) {
+            intrinsics[ref] = std::move(body);
+        }
         irprog->constant_pool[irprog->line_number_table_index]->as<LineNumberTable>()->add_entry(
             function_stack.back(), 0, 0
         );
         pop_lambda_env();
-        emit(ByteCode::sa_code_a(ByteCode::NEWCLOSURE, findex), SymbolInfo(Location(0, 0, 0)));
-        emit(ByteCode::sa_code_a(ByteCode::STOREG, gindex), SymbolInfo(Location(0, 0, 0)));
+        builtin_indices[ref] = builtin_closures.size();
+        builtin_closures.push_back({ findex, gindex });
+    }
+
+    builtin_init_index = push_lambda_env(0, 0, "<builtins>", SymbolInfo::absolute(),
+        PrimitiveTypeBuilder("function")("nil")(symbol_table));
+    pop_lambda_env();
+}
+
+void IRCodeGenerator::build_system_closures() {
+    function_stack.push_back(builtin_init_index);
+    inline_envs.emplace_back();
+    for (const auto& b : builtin_closures) {
+        if (!b.used) continue;
+        emit(ByteCode::sa_code_a(ByteCode::NEWCLOSURE, b.findex), SymbolInfo(Location(0, 0, 0)));
+        emit(ByteCode::sa_code_a(ByteCode::STOREG, b.gindex), SymbolInfo(Location(0, 0, 0)));
+    }
+    emit(ByteCode::na_code(ByteCode::RETN), SymbolInfo(Location(0, 0, 0)));
+    pop_lambda_env();
+}
+
+void IRCodeGenerator::build_layouts() {
+    for (auto cp : irprog->constant_pool) {
+        if (cp->get_type() != ConstantPoolObject::CLASS_LAYOUT) continue;
+        ClassLayout* cl = cp->as<ClassLayout>();
+        cl->pack();
+        auto& itable = cl->itable.edit();
+        itable.assign(irprog->interface_fields.size(), { 0, ClassLayout::absent });
+        for (Size_t id = 0; id < itable.size(); id++) {
+            auto field = field_indices.find((size_t(cl->info_index) << 32) + irprog->interface_fields[id]);
+            if (field != field_indices.end()) {
+                const auto& f = cl->fields[field->second.index];
+                itable[id] = { f.offset, ClassLayout::width(f.kind) };
+                continue;
+            }
+            for (const auto& m : cl->methods) {
+                if (m.name_index == irprog->interface_fields[id]) itable[id] = { m.function_index, 0 };
+            }
+        }
     }
 }
 
@@ -358,11 +692,10 @@ void IRCodeGenerator::build_system_type(const SymbolTable& symbol_table) {
     }
 }
 
-Size_t IRCodeGenerator::push_lambda_env(Size_t narg, Size_t nbind, const StringRef& name, const SymbolInfo& info, const pType& type) {
+Size_t IRCodeGenerator::add_function(Size_t narg, Size_t nbind, const StringRef& name, const SymbolInfo& info, const pType& type) {
 
     Function* f = new Function();
     Size_t findex = irprog->add_constant(f);
-    function_stack.push_back(findex);
 
     f->sz_arg = narg;
     f->sz_bind = nbind;
@@ -388,7 +721,6 @@ Size_t IRCodeGenerator::push_lambda_env(Size_t narg, Size_t nbind, const StringR
 Size_t IRCodeGenerator::push_class_env(const StringRef& name, const SymbolInfo& info, Index_t type_index) {
 
     ClassLayout* cl = new ClassLayout();
-    cl->offset.push_back(4);        // initial offset for classinfo.
 
     Size_t cindex = irprog->add_constant(cl);
     class_stack.push_back(cindex);
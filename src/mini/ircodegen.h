@@ -8,6 +8,8 @@
 
 #include <vector>
 #include <algorithm>
+#include <unordered_set>
+#include <map>
 
 namespace mini {
 
@@ -18,7 +20,8 @@ namespace mini {
 
         void process(const std::vector<pAST>& nodes, const SymbolTable& sym_table, IRProgram& irprog, const std::vector<std::string>& filename_table);
 
-        void process_expr(const Ptr<ExprNode>& node, const std::string& name = "");
+        // tail: the value of node is returned by current function right away.
+        void process_expr(const Ptr<ExprNode>& node, const std::string& name = "", bool tail = false);
 
         void process_constant(const ConstantNode* node);
 
@@ -30,7 +33,14 @@ namespace mini {
          
         void process_struct(const StructNode* node);
 
-        void process_funcall(const FunCallNode* node);
+        void process_funcall(const FunCallNode* node, bool tail = false);
+
+        // expand an immediately applied lambda in place.
+        void process_inline_lambda(const LambdaNode* node, const std::vector<Ptr<ExprNode>>& args, bool tail);
+
+        // sel(cond, \->A, \->B)() => cond; jz else; A; jmp end; else: B; end:
+        // returns false (and emits nothing) if the call does not fit.
+        bool process_selector_call(const FunCallNode* node, bool tail);
 
         void process_getfield(const GetFieldNode* node, const std::shared_ptr<ExprNode>& assignment_expr);
 
@@ -42,11 +52,23 @@ namespace mini {
 
         void process_lambda(const LambdaNode* node, const std::string& name);
 
+        // the codes of a lambda, into the function on top of function_stack
+        void process_lambda_body(const LambdaNode* node);
+
+        // obj.f(args) where f is a method: args; obj; call f
+        void process_method_call(const FunCallNode* node, Size_t findex, bool tail);
+
         void process_class(const ClassNode* node);
 
-        // fill the system library codes to predefined closures.
+        // fill the system library codes to predefined functions.
         void build_system_lib(const SymbolTable& symbol_table);
 
+        // create the closures of builtin functions that are used as values, at the start of <main>.
+        void build_system_closures();
+
+        // place the fields of every class layout, and build its itable once all interface fields are known.
+        void build_layouts();
+
         void build_system_type(const SymbolTable& symbol_table);
 
     private:
@@ -60,7 +82,6 @@ namespace mini {
             // Register a new struct type.
 
             ClassLayout* cl = new ClassLayout();
-            cl->offset.push_back(4);        // initial offset for classinfo.
 
             Size_t cindex = irprog->add_constant(cl);
             class_stack.push_back(cindex);
@@ -79,11 +100,16 @@ namespace mini {
             return cindex;
         }
 
-        Size_t lookup_field_index(Size_t info_index, Size_t field_id) const {
+        // index and kind of a field in a layout
+        struct FieldRef {
+            Size_t index;
+            uint16_t kind;
+        };
+        const FieldRef& lookup_field(Size_t info_index, Size_t field_id) const {
             return field_indices.at( (size_t(info_index) << 32) + field_id );
         }
-        void insert_field_offset(Size_t info_index, Size_t field_id, Size_t field_index) {
-            field_indices.insert({ (size_t(info_index) << 32) + field_id, field_index });
+        void insert_field_offset(Size_t info_index, Size_t field_id, const FieldRef& field) {
+            field_indices.insert({ (size_t(info_index) << 32) + field_id, field });
         }
 
         uint16_t get_typebit(const pType& tp)const {
@@ -107,6 +133,19 @@ namespace mini {
         Size_t argindex2addr(unsigned index)const {
             return index;
         }
+        // address of an arg/binding/local variable; inside an inlined lambda they are mapped to the slots
+        // of the enclosing function.
+        Size_t var2addr(ConstVariableRef ref)const {
+            const auto& frames = inline_envs.back().frames;
+            switch (ref->source)
+            {
+            case VarMetaData::ARG: return frames.empty() ? argindex2addr(ref->index) : frames.back().arg_addr[ref->index];
+            case VarMetaData::BINDING: return frames.empty() ? bindindex2addr(ref->index) : frames.back().binding_addr[ref->index];
+            case VarMetaData::LOCAL: return frames.empty() ? localindex2addr(ref->index) : frames.back().local_base + ref->index;
+            default:
+                throw std::runtime_error("Incorrect variable source");
+            }
+        }
         // get the typedef
         Size_t type2infoaddr(const pType& tr) {
 
@@ -140,13 +179,26 @@ namespace mini {
         void emit(const ByteCode& b, const SymbolInfo& info) {
             cur_function()->codes.push_back(b);
 
-            // add a new entry in lnt: new function; no info exist (treat as -1); lineno increased
-            if (info.location.lineno > latest_linenos[info.location.srcno] || cur_function()->codes.size() == 1) {
+            // add a new entry in lnt: new function; no info exist (treat as -1); lineno increased; jump target
+            if (info.location.lineno > latest_linenos[info.location.srcno] || cur_function()->codes.size() == 1 || at_jump_target) {
                 irprog->fetch_constant(irprog->line_number_table_index)->as<LineNumberTable>()->add_entry(
                     function_stack.back(), cur_function()->codes.size() - 1, info.location.lineno
                 );
                 latest_linenos[info.location.srcno] = info.location.lineno;
             }
+            at_jump_target = false;
+        }
+
+        // emit a jump whose target is filled by place_label()
+        Size_t emit_jump(ByteCode::OpCode code, const SymbolInfo& info) {
+            emit(ByteCode::sa_code_a(code, 0), info);
+            return cur_function()->codes.size() - 1;
+        }
+        // make the jump at pc point to the next code. The code there may be reached from another line,
+        // so it always starts a new lnt entry.
+        void place_label(Size_t pc) {
+            cur_function()->codes[pc].arg1 = StackElem(Address(cur_function()->codes.size()));
+            at_jump_target = true;
         }
 
         const Function* cur_function()const {
@@ -165,43 +217,143 @@ namespace mini {
             irprog->constant_pool.push_back(new StringConstant(s));
             return irprog->constant_pool.size() - 1;
         }
-        // add a field with certain type; return the field index
-        Size_t add_field(const StringRef& name, const pType& type) {
-            auto r = field_ids.find(name);  // ensure the uniqueness of field string
+        // the string of a field name, unique for each name
+        Size_t field_id(const StringRef& name) {
+            auto r = field_ids.find(name);
             if (r == field_ids.end()) {
                 r = field_ids.insert({ name, add_string(name) }).first;
             }
-            cur_class()->offset.push_back(cur_class()->offset.back() + 4);
+            return r->second;
+        }
+        // dense id of a field accessed through interfaces, numbered as first accessed
+        Size_t interface_id(const StringRef& name) {
+            auto r = interface_ids.insert({ field_id(name), Size_t(irprog->interface_fields.size()) });
+            if (r.second) irprog->interface_fields.push_back(r.first->first);
+            return r.first->second;
+        }
+        // add a field with certain type; return the field index. It is placed by ClassLayout::pack at the end.
+        Size_t add_field(const StringRef& name, const pType& type) {
+            return add_field(name, type, get_typebit(type));
+        }
+        Size_t add_field(const StringRef& name, const pType& type, uint16_t kind) {
+            Size_t id = field_id(name);
+            cur_class()->fields.push_back({ 0, kind });
 
-            auto field_index = cur_class()->offset.size() - 2;
+            auto field_index = cur_class()->fields.size() - 1;
             auto& field_info = cur_class_info()->field_info;
-            field_info.push_back({ r->second, type2infoaddr(type) });
-            insert_field_offset(cur_class()->info_index, r->second, Size_t(field_index));
+            field_info.push_back({ id, type2infoaddr(type) });
+            insert_field_offset(cur_class()->info_index, id, { Size_t(field_index), kind });
             return field_index;
         }
+        // Kind of field name of class ref, as declared by the first class that has it, so that the field has
+        // the same width in the layouts of all subclasses.
+        uint16_t field_kind(const ObjectTypeMetaData* ref, const std::string& name)const {
+            while (ref->base && ref->base->is_object() && ref->base->as<ObjectType>()->ref->fields.count(name)) {
+                ref = ref->base->as<ObjectType>()->ref;
+            }
+            return get_typebit(ref->fields.at(name));
+        }
+        // If field name of an object of type tp is a method, get its function.
+        bool find_method(const pType& tp, const std::string& name, Size_t& findex)const {
+            return tp->is_object() && find_method(tp->as<ObjectType>()->ref, name, findex);
+        }
+        bool find_method(const ObjectTypeMetaData* ref, const std::string& name, Size_t& findex)const {
+            for (; ref; ref = ref->base && ref->base->is_object() ? ref->base->as<ObjectType>()->ref : nullptr) {
+                auto m = methods.find({ ref, name });
+                if (m != methods.end()) {
+                    findex = m->second;
+                    return true;
+                }
+            }
+            return false;
+        }
         
-        Size_t push_lambda_env(Size_t narg, Size_t nbind, const StringRef& name, const SymbolInfo& info, const pType& type);
+        // a function with its info, not yet processed
+        Size_t add_function(Size_t narg, Size_t nbind, const StringRef& name, const SymbolInfo& info, const pType& type);
+
+
+        Size_t push_lambda_env(Size_t narg, Size_t nbind, const StringRef& name, const SymbolInfo& info, const pType& type) {
+            Size_t findex = add_function(narg, nbind, name, info, type);
+            push_function_env(findex);
+            return findex;
+        }
+        void push_function_env(Size_t findex) {
+            function_stack.push_back(findex);
+            inline_envs.emplace_back();
+        }
         
         Size_t push_class_env(const StringRef& name, const SymbolInfo& info, Index_t type_index);
         
         void pop_lambda_env() {
             function_stack.pop_back();
+            inline_envs.pop_back();
         }
         void pop_class_env() {
             class_stack.pop_back();
         }
 
         IRProgram* irprog = nullptr;
+        const SymbolTable* symbol_table = nullptr;
         std::vector<Size_t> function_stack;     // stack of currently processed function id
         std::vector<Size_t> class_stack;        // stack of currently processed class id
         std::vector<Size_t> filename_indices;   // address of filename in constant pool, keyed by id
         std::unordered_map<Size_t, Size_t> type_addr;           // address of typeinfo/classlayout in constant pool for primitive/object types, keyed by id
         std::vector<Offset_t> latest_linenos;   // latest line numbers in each file, keyed by filename id
         std::unordered_map<std::string, Size_t> field_ids;      // global field id for interfaces
-        std::unordered_map<uint64_t, Size_t> field_indices;     // field offsets map, keyed by info_id:field_id
+        std::unordered_map<uint64_t, FieldRef> field_indices;   // field index map, keyed by info_id:field_id
+        std::unordered_map<Size_t, Size_t> interface_ids;       // interface field id, keyed by field_id
         std::unordered_map<StructType::Identifier, Size_t, StructType::Hasher> struct_addr;      // address of classlayout for struct types
         size_t struct_count = 0;
+        bool at_jump_target = false;            // next emitted code is a jump target
+
+        // Lambdas applied in place are inlined into the current function. Their args and locals take slots
+        // after the function's own locals; slots are reused once an inlined body ends.
+        struct InlineFrame {
+            std::vector<Size_t> arg_addr;       // slot of each arg
+            std::vector<Size_t> binding_addr;   // slot of each binding in the enclosing body
+            Size_t local_base = 0;              // slot of the first local
+        };
+        struct InlineEnv {
+            Size_t own_locals = 0;              // locals declared by the function itself
+            Size_t inlined_locals = 0;          // slots in use by inlined bodies
+            Size_t max_inlined_locals = 0;
+            std::vector<InlineFrame> frames;
+        };
+        std::vector<InlineEnv> inline_envs;     // parallel to function_stack
+        std::unordered_set<ConstVariableRef> selectors;     // globals known to be sel-like functions
+
+        // Globals that always hold the same closure without bindings can be called directly by function index.
+        // A global qualifies if its only assignment is a capture-free lambda; it is registered as soon as the
+        // lambda gets its index, so that recursive calls in its body are direct as well.
+        std::unordered_map<ConstVariableRef, Size_t> direct_functions;
+        ConstVariableRef defining_global = nullptr;    // global assigned by the lambda being processed
+
+        // Builtins whose codes, without loading the args and returning, are spliced into the call site.
+        std::unordered_map<ConstVariableRef, std::vector<ByteCode>> intrinsics;
+
+        // A builtin gets its closure only if it is used as a value; otherwise it is always called directly
+        // or inlined, and its global is left empty.
+        struct BuiltinClosure {
+            Size_t findex;      // function in constant pool
+            Size_t gindex;      // field in the global pool
+            bool used = false;
+        };
+        std::vector<BuiltinClosure> builtin_closures;                   // in declaration order
+        std::unordered_map<ConstVariableRef, Size_t> builtin_indices;   // index in builtin_closures
+        Size_t builtin_init_index = 0;  // function creating the used closures, called first by <main>
+
+        void prepare_direct_function(ConstVariableRef ref, const Ptr<ExprNode>& expr) {
+            if (ref->assignments == 1 && expr->get_type() == AST::LAMBDA && expr->as<LambdaNode>()->bindings.empty()) {
+                defining_global = ref;
+            }
+        }
         ConstTypedefRef ref_addressable;
+
+        // Methods are fields that the constructor of their class sets to a lambda capturing nothing but self, and
+        // that are set nowhere else. Each is compiled once, and instances do not hold it: obj.f(...) calls the
+        // function with obj as the binding, and obj.f as a value makes the closure only then.
+        std::map<std::pair<ConstTypedefRef, std::string>, Size_t> methods;     // function, keyed by class and name
+        std::unordered_set<const SetNode*> method_assignments;                  // the sets in constructors; not emitted
     };
 
 }
@@ -0,0 +1,584 @@
+#include "jit.h"
+#include "vm.h"
+
+#include <cmath>
+
+#ifdef MINI_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace mini;
+
+#ifdef MINI_JIT
+
+namespace {
+
+    // A template is a sequence of bytes with holes; a hole takes the place of 4 bytes (8 for HELPER64).
+    // Registers: rbx = sp, r12 = bp, r13 = sp_limit, r14 = globals, r15 = JitFrame.
+    enum Hole : int {
+        OPERAND32 = 0x100,      // operand of the code
+        INDEX32,                // index of the code
+        TARGET32,               // rel32 to the code jumped to
+        EXIT32,                 // rel32 to the exit of the code: the interpreter runs it
+        EPILOGUE32,             // rel32 to the epilogue
+        HELPER64,               // address of the helper function
+        INSTRUCTION64,          // address of the instruction
+    };
+
+    typedef std::vector<int> Template;
+
+    // entry(JitFrame* rdi, code address rsi)
+    const Template prologue = {
+        0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57,  // push rbx; push r12-r15
+        0x49, 0x89, 0xff,                   // mov r15, rdi
+        0x49, 0x8b, 0x1f,                   // mov rbx, [r15]
+        0x4d, 0x8b, 0x67, 0x08,             // mov r12, [r15+8]
+        0x4d, 0x8b, 0x6f, 0x10,             // mov r13, [r15+16]
+        0x4d, 0x8b, 0x77, 0x18,             // mov r14, [r15+24]
+        0xff, 0xe6,                         // jmp rsi
+    };
+    // the index of the code to resume from is in eax
+    const Template epilogue = {
+        0x49, 0x89, 0x1f,                   // mov [r15], rbx
+        0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b,  // pop r15-r12; pop rbx
+        0xc3,                               // ret
+    };
+    const Template exit_to_interpreter = {
+        0xb8, INDEX32,                      // mov eax, index
+        0xe9, EPILOGUE32,                   // jmp epilogue
+    };
+
+    // leave it to the interpreter if one more element does not fit (it grows the stack)
+    const Template check_push = {
+        0x48, 0x8d, 0x4b, 0x04,             // lea rcx, [rbx+4]
+        0x4c, 0x39, 0xe9,                   // cmp rcx, r13
+        0x0f, 0x83, EXIT32,                 // jae exit
+    };
+    const Template push_eax = {
+        0x89, 0x03,                         // mov [rbx], eax
+        0x48, 0x83, 0xc3, 0x04,             // add rbx, 4
+    };
+    const Template shift = { 0x48, 0x83, 0xc3, 0x04 };     // add rbx, 4
+    const Template pop = { 0x48, 0x83, 0xeb, 0x04 };       // sub rbx, 4
+    const Template top_to_eax = { 0x8b, 0x43, 0xfc };      // mov eax, [rbx-4]
+    const Template top2_to_eax = { 0x8b, 0x43, 0xf8 };     // mov eax, [rbx-8]
+    const Template eax_to_top = { 0x89, 0x43, 0xfc };      // mov [rbx-4], eax
+    const Template eax_to_top2 = { 0x89, 0x43, 0xf8 };     // mov [rbx-8], eax
+    const Template ecx_to_top2 = { 0x89, 0x4b, 0xf8 };     // mov [rbx-8], ecx
+
+    const Template load_local = { 0x41, 0x8b, 0x84, 0x24, OPERAND32 };     // mov eax, [r12+operand]
+    const Template store_local = { 0x41, 0x89, 0x84, 0x24, OPERAND32 };    // mov [r12+operand], eax
+    const Template load_global4 = { 0x41, 0x8b, 0x86, OPERAND32 };         // mov eax, [r14+operand]
+    const Template load_global1 = { 0x41, 0x0f, 0xbe, 0x86, OPERAND32 };   // movsx eax, byte [r14+operand]
+    const Template store_global4 = { 0x41, 0x89, 0x86, OPERAND32 };        // mov [r14+operand], eax
+    const Template store_global1 = { 0x41, 0x88, 0x86, OPERAND32 };        // mov [r14+operand], al
+    const Template const_to_stack = {
+        0xc7, 0x03, OPERAND32,              // mov dword [rbx], operand
+        0x48, 0x83, 0xc3, 0x04,             // add rbx, 4
+    };
+    const Template swap = {
+        0x8b, 0x43, 0xfc,                   // mov eax, [rbx-4]
+        0x8b, 0x4b, 0xf8,                   // mov ecx, [rbx-8]
+        0x89, 0x43, 0xf8,                   // mov [rbx-8], eax
+        0x89, 0x4b, 0xfc,                   // mov [rbx-4], ecx
+    };
+
+    // eax = eax op [rbx-4]
+    const Template addi = { 0x03, 0x43, 0xfc };
+    const Template subi = { 0x2b, 0x43, 0xfc };
+    const Template muli = { 0x0f, 0xaf, 0x43, 0xfc };
+    const Template andi = { 0x23, 0x43, 0xfc };
+    const Template ori = { 0x0b, 0x43, 0xfc };
+    const Template xori = { 0x33, 0x43, 0xfc };
+
+    // the interpreter divides by 0 and -1 itself, whatever the outcome
+    const Template divide = {
+        0x8b, 0x4b, 0xfc,                   // mov ecx, [rbx-4]
+        0x8d, 0x51, 0x01,                   // lea edx, [rcx+1]
+        0x83, 0xfa, 0x01,                   // cmp edx, 1
+        0x0f, 0x86, EXIT32,                 // jbe exit
+        0x8b, 0x43, 0xf8,                   // mov eax, [rbx-8]
+        0x99,                               // cdq
+        0xf7, 0xf9,                         // idiv ecx
+    };
+    const Template edx_to_top2 = { 0x89, 0x53, 0xf8 };     // mov [rbx-8], edx
+
+    const Template negi = { 0xf7, 0x5b, 0xfc };            // neg dword [rbx-4]
+    const Template negf = { 0x81, 0x73, 0xfc, 0x00, 0x00, 0x00, 0x80 };   // xor dword [rbx-4], 0x80000000
+
+    // [rbx-8] = [rbx-8] op [rbx-4] in xmm0
+    const Template top2_to_xmm0 = { 0xf3, 0x0f, 0x10, 0x43, 0xf8 };       // movss xmm0, [rbx-8]
+    const Template xmm0_to_top2 = { 0xf3, 0x0f, 0x11, 0x43, 0xf8 };       // movss [rbx-8], xmm0
+    const Template xmm0_to_top = { 0xf3, 0x0f, 0x11, 0x43, 0xfc };        // movss [rbx-4], xmm0
+    const Template addf = { 0xf3, 0x0f, 0x58, 0x43, 0xfc };
+    const Template subf = { 0xf3, 0x0f, 0x5c, 0x43, 0xfc };
+    const Template mulf = { 0xf3, 0x0f, 0x59, 0x43, 0xfc };
+    const Template divf = { 0xf3, 0x0f, 0x5e, 0x43, 0xfc };
+
+    // ecx = (a > b) - (a < b), with the flags of a compare
+    const Template clear_ecx_edx = { 0x31, 0xc9, 0x31, 0xd2 };
+    const Template cmpi = {
+        0x3b, 0x43, 0xfc,                   // cmp eax, [rbx-4]
+        0x0f, 0x9f, 0xc1,                   // setg cl
+        0x0f, 0x9c, 0xc2,                   // setl dl
+        0x29, 0xd1,                         // sub ecx, edx
+    };
+    const Template cmpa = {
+        0x3b, 0x43, 0xfc,                   // cmp eax, [rbx-4]
+        0x0f, 0x97, 0xc1,                   // seta cl
+        0x0f, 0x92, 0xc2,                   // setb dl
+        0x29, 0xd1,                         // sub ecx, edx
+    };
+    const Template load_chars = {
+        0x0f, 0xbe, 0x43, 0xf8,             // movsx eax, byte [rbx-8]
+        0x0f, 0xbe, 0x73, 0xfc,             // movsx esi, byte [rbx-4]
+    };
+    const Template cmpc = {
+        0x39, 0xf0,                         // cmp eax, esi
+        0x0f, 0x9f, 0xc1,                   // setg cl
+        0x0f, 0x9c, 0xc2,                   // setl dl
+        0x29, 0xd1,                         // sub ecx, edx
+    };
+    const Template load_floats = {
+        0xf3, 0x0f, 0x10, 0x43, 0xf8,       // movss xmm0, [rbx-8]
+        0xf3, 0x0f, 0x10, 0x4b, 0xfc,       // movss xmm1, [rbx-4]
+    };
+    const Template cmpf = {                 // both 0 if unordered
+        0x0f, 0x2e, 0xc1,                   // ucomiss xmm0, xmm1
+        0x0f, 0x97, 0xc1,                   // seta cl
+        0x0f, 0x2e, 0xc8,                   // ucomiss xmm1, xmm0
+        0x0f, 0x97, 0xc2,                   // seta dl
+        0x29, 0xd1,                         // sub ecx, edx
+    };
+
+    // [rbx-4] = [rbx-4] cc 0, where cc is the second byte of a setcc
+    Template set_condition(int cc) {
+        return {
+            0x31, 0xc0,                     // xor eax, eax
+            0x83, 0x7b, 0xfc, 0x00,         // cmp dword [rbx-4], 0
+            0x0f, cc, 0xc0,                 // setcc al
+            0x89, 0x43, 0xfc,               // mov [rbx-4], eax
+        };
+    }
+
+    const Template c2i = { 0x0f, 0xbe, 0x43, 0xfc };       // movsx eax, byte [rbx-4]
+    const Template eax_to_xmm0 = { 0xf3, 0x0f, 0x2a, 0xc0 };               // cvtsi2ss xmm0, eax
+    const Template i2f = { 0xf3, 0x0f, 0x2a, 0x43, 0xfc };                 // cvtsi2ss xmm0, [rbx-4]
+    const Template f2i = { 0xf3, 0x0f, 0x2c, 0x43, 0xfc };                 // cvttss2si eax, [rbx-4]
+
+    const Template jmp = { 0xe9, TARGET32 };
+    const Template pop_and_test = {
+        0x48, 0x83, 0xeb, 0x04,             // sub rbx, 4
+        0x83, 0x3b, 0x00,                   // cmp dword [rbx], 0
+    };
+    const Template jz = { 0x0f, 0x84, TARGET32 };
+    const Template jnz = { 0x0f, 0x85, TARGET32 };
+
+    // sp = helper(vm, sp, instruction), or exit if it returns null
+    const Template call_helper = {
+        0x49, 0x8b, 0x7f, 0x20,             // mov rdi, [r15+32]
+        0x48, 0x89, 0xde,                   // mov rsi, rbx
+        0x48, 0xba, INSTRUCTION64,          // mov rdx, instruction
+        0x48, 0xb8, HELPER64,               // mov rax, helper
+        0xff, 0xd0,                         // call rax
+        0x48, 0x85, 0xc0,                   // test rax, rax
+        0x0f, 0x84, EXIT32,                 // jz exit
+        0x48, 0x89, 0xc3,                   // mov rbx, rax
+    };
+
+    // call or return through transfer(frame, instruction), which returns where to go on, or exit if it is null
+    const Template call_transfer = {
+        0x49, 0x89, 0x1f,                   // mov [r15], rbx
+        0x4c, 0x89, 0xff,                   // mov rdi, r15
+        0x48, 0xbe, INSTRUCTION64,          // mov rsi, instruction
+        0x48, 0xb8, HELPER64,               // mov rax, transfer
+        0xff, 0xd0,                         // call rax
+        0x48, 0x85, 0xc0,                   // test rax, rax
+        0x0f, 0x84, EXIT32,                 // jz exit
+        0x49, 0x8b, 0x1f,                   // mov rbx, [r15]
+        0x4d, 0x8b, 0x67, 0x08,             // mov r12, [r15+8]
+        0x4d, 0x8b, 0x6f, 0x10,             // mov r13, [r15+16]
+        0xff, 0xe0,                         // jmp rax
+    };
+
+    // Helpers for the codes that go through the VM. They return the new sp, or null if the code raises an
+    // error, which is then raised again by the interpreter; nothing is thrown through the machine code.
+    typedef StackElem* (*Helper)(VM*, StackElem*, const Instruction*);
+
+    StackElem* load_index(VM* vm, StackElem* sp, const Instruction* ins) {
+        try {
+            sp[-2] = vm->load_index(sp[-2].aarg, sp[-1].iarg, ins->code - ByteCode::OpCode::LOADI);
+            return sp - 1;
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    StackElem* store_index(VM* vm, StackElem* sp, const Instruction* ins) {
+        try {
+            vm->store_index(sp[-3].aarg, sp[-2].iarg, sp[-1], ins->code - ByteCode::OpCode::STOREI);
+            return sp - 3;
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    StackElem* load_field(VM* vm, StackElem* sp, const Instruction* ins) {
+        try {
+            sp[-1] = vm->load_field(sp[-1].aarg, ins->arg1.iarg, VM::unquickened(ins->code) - ByteCode::OpCode::LOADFIELD);
+            return sp;
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    StackElem* store_field(VM* vm, StackElem* sp, const Instruction* ins) {
+        try {
+            vm->store_field(sp[-2].aarg, ins->arg1.iarg, sp[-1], VM::unquickened(ins->code) - ByteCode::OpCode::STOREFIELD);
+            return sp - 2;
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    StackElem* load_interface(VM* vm, StackElem* sp, const Instruction* ins) {
+        try {
+            sp[-1] = vm->load_interface(sp[-1].aarg, ins->arg1.iarg, ins->cache);
+            return sp;
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    StackElem* store_interface(VM* vm, StackElem* sp, const Instruction* ins) {
+        try {
+            vm->store_interface(sp[-2].aarg, ins->arg1.iarg, sp[-1], ins->cache);
+            return sp - 2;
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    StackElem* allocate(VM* vm, StackElem* sp, const Instruction* ins) {
+        try {
+            return vm->allocate_from_native(sp, *ins);
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    StackElem* remf(VM*, StackElem* sp, const Instruction*) {
+        sp[-2].farg = fmod(sp[-2].farg, sp[-1].farg);
+        return sp - 1;
+    }
+
+    const void* transfer(JitFrame* frame, const Instruction* ins) {
+        try {
+            return frame->vm->transfer(*frame, *ins);
+        }
+        catch (...) {
+            return nullptr;
+        }
+    }
+
+    class Stitcher {
+    public:
+
+        explicit Stitcher(const FunctionCode& f) : entries(f.codes.size()), f(f) {}
+
+        void compile() {
+            emit(prologue);
+            for (index = 0; index < f.codes.size(); index++) {
+                entries[index] = uint32_t(code.size());
+                compile_instruction(f.codes[index]);
+            }
+            // the exits, in order of index
+            exits.resize(f.codes.size());
+            for (index = 0; index < f.codes.size(); index++) {
+                exits[index] = uint32_t(code.size());
+                emit(exit_to_interpreter);
+            }
+            epilogue_offset = uint32_t(code.size());
+            emit(epilogue);
+
+            for (const auto& fix : fixups) {
+                uint32_t target = fix.kind == TARGET32 ? entries[fix.index] : (fix.kind == EXIT32 ? exits[fix.index] : epilogue_offset);
+                int32_t rel = int32_t(target) - int32_t(fix.offset + 4);
+                memcpy(&code[fix.offset], &rel, 4);
+            }
+        }
+
+        std::vector<unsigned char> code;
+        std::vector<uint32_t> entries;
+
+    private:
+
+        void compile_instruction(const Instruction& ins) {
+            operand = ins.arg1.iarg;
+            helper = nullptr;
+            instruction = &ins;
+
+            switch (VM::unquickened(ins.code))     // quickened codes keep their operands
+            {
+            case ByteCode::OpCode::NOP:
+            case ByteCode::OpCode::I2C:
+            case ByteCode::OpCode::F2C:     // only the lowest byte is used
+                break;
+
+            case ByteCode::OpCode::LOADL:
+            case ByteCode::OpCode::LOADLI:
+            case ByteCode::OpCode::LOADLF:
+            case ByteCode::OpCode::LOADLA:
+                if (!local_offset(ins.arg1.iarg)) {
+                    emit(exit_to_interpreter);
+                    break;
+                }
+                emit(check_push); emit(load_local); emit(push_eax);
+                break;
+            case ByteCode::OpCode::STOREL:
+            case ByteCode::OpCode::STORELI:
+            case ByteCode::OpCode::STORELF:
+            case ByteCode::OpCode::STORELA:
+                if (!local_offset(ins.arg1.iarg)) {
+                    emit(exit_to_interpreter);
+                    break;
+                }
+                emit(top_to_eax); emit(store_local); emit(pop);
+                break;
+            case ByteCode::OpCode::LOADG:
+                emit(check_push); emit(ins.width == 1 ? load_global1 : load_global4); emit(push_eax);
+                break;
+            case ByteCode::OpCode::STOREG:
+                emit(top_to_eax); emit(ins.width == 1 ? store_global1 : store_global4); emit(pop);
+                break;
+
+            case ByteCode::OpCode::LOADI:
+            case ByteCode::OpCode::LOADII:
+            case ByteCode::OpCode::LOADIF:
+            case ByteCode::OpCode::LOADIA:
+                call(load_index);
+                break;
+            case ByteCode::OpCode::STOREI:
+            case ByteCode::OpCode::STOREII:
+            case ByteCode::OpCode::STOREIF:
+            case ByteCode::OpCode::STOREIA:
+                call(store_index);
+                break;
+            case ByteCode::OpCode::LOADFIELD:
+            case ByteCode::OpCode::LOADFIELDI:
+            case ByteCode::OpCode::LOADFIELDF:
+            case ByteCode::OpCode::LOADFIELDA:
+                call(load_field);
+                break;
+            case ByteCode::OpCode::STOREFIELD:
+            case ByteCode::OpCode::STOREFIELDI:
+            case ByteCode::OpCode::STOREFIELDF:
+            case ByteCode::OpCode::STOREFIELDA:
+                call(store_field);
+                break;
+            case ByteCode::OpCode::LOADINTERFACE: call(load_interface); break;
+            case ByteCode::OpCode::STOREINTERFACE: call(store_interface); break;
+
+            case ByteCode::OpCode::CALL:
+            case ByteCode::OpCode::CALLA:
+            case ByteCode::OpCode::TAILCALL:
+            case ByteCode::OpCode::TAILCALLA:
+            case ByteCode::OpCode::RETN:
+            case ByteCode::OpCode::RET:
+            case ByteCode::OpCode::RETI:
+            case ByteCode::OpCode::RETF:
+            case ByteCode::OpCode::RETA:
+                helper = reinterpret_cast<const void*>(transfer);
+                emit(call_transfer);
+                break;
+
+            case ByteCode::OpCode::ALLOC:
+            case ByteCode::OpCode::ALLOCI:
+            case ByteCode::OpCode::ALLOCF:
+            case ByteCode::OpCode::ALLOCA:
+            case ByteCode::OpCode::NEW:
+            case ByteCode::OpCode::NEWCLOSURE:
+            case ByteCode::OpCode::LOADC:
+                call(allocate);
+                break;
+
+            case ByteCode::OpCode::JMP: jump_target(ins); emit(jmp); break;
+            case ByteCode::OpCode::JZ: jump_target(ins); emit(pop_and_test); emit(jz); break;
+            case ByteCode::OpCode::JNZ: jump_target(ins); emit(pop_and_test); emit(jnz); break;
+
+            case ByteCode::OpCode::CONST:
+            case ByteCode::OpCode::CONSTI:
+            case ByteCode::OpCode::CONSTF:
+            case ByteCode::OpCode::CONSTA:
+                emit(check_push); emit(const_to_stack);
+                break;
+            case ByteCode::OpCode::DUP: emit(check_push); emit(top_to_eax); emit(push_eax); break;
+            case ByteCode::OpCode::POP: emit(pop); break;
+            case ByteCode::OpCode::SWAP: emit(swap); break;
+            case ByteCode::OpCode::SHIFT: emit(check_push); emit(shift); break;
+
+            case ByteCode::OpCode::ADDI: binary_int(addi); break;
+            case ByteCode::OpCode::SUBI: binary_int(subi); break;
+            case ByteCode::OpCode::MULI: binary_int(muli); break;
+            case ByteCode::OpCode::AND: binary_int(andi); break;
+            case ByteCode::OpCode::OR: binary_int(ori); break;
+            case ByteCode::OpCode::XOR: binary_int(xori); break;
+            case ByteCode::OpCode::DIVI: emit(divide); emit(eax_to_top2); emit(pop); break;
+            case ByteCode::OpCode::REMI: emit(divide); emit(edx_to_top2); emit(pop); break;
+            case ByteCode::OpCode::NEGI: emit(negi); break;
+            case ByteCode::OpCode::NOT: emit(set_condition(0x94)); break;
+
+            case ByteCode::OpCode::ADDF: binary_float(addf); break;
+            case ByteCode::OpCode::SUBF: binary_float(subf); break;
+            case ByteCode::OpCode::MULF: binary_float(mulf); break;
+            case ByteCode::OpCode::DIVF: binary_float(divf); break;
+            case ByteCode::OpCode::REMF: call(remf); break;
+            case ByteCode::OpCode::NEGF: emit(negf); break;
+
+            case ByteCode::OpCode::CMP: emit(load_chars); emit(clear_ecx_edx); emit(cmpc); emit(ecx_to_top2); emit(pop); break;
+            case ByteCode::OpCode::CMPI: emit(top2_to_eax); emit(clear_ecx_edx); emit(cmpi); emit(ecx_to_top2); emit(pop); break;
+            case ByteCode::OpCode::CMPA: emit(top2_to_eax); emit(clear_ecx_edx); emit(cmpa); emit(ecx_to_top2); emit(pop); break;
+            case ByteCode::OpCode::CMPF: emit(load_floats); emit(clear_ecx_edx); emit(cmpf); emit(ecx_to_top2); emit(pop); break;
+            case ByteCode::OpCode::EQ: emit(set_condition(0x94)); break;     // sete
+            case ByteCode::OpCode::NE: emit(set_condition(0x95)); break;     // setne
+            case ByteCode::OpCode::LT: emit(set_condition(0x9c)); break;     // setl
+            case ByteCode::OpCode::LE: emit(set_condition(0x9e)); break;     // setle
+            case ByteCode::OpCode::GT: emit(set_condition(0x9f)); break;     // setg
+            case ByteCode::OpCode::GE: emit(set_condition(0x9d)); break;     // setge
+
+            case ByteCode::OpCode::C2I: emit(c2i); emit(eax_to_top); break;
+            case ByteCode::OpCode::C2F: emit(c2i); emit(eax_to_xmm0); emit(xmm0_to_top); break;
+            case ByteCode::OpCode::I2F: emit(i2f); emit(xmm0_to_top); break;
+            case ByteCode::OpCode::F2I: emit(f2i); emit(eax_to_top); break;
+
+            default:    // native calls and errors
+                emit(exit_to_interpreter);
+                break;
+            }
+        }
+
+        void call(Helper h) {
+            helper = reinterpret_cast<const void*>(h);
+            emit(call_helper);
+        }
+
+        void binary_int(const Template& op) {
+            emit(top2_to_eax); emit(op); emit(eax_to_top2); emit(pop);
+        }
+
+        void binary_float(const Template& op) {
+            emit(top2_to_xmm0); emit(op); emit(xmm0_to_top2); emit(pop);
+        }
+
+        // Set operand to the offset of a local variable from bp, as the interpreter addresses it; false if
+        // it does not exist.
+        bool local_offset(Offset_t index) {
+            if (index < f.sz_arg) {
+                operand = (index - f.sz_arg - 1) * int32_t(sizeof(StackElem));
+                return true;
+            }
+            else if (Size_t(index - f.sz_arg) < f.sz_local) {
+                operand = (index - f.sz_arg + VM::frame_header) * int32_t(sizeof(StackElem));
+                return true;
+            }
+            return false;
+        }
+
+        void jump_target(const Instruction& ins) {
+            target = Size_t(ins.target - f.codes.data());
+        }
+
+        void emit(const Template& t) {
+            for (int byte : t) {
+                switch (byte)
+                {
+                case OPERAND32: emit32(uint32_t(operand)); break;
+                case INDEX32: emit32(index); break;
+                case TARGET32: fixups.push_back({ uint32_t(code.size()), TARGET32, target }); emit32(0); break;
+                case EXIT32: fixups.push_back({ uint32_t(code.size()), EXIT32, index }); emit32(0); break;
+                case EPILOGUE32: fixups.push_back({ uint32_t(code.size()), EPILOGUE32, 0 }); emit32(0); break;
+                case HELPER64: emit64(reinterpret_cast<uint64_t>(helper)); break;
+                case INSTRUCTION64: emit64(reinterpret_cast<uint64_t>(instruction)); break;
+                default: code.push_back(static_cast<unsigned char>(byte)); break;
+                }
+            }
+        }
+
+        void emit32(uint32_t value) {
+            code.insert(code.end(), reinterpret_cast<unsigned char*>(&value), reinterpret_cast<unsigned char*>(&value) + 4);
+        }
+
+        void emit64(uint64_t value) {
+            code.insert(code.end(), reinterpret_cast<unsigned char*>(&value), reinterpret_cast<unsigned char*>(&value) + 8);
+        }
+
+        struct Fixup {
+            uint32_t offset;
+            int kind;
+            Size_t index;
+        };
+
+        const FunctionCode& f;
+        std::vector<uint32_t> exits;
+        std::vector<Fixup> fixups;
+        uint32_t epilogue_offset = 0;
+
+        // of the code being compiled
+        Size_t index = 0;
+        int32_t operand = 0;
+        Size_t target = 0;
+        const void* helper = nullptr;
+        const Instruction* instruction = nullptr;
+    };
+
+}
+
+NativeCode::~NativeCode() {
+    munmap(memory, mapped_size);
+}
+
+Size_t NativeCode::run(JitFrame& frame, Size_t pc)const {
+    typedef Size_t (*Entry)(JitFrame*, const void*);
+    return reinterpret_cast<Entry>(memory)(&frame, memory + entries[pc]);
+}
+
+std::unique_ptr<NativeCode> NativeCode::compile(const FunctionCode& f) {
+    Stitcher stitcher(f);
+    stitcher.compile();
+
+    size_t page = size_t(sysconf(_SC_PAGESIZE));
+    size_t size = (stitcher.code.size() + page - 1) / page * page;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    memcpy(memory, stitcher.code.data(), stitcher.code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+    }
+    return std::unique_ptr<NativeCode>(new NativeCode(static_cast<unsigned char*>(memory), size, stitcher.code.size(), std::move(stitcher.entries)));
+}
+
+#else
+
+NativeCode::~NativeCode() {
+}
+
+Size_t NativeCode::run(JitFrame&, Size_t pc)const {
+    return pc;
+}
+
+std::unique_ptr<NativeCode> NativeCode::compile(const FunctionCode&) {
+    return nullptr;
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef MINI_JIT_H
+#define MINI_JIT_H
+
+#include "bytecode.h"
+#include "ir.h"
+
+#include <memory>
+#include <vector>
+
+// The JIT emits x86-64 code into memory from mmap/mprotect. Define MINI_NO_JIT to leave it out.
+#if defined(__x86_64__) && defined(__linux__) && !defined(MINI_NO_JIT)
+#define MINI_JIT
+#endif
+
+namespace mini {
+
+    class VM;
+    struct FunctionCode;
+
+    // Registers of the interpreter handed to the machine code; sp is written back when it returns.
+    struct JitFrame {
+        StackElem* sp;
+        StackElem* bp;
+        StackElem* sp_limit;
+        char* globals;          // data of the global pool
+        VM* vm;
+    };
+
+    // Machine code of a function, stitched together from a precompiled template for each code, with the
+    // operands, jump targets and exits patched in. It works on the stack frame of the interpreter. Calls and
+    // returns go through VM::transfer and jump straight into the machine code of the other function if it has
+    // some; everything else that needs the VM (allocations, native calls, any code that would raise an error)
+    // is left to the interpreter, so tracebacks and the collector see the same state as without the JIT.
+    class NativeCode {
+    public:
+
+        NativeCode(const NativeCode&) = delete;
+        NativeCode& operator=(const NativeCode&) = delete;
+
+        ~NativeCode();
+
+        // Run from the code at pc until one left to the interpreter; returns its index in the function
+        // current by then.
+        Size_t run(JitFrame& frame, Size_t pc)const;
+
+        // machine code of the code at pc
+        const void* address(Size_t pc)const {
+            return memory + entries[pc];
+        }
+
+        // bytes of machine code
+        size_t size()const {
+            return code_size;
+        }
+
+        // Compile f; returns null if there is no JIT for this platform or no executable memory.
+        static std::unique_ptr<NativeCode> compile(const FunctionCode& f);
+
+    private:
+
+        NativeCode(unsigned char* memory, size_t mapped_size, size_t code_size, std::vector<uint32_t>&& entries) :
+            memory(memory), mapped_size(mapped_size), code_size(code_size), entries(std::move(entries)) {}
+
+        unsigned char* memory;
+        size_t mapped_size;
+        size_t code_size;
+        std::vector<uint32_t> entries;      // offset of the code of each instruction
+    };
+
+}
+
+#endif
@@ -1,6 +1,8 @@
 
 #include "lexer.h"
 
+#include <cctype>
+
 using namespace mini;
 
 const std::unordered_map<char, Keyword> Lexer::operator_map = {
@@ -186,6 +188,64 @@ void Lexer::tokenize(const std::string& str, std::vector<Token>& token_buffer, u
 }
 
 
+void Lexer::scan_imports(const std::string& str, std::vector<std::string>& imports) {
+
+    size_t i = 0;
+    auto skip_white = [&]() {
+        while (i < str.size()) {
+            if (str[i] == ' ' || str[i] == '\t' || str[i] == '\n' || str[i] == '\r') i++;
+            else if (str[i] == comment_begin) while (i < str.size() && str[i] != '\n') i++;
+            else break;
+        }
+    };
+    auto match_word = [&]() {
+        size_t b = i;
+        while (i < str.size() && (isalnum((unsigned char)str[i]) || str[i] == '_')) i++;
+        return str.substr(b, i - b);
+    };
+
+    while (i < str.size()) {
+        // at the beginning of a statement
+        skip_white();
+        if (match_word() == "import") {
+            std::string name;
+            skip_white();
+            std::string part = match_word();
+            while (!part.empty()) {
+                name += part;
+                skip_white();
+                if (i < str.size() && str[i] == '.') {
+                    i++;
+                    skip_white();
+                    part = match_word();
+                    if (part.empty()) name.clear();
+                    else name += '/';
+                }
+                else {
+                    break;
+                }
+            }
+            if (!name.empty() && i < str.size() && str[i] == ';') {
+                imports.push_back(name);
+            }
+        }
+        // to the next statement
+        while (i < str.size() && str[i] != ';') {
+            if (str[i] == comment_begin) {
+                while (i < str.size() && str[i] != '\n') i++;
+            }
+            else if (str[i] == '\'' || str[i] == '\"') {
+                char quote = str[i++];
+                while (i < str.size() && str[i] != quote) i += str[i] == '\\' ? 2 : 1;
+                if (i < str.size()) i++;
+            }
+            else {
+                i++;
+            }
+        }
+        if (i < str.size()) i++;
+    }
+}
 
 // do the normal reduction for [begin,pos). pos unchanged; begin->none; state->empty
 void Lexer::reduce_normal(const std::string& str, std::vector<Token>& token_buffer) {
@@ -38,6 +38,10 @@ namespace mini {
         // LALR
         void tokenize(const std::string& str, std::vector<Token>& token_buffer, unsigned file_no = 0);
 
+        // Find the files imported by str ("a/b" for "import a.b;") without tokenizing it. This is only a
+        // guess made ahead of parsing: it skips comments and strings but does not check the other statements.
+        static void scan_imports(const std::string& str, std::vector<std::string>& imports);
+
     private:
 
         // pos++, begin does not change (but if begin == none, set begin = pos)
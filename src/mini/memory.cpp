@@ -1,36 +1,125 @@
-
 #include "memory.h"
 #include "ir.h"
+#include "profiler.h"
+
+#include <new>
 
 using namespace mini;
 
-Address MemorySection::allocate(MemoryObject::Type_t objtype, Size_t dyn_size) {
+Address MemorySection::allocate(MemoryObject::Type_t objtype, Size_t dyn_size, unsigned char typebit) {
 
-    // if there is a memory pool, we would 
-    // 1) allocate a segment of memory with sizeof(xxxObject) + dyn_size
-    // 2) set p->set_dataptr(p+sizeof(xxxObject), dyn_size)
-    // 3) cast.
+    static_assert(sizeof(ArrayObject) == sizeof(MemoryObject) && sizeof(ClosureObject) == sizeof(MemoryObject)
+        && sizeof(ClassObject) == sizeof(MemoryObject), "Memory objects must share the header layout");
 
+    // header and data are allocated as a single block
     Address addr = get_free_slot();
+    void* block = SlabAllocator::local().allocate(sizeof(MemoryObject) + dyn_size);
     MemoryObject* p = 0;
     switch (objtype)
     {
-    case MemoryObject::Type_t::ARRAY: p = new ArrayObject(); break;
-    case MemoryObject::Type_t::CLOSURE: p = new ClosureObject(); break;
-    case MemoryObject::Type_t::CLASS: p = new ClassObject(); break;
+    case MemoryObject::Type_t::ARRAY: p = new (block) ArrayObject(); break;
+    case MemoryObject::Type_t::CLOSURE: p = new (block) ClosureObject(); break;
+    case MemoryObject::Type_t::CLASS: p = new (block) ClassObject(); break;
     default:
         break;
     }
-    p->set_dataptr(malloc(dyn_size), dyn_size); // may be replaced by custom allocator
+    p->set_dataptr(static_cast<char*>(block) + sizeof(MemoryObject), dyn_size);
+    p->typebit = typebit;
     if (objtype == MemoryObject::Type_t::CLASS) {
         memset(p->data, 0, dyn_size);
     }
 
     table[addr] = p;
+    allocated_bytes += sizeof(MemoryObject) + dyn_size;
+#ifdef MINI_PROFILE
+    if (profiler) profiler->record(objtype, typebit, sizeof(MemoryObject) + dyn_size);
+#endif
 
     return addr;
 }
 
-Address MemorySection::get_free_slot() const {
-    return table.size() + 1;
+Address MemorySection::get_free_slot() {
+    if (!free_slots.empty()) {
+        Address addr = free_slots.back();
+        free_slots.pop_back();
+        return addr;
+    }
+    table.push_back(nullptr);
+    return table.size() - 1;
+}
+
+void MemorySection::register_layouts(const IRProgram& irprog) {
+
+    layout_refs.assign(irprog.constant_pool.size(), {});
+
+    for (Size_t i = 0; i < irprog.constant_pool.size(); i++) {
+        if (irprog.constant_pool[i]->get_type() != ConstantPoolObject::CLASS_LAYOUT) continue;
+
+        // unboxed primitives never hold a reference; anything else (including top) is traced.
+        for (const auto& f : irprog.constant_pool[i]->as<ClassLayout>()->fields) {
+            if (f.kind == 3) layout_refs[i].push_back(f.offset);
+        }
+    }
+}
+
+void MemorySection::trace() {
+
+    while (!mark_stack.empty()) {
+        MemoryObject* obj = mark_stack.back();
+        mark_stack.pop_back();
+
+        switch (obj->type)
+        {
+        case MemoryObject::Type_t::ARRAY:
+            if (obj->typebit == 3) {
+                for (Size_t i = 0; i + 4 <= obj->size; i += 4) {
+                    mark(obj->fetch4(i).aarg);
+                }
+            }
+            break;
+        case MemoryObject::Type_t::CLOSURE:
+            // binding types are not recorded; scan them conservatively.
+            for (Size_t i = 4; i + 4 <= obj->size; i += 4) {
+                mark(obj->fetch4(i).aarg);
+            }
+            break;
+        case MemoryObject::Type_t::CLASS: {
+            Size_t layout = obj->as<ClassObject>()->layout_addr();
+            if (layout < layout_refs.size()) {
+                for (const auto& offset : layout_refs[layout]) {
+                    mark(obj->fetch4(offset).aarg);
+                }
+            }
+            break;
+        }
+        default:
+            break;
+        }
+    }
+}
+
+void MemorySection::sweep() {
+
+    survived_bytes = 0;
+    for (Address addr = 1; addr < table.size(); addr++) {
+        MemoryObject* obj = table[addr];
+        if (!obj) {
+            continue;
+        }
+        if (obj->marked) {
+            obj->marked = false;
+            survived_bytes += sizeof(MemoryObject) + obj->size;
+        }
+        else {
+            stat.freed_objects++;
+            stat.freed_bytes += sizeof(MemoryObject) + obj->size;
+            free_slots.push_back(addr);
+            release(obj);
+            table[addr] = nullptr;
+        }
+    }
+
+    // the heap may grow up to twice of the surviving size before next collection
+    allocated_bytes = 0;
+    next_collection = std::max(threshold, survived_bytes);
 }
@@ -2,12 +2,14 @@
 #define MEMORY_H
 
 #include "ir.h"
+#include "allocator.h"
 
-#include <unordered_map>
 #include <vector>
+#include <chrono>
 
 namespace mini {
 
+    class HeapProfiler;
 
     class MemoryObject {
     public:
@@ -19,9 +21,10 @@ namespace mini {
         };
 
         Type_t type;
+        bool marked = false;            // gc metadata
+        unsigned char typebit = 0;      // element type of arrays (same as the suffix of alloc)
         Size_t size;          // size of data in bytes. Total size should be sizeof(T) + T.size
-        Size_t ref_count = 0;     // also metadata for gc
-        void* data;
+        void* data;           // data is placed right after the header
 
 
         void set_dataptr(void* ptr, Size_t size) {
@@ -44,8 +47,6 @@ namespace mini {
             *reinterpret_cast<StackElem*>(static_cast<char*>(data) + index) = value;
         }
 
-        virtual ~MemoryObject() {}
-
         template<class T>
         const T* as()const {
             static_assert(std::is_base_of<MemoryObject, T>::value);
@@ -87,7 +88,7 @@ namespace mini {
         void move_from(StackElem* src) {
             memcpy(static_cast<char*>(data) + 4, src, data_size());
         }
-        void move_to(StackElem* dst) {
+        void move_to(StackElem* dst)const {
             memcpy(dst, static_cast<char*>(data) + 4, data_size());
         }
 
@@ -108,37 +109,134 @@ namespace mini {
     class MemorySection {
     public:
 
-        std::unordered_map<Address, MemoryObject*> table;
+        struct Statistics {
+            Size_t collections = 0;
+            Size_t freed_objects = 0;
+            size_t freed_bytes = 0;
+            double total_time = 0.0;    // in seconds
+            double max_pause = 0.0;
+        };
+
+        static const size_t default_threshold = 8 << 20;
 
-        MemorySection() {}
+        // Handle table: object of each address; the slot is null if the address is not in use. Address 0 is always null.
+        std::vector<MemoryObject*> table;
+
+        MemorySection() : table(1, nullptr) {}
 
         MemoryObject* fetch(Address addr) {
             return const_cast<MemoryObject*>(const_cast<const MemorySection*>(this)->fetch(addr));
         }
         const MemoryObject* fetch(Address addr)const {
-            if (addr == 0) {
-                throw RuntimeError("The memory address is null");
+            if (addr < table.size() && table[addr]) {
+                return table[addr];
             }
-            auto t = table.find(addr);
-            if (t == table.end()) {
-                throw RuntimeError("Invalid address: " + std::to_string(addr));
-            }
-            else {
-                return t->second;
+            throw_invalid_address(addr);
+        }
+
+        // Allocate an object. Never collects; only raises collect_requested() when the threshold is reached.
+        Address allocate(MemoryObject::Type_t objtype, Size_t dyn_size, unsigned char typebit = 0);
+
+#ifdef MINI_PROFILE
+        // Report each allocation to profiler; null to stop.
+        void set_profiler(HeapProfiler* profiler) {
+            this->profiler = profiler;
+        }
+#endif
+
+        Address get_free_slot();
+
+        // Build the pointer maps of class layouts from the field types. Must be called before collecting.
+        void register_layouts(const IRProgram& irprog);
+
+        // Bytes allocated since last collection before a collection is requested. 0 disables the collector.
+        void set_threshold(size_t bytes) {
+            threshold = bytes;
+            next_collection = bytes;
+        }
+
+        bool collect_requested()const {
+            return threshold > 0 && allocated_bytes >= next_collection;
+        }
+
+        // Mark phase: treat value as a (possible) reference. Invalid addresses are ignored.
+        void mark(Address addr) {
+            if (addr < table.size() && table[addr] && !table[addr]->marked) {
+                table[addr]->marked = true;
+                mark_stack.push_back(table[addr]);
             }
         }
 
-        Address allocate(MemoryObject::Type_t objtype, Size_t dyn_size);
+        // Trace all objects reachable from the marked roots.
+        void trace();
+
+        // Sweep phase: free unmarked objects and reset the mark of the others.
+        void sweep();
 
-        Address get_free_slot()const;
+        // Collect with the given roots.
+        template<typename MarkRoots>
+        void collect(MarkRoots mark_roots) {
+            auto t_start = std::chrono::steady_clock::now();
+
+            mark_roots(*this);
+            trace();
+            sweep();
+
+            double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - t_start).count();
+            stat.collections++;
+            stat.total_time += t;
+            stat.max_pause = std::max(stat.max_pause, t);
+        }
+
+        const Statistics& statistics()const {
+            return stat;
+        }
+
+        size_t live_bytes()const {
+            return allocated_bytes + survived_bytes;
+        }
+
+        Size_t live_objects()const {
+            return table.size() - 1 - free_slots.size();
+        }
 
         ~MemorySection() {
-            for (const auto& t : table) {
-                free(t.second->data);
-                delete t.second;
+            for (const auto& obj : table) {
+                if (obj) release(obj);
+            }
+        }
+
+    private:
+
+        [[noreturn]] static void throw_invalid_address(Address addr) {
+            if (addr == 0) {
+                throw RuntimeError("The memory address is null");
+            }
+            else {
+                throw RuntimeError("Invalid address: " + std::to_string(addr));
             }
         }
 
+        // return the memory of obj to the allocator
+        void release(MemoryObject* obj) {
+            SlabAllocator::local().deallocate(obj, sizeof(MemoryObject) + obj->size);
+        }
+
+        std::vector<Address> free_slots;      // recycled addresses
+
+        std::vector<MemoryObject*> mark_stack;
+        std::vector<std::vector<Size_t>> layout_refs;     // offsets of reference fields, keyed by layout index
+
+        size_t threshold = default_threshold;
+        size_t next_collection = default_threshold;
+        size_t allocated_bytes = 0;     // since last collection
+        size_t survived_bytes = 0;      // after last collection
+
+        Statistics stat;
+
+#ifdef MINI_PROFILE
+        HeapProfiler* profiler = nullptr;
+#endif
     };
 
 }
@@ -2,11 +2,13 @@
 #ifndef MINI_H
 #define MINI_H
 
+#include "cppgen.h"
 #include "frontend.h"
 #include "vm.h"
 
 #include <cstdio>
 #include <string>
+#include <thread>
 
 namespace mini {
 
@@ -15,11 +17,22 @@ namespace mini {
         enum class Mode {
             COMPILE = 0,
             EXEC = 1,
-            COMPILE_EXEC = 2
+            COMPILE_EXEC = 2,
+            TRANSLATE = 3,      // to C++
         };
         
         std::string arg;
         bool execute_from_file = true;
+        bool verbose = false;
+        bool dump = false;
+        bool use_module_cache = true;
+        unsigned parse_threads = std::thread::hardware_concurrency();
+        std::string output_file;    // of the bytecode image or C++ source; derived from arg if empty
+        std::string profile_file;   // JSON profile of the run; no profiling if empty
+        std::string sample_file;    // collapsed stacks sampled during the run; no sampling if empty
+        bool heap_profile = false;
+        bool compile_report = false;        // print the report of the frontend
+        std::string compile_report_file;    // JSON of the report of the frontend; not written if empty
         Mode mode = Mode::COMPILE_EXEC;
 
         CompilerFrontEnd frontend;
@@ -50,9 +63,21 @@ namespace mini {
             if (argc < 2 || strcmp(argv[1], "-h") == 0) {
                 std::cout << "Usage: mini [option] ... [-e command | filename]\n";
                 std::cout << "Avaiable options are:\n";
-                std::cout << "  -c        : Compile the program to bytecodes instead of evaluating it.\n";
+                std::cout << "  -a        : Translate the program to C++ instead of evaluating it (see aotruntime.h).\n";
+                std::cout << "  -c        : Compile the program to a bytecode image instead of evaluating it.\n";
+                std::cout << "  -d        : Print the bytecodes in text form.\n";
                 std::cout << "  -e command: Execute command directly.\n";
-                std::cout << "  -p        : Run from bytecodes.\n";
+                std::cout << "  -g size   : Heap growth (in KB) that triggers a garbage collection. 0 disables it.\n";
+                std::cout << "  -j n      : Threads lexing and parsing imported files (default: number of cores).\n";
+                std::cout << "  -J n      : Compile a function to machine code after n calls (x86-64 Linux only; default 0: never).\n";
+                std::cout << "  -m        : Profile the allocations; print the top allocation sites and the live objects (needs MINI_PROFILE).\n";
+                std::cout << "  -n        : Do not use the module cache (in $MINICACHE, or mini-cache in the temporary directory).\n";
+                std::cout << "  -o file   : Name of the file written by -c or -a (default: source name with .mbc or .cpp).\n";
+                std::cout << "  -p        : Run from a bytecode image.\n";
+                std::cout << "  -s file   : Sample the call stack every 1ms of CPU time; write collapsed stacks to file (needs MINI_PROFILE).\n";
+                std::cout << "  -P file   : Profile opcodes and functions; print a report and write it to file as JSON (needs MINI_PROFILE).\n";
+                std::cout << "  -t        : Print the time and memory of each compilation phase and file.\n";
+                std::cout << "  -T file   : Write the report of -t to file as JSON.\n";
                 std::cout << "  -v        : Verbose.\n";
                 std::cout << std::endl;
                 exit(0);
@@ -65,9 +90,48 @@ namespace mini {
                     else if (strcmp(argv[i], "-c") == 0) {
                         mode = Mode::COMPILE;
                     }
+                    else if (strcmp(argv[i], "-a") == 0) {
+                        mode = Mode::TRANSLATE;
+                    }
                     else if (strcmp(argv[i], "-p") == 0) {
                         mode = Mode::EXEC;
                     }
+                    else if (strcmp(argv[i], "-d") == 0) {
+                        dump = true;
+                    }
+                    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+                        output_file = argv[++i];
+                    }
+                    else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+                        profile_file = argv[++i];
+                    }
+                    else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+                        sample_file = argv[++i];
+                    }
+                    else if (strcmp(argv[i], "-g") == 0 && i + 1 < argc) {
+                        vm.set_gc_threshold(size_t(std::stoul(argv[++i])) << 10);
+                    }
+                    else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+                        parse_threads = unsigned(std::stoul(argv[++i]));
+                    }
+                    else if (strcmp(argv[i], "-J") == 0 && i + 1 < argc) {
+                        vm.set_jit_threshold(Size_t(std::stoul(argv[++i])));
+                    }
+                    else if (strcmp(argv[i], "-m") == 0) {
+                        heap_profile = true;
+                    }
+                    else if (strcmp(argv[i], "-n") == 0) {
+                        use_module_cache = false;
+                    }
+                    else if (strcmp(argv[i], "-t") == 0) {
+                        compile_report = true;
+                    }
+                    else if (strcmp(argv[i], "-T") == 0 && i + 1 < argc) {
+                        compile_report_file = argv[++i];
+                    }
+                    else if (strcmp(argv[i], "-v") == 0) {
+                        verbose = true;
+                    }
                     else {
                         arg = argv[i];
                     }
@@ -75,12 +139,29 @@ namespace mini {
             }
 
             frontend.initialize(search_paths);
+            frontend.set_parse_threads(parse_threads);
+
+            if (use_module_cache) {
+                char* cache_dir = std::getenv("MINICACHE");
+                std::error_code ec;
+                auto temp_dir = std::filesystem::temp_directory_path(ec);
+                if (cache_dir) {
+                    frontend.enable_module_cache(cache_dir);
+                }
+                else if (!ec) {
+                    frontend.enable_module_cache(temp_dir / "mini-cache");
+                }
+            }
         }
 
         int exec() {
 
-            if (mode == Mode::COMPILE || mode == Mode::COMPILE_EXEC) {
+            if (mode == Mode::COMPILE || mode == Mode::COMPILE_EXEC || mode == Mode::TRANSLATE) {
                 int ret;
+                CompileReport report;
+                if (compile_report || !compile_report_file.empty()) {
+                    frontend.set_report(&report);
+                }
                 try {
                     if (execute_from_file) {
                         frontend.load_file(arg);
@@ -100,20 +181,117 @@ namespace mini {
                     e.print(frontend.filename_table(), output) << '\n';
                     return 1;
                 }
+                if (compile_report) {
+                    report.print(std::cerr);
+                }
+                if (!compile_report_file.empty()) {
+                    std::ofstream ofs(compile_report_file);
+                    if (!ofs) {
+                        std::cerr << "Cannot write the compile report to " << compile_report_file << '\n';
+                        return 1;
+                    }
+                    report.write_json(ofs);
+                }
+                frontend.set_report(nullptr);
                 if (ret != 0) return 1;
+                if (verbose) {
+                    if (frontend.get_module_cache()) {
+                        frontend.get_module_cache()->print_statistics(std::cerr);
+                    }
+                    frontend.bytecode_optimizer().print_statistics(std::cerr);
+                }
                 if (mode == Mode::COMPILE) {
-                    // dump the ir (should be binary, but here I use text for debugging)
-                    StdoutOutputStream output;
-                    irprog.print_full(output);
+                    if (output_file.empty()) {
+                        output_file = execute_from_file ? std::filesystem::path(arg).replace_extension(".mbc").string() : "out.mbc";
+                    }
+                    BinaryStream bs;
+                    irprog.serialize(bs);
+                    try {
+                        FileLoader::write_binary_file(output_file, bs.buffer);
+                    }
+                    catch (const IOError& e) {
+                        StdoutOutputStream output;
+                        e.print(output) << '\n';
+                        return 1;
+                    }
+                }
+                else if (mode == Mode::TRANSLATE) {
+                    if (output_file.empty()) {
+                        output_file = execute_from_file ? std::filesystem::path(arg).replace_extension(".cpp").string() : "out.cpp";
+                    }
+                    StringOutputStream source;
+                    try {
+                        CppGenerator().generate(irprog, execute_from_file ? arg : "<command>", source);
+                        FileLoader::write_binary_file(output_file, source.str());
+                    }
+                    catch (const IOError& e) {
+                        StdoutOutputStream output;
+                        e.print(output) << '\n';
+                        return 1;
+                    }
                 }
             }
             else if (mode == Mode::EXEC) {
-                // load the ir
+                try {
+                    irprog.map_image(arg);
+                }
+                catch (const IOError& e) {
+                    StdoutOutputStream output;
+                    e.print(output) << '\n';
+                    return 1;
+                }
+            }
+
+            if (dump) {
+                StdoutOutputStream output;
+                irprog.print_full(output);
             }
 
             if (mode == Mode::COMPILE_EXEC || mode == Mode::EXEC) {
+                if (!profile_file.empty() || !sample_file.empty() || heap_profile) {
+#ifdef MINI_PROFILE
+                    if (!profile_file.empty()) vm.enable_profiler();
+                    if (heap_profile) vm.enable_heap_profiler();
+#else
+                    std::cerr << "Warning: mini is built without MINI_PROFILE; -P, -s and -m are ignored.\n";
+#endif
+                }
                 vm.load(irprog);
+#ifdef MINI_PROFILE
+                if (!sample_file.empty() && !vm.enable_sampler()) {
+                    std::cerr << "Warning: the system has no profiling timer; -s is ignored.\n";
+                }
+#endif
                 vm.run();
+                if (verbose) {
+                    vm.print_gc_statistics(std::cerr);
+                    vm.print_jit_statistics(std::cerr);
+                    vm.print_quickening_statistics(std::cerr);
+                }
+#ifdef MINI_PROFILE
+                if (vm.get_profiler()) {
+                    vm.get_profiler()->print_report(std::cerr, irprog);
+                    std::ofstream ofs(profile_file);
+                    if (!ofs) {
+                        std::cerr << "Cannot write the profile to " << profile_file << '\n';
+                        return 1;
+                    }
+                    vm.get_profiler()->write_json(ofs, irprog);
+                }
+                vm.print_heap_profile(std::cerr);
+                if (vm.get_sampler()) {
+                    vm.get_sampler()->stop();
+                    std::ofstream ofs(sample_file);
+                    if (!ofs) {
+                        std::cerr << "Cannot write the samples to " << sample_file << '\n';
+                        return 1;
+                    }
+                    vm.get_sampler()->write_collapsed(ofs, irprog);
+                    if (verbose) {
+                        std::cerr << "Sampler: " << vm.get_sampler()->samples() << " samples\n";
+                    }
+                }
+#endif
                 return vm.error_flag;
             }
             
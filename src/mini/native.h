@@ -13,6 +13,23 @@ namespace mini {
         FORMAT = 6,
     };
 
+    // Stack elements popped and pushed by a native function (see VM::call_native); false if there is none.
+    inline bool native_stack_effect(int index, int& pops, int& pushes) {
+        static const int effects[][2] = {
+            { 1, 1 },   // LEN
+            { 5, 0 },   // COPY
+            { 2, 1 },   // OPEN
+            { 1, 0 },   // CLOSE
+            { 3, 1 },   // READ
+            { 2, 0 },   // WRITE
+            { 2, 1 },   // FORMAT
+        };
+        if (index < 0 || index >= int(sizeof(effects) / sizeof(effects[0]))) return false;
+        pops = effects[index][0];
+        pushes = effects[index][1];
+        return true;
+    }
+
 }
 
 #endif
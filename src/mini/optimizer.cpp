@@ -0,0 +1,429 @@
+#include "optimizer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <climits>
+#include <iomanip>
+
+using namespace mini;
+
+void CodeBuffer::reset() {
+    targeted.assign(size() + 1, false);
+    removed.assign(size(), false);
+    for (const auto& c : function->codes) {
+        if (is_jump(c.code) && c.arg1.aarg <= size()) targeted[c.arg1.aarg] = true;
+    }
+}
+
+Size_t CodeBuffer::compact() {
+    auto& c = codes();
+    Size_t n = size();
+
+    // a dropped code is replaced by the next one kept
+    std::vector<Size_t> new_pc(n + 1);
+    Size_t kept = 0;
+    for (Size_t i = 0; i < n; i++) {
+        new_pc[i] = kept;
+        if (!removed[i]) c[kept++] = c[i];
+    }
+    new_pc[n] = kept;
+    c.resize(kept);
+
+    for (auto& b : c) {
+        if (is_jump(b.code) && b.arg1.aarg <= n) b.arg1 = StackElem(Address(new_pc[b.arg1.aarg]));
+    }
+
+    // Entries moved onto the same code are merged, keeping the last one: it is the line of the code that
+    // is actually there.
+    auto& table = lnt->line_number_table.edit();
+    auto range = std::equal_range(table.begin(), table.end(),
+        LineNumberTable::LineNumberPair{ findex, 0, 0 },
+        [](const LineNumberTable::LineNumberPair& a, const LineNumberTable::LineNumberPair& b) { return a.function_index < b.function_index; });
+    auto out = range.first;
+    for (auto e = range.first; e != range.second; e++) {
+        Size_t pc = e->pc <= n ? new_pc[e->pc] : kept;
+        if (pc >= kept) continue;
+        if (out != range.first && (out - 1)->pc == pc) {
+            (out - 1)->line_number = e->line_number;
+        }
+        else {
+            *out = *e;
+            out->pc = pc;
+            out++;
+        }
+    }
+    table.erase(out, range.second);
+
+    reset();
+    return n - kept;
+}
+
+
+// Replaces constant operands and their operation by the result.
+class ConstantFoldingPass : public BytecodePass {
+public:
+
+    const char* name()const {
+        return "constant-folding";
+    }
+
+    size_t run(CodeBuffer& b) {
+        size_t count = 0;
+        for (Size_t pc = 0; pc < b.size(); pc++) {
+            StackElem result;
+            ByteCode::OpCode result_code;
+            if (b.is_block(pc, 3) && fold_binary(b[pc], b[pc + 1], b[pc + 2].code, result_code, result)) {
+                b[pc] = { result_code, 0, result };
+                b.remove(pc + 1, 2);
+                pc += 2;
+                count++;
+            }
+            else if (b.is_block(pc, 2) && fold_unary(b[pc], b[pc + 1].code, result_code, result)) {
+                b[pc] = { result_code, 0, result };
+                b.remove(pc + 1);
+                pc += 1;
+                count++;
+            }
+        }
+        return count;
+    }
+
+private:
+
+    static int32_t cmp(int32_t a, int32_t b) { return a > b ? 1 : (a < b ? -1 : 0); }
+    static int32_t cmp(float a, float b) { return a > b ? 1 : (a < b ? -1 : 0); }
+
+    // Integer arithmetic wraps around as in the VM. Division is left to runtime when it may trap.
+    static bool fold_binary(const ByteCode& lhs, const ByteCode& rhs, ByteCode::OpCode op, ByteCode::OpCode& result_code, StackElem& result) {
+        if (lhs.code == ByteCode::CONSTI && rhs.code == ByteCode::CONSTI) {
+            int32_t a = lhs.arg1.iarg, b = rhs.arg1.iarg;
+            uint32_t ua = uint32_t(a), ub = uint32_t(b);
+            result_code = ByteCode::CONSTI;
+            switch (op)
+            {
+            case ByteCode::ADDI: result = StackElem(int32_t(ua + ub)); return true;
+            case ByteCode::SUBI: result = StackElem(int32_t(ua - ub)); return true;
+            case ByteCode::MULI: result = StackElem(int32_t(ua * ub)); return true;
+            case ByteCode::DIVI:
+                if (b == 0 || (a == INT32_MIN && b == -1)) return false;
+                result = StackElem(int32_t(a / b)); return true;
+            case ByteCode::REMI:
+                if (b == 0 || (a == INT32_MIN && b == -1)) return false;
+                result = StackElem(int32_t(a % b)); return true;
+            case ByteCode::AND: result = StackElem(int32_t(a & b)); return true;
+            case ByteCode::OR: result = StackElem(int32_t(a | b)); return true;
+            case ByteCode::XOR: result = StackElem(int32_t(a ^ b)); return true;
+            case ByteCode::CMPI: result = StackElem(cmp(a, b)); return true;
+            default: return false;
+            }
+        }
+        if (lhs.code == ByteCode::CONSTF && rhs.code == ByteCode::CONSTF) {
+            float a = lhs.arg1.farg, b = rhs.arg1.farg;
+            result_code = ByteCode::CONSTF;
+            switch (op)
+            {
+            case ByteCode::ADDF: result = StackElem(a + b); return true;
+            case ByteCode::SUBF: result = StackElem(a - b); return true;
+            case ByteCode::MULF: result = StackElem(a * b); return true;
+            case ByteCode::DIVF: result = StackElem(a / b); return true;
+            case ByteCode::REMF: result = StackElem(float(fmod(a, b))); return true;
+            case ByteCode::CMPF: result_code = ByteCode::CONSTI; result = StackElem(cmp(a, b)); return true;
+            default: return false;
+            }
+        }
+        return false;
+    }
+
+    static bool fold_unary(const ByteCode& arg, ByteCode::OpCode op, ByteCode::OpCode& result_code, StackElem& result) {
+        if (arg.code == ByteCode::CONSTI) {
+            int32_t a = arg.arg1.iarg;
+            result_code = ByteCode::CONSTI;
+            switch (op)
+            {
+            case ByteCode::NEGI: result = StackElem(int32_t(0u - uint32_t(a))); return true;
+            case ByteCode::NOT: result = StackElem(int32_t(!a)); return true;
+            case ByteCode::EQ: result = StackElem(int32_t(a == 0 ? 1 : 0)); return true;
+            case ByteCode::NE: result = StackElem(int32_t(a != 0 ? 1 : 0)); return true;
+            case ByteCode::LT: result = StackElem(int32_t(a < 0 ? 1 : 0)); return true;
+            case ByteCode::LE: result = StackElem(int32_t(a <= 0 ? 1 : 0)); return true;
+            case ByteCode::GT: result = StackElem(int32_t(a > 0 ? 1 : 0)); return true;
+            case ByteCode::GE: result = StackElem(int32_t(a >= 0 ? 1 : 0)); return true;
+            case ByteCode::I2F: result_code = ByteCode::CONSTF; result = StackElem(static_cast<float>(a)); return true;
+            default: return false;
+            }
+        }
+        if (arg.code == ByteCode::CONSTF) {
+            float a = arg.arg1.farg;
+            switch (op)
+            {
+            case ByteCode::NEGF: result_code = ByteCode::CONSTF; result = StackElem(-a); return true;
+            default: return false;     // F2I of an out of range value is left to the runtime
+            }
+        }
+        if (arg.code == ByteCode::CONST) {
+            char a = arg.arg1.carg;
+            switch (op)
+            {
+            case ByteCode::C2I: result_code = ByteCode::CONSTI; result = StackElem(int32_t(a)); return true;
+            case ByteCode::C2F: result_code = ByteCode::CONSTF; result = StackElem(static_cast<float>(a)); return true;
+            default: return false;
+            }
+        }
+        return false;
+    }
+};
+
+
+// Rewrites short sequences into shorter ones.
+class PeepholePass : public BytecodePass {
+public:
+
+    const char* name()const {
+        return "peephole";
+    }
+
+    size_t run(CodeBuffer& b) {
+        size_t count = 0;
+        for (Size_t pc = 0; pc < b.size(); pc++) {
+            auto code = b[pc].code;
+
+            // nop =>
+            if (code == ByteCode::NOP) {
+                b.remove(pc);
+                count++;
+            }
+            // consti 0; cmpi; <test> => <test>, as the sign of x is the sign of cmp(x, 0)
+            else if (code == ByteCode::CONSTI && b[pc].arg1.iarg == 0 && b.is_block(pc, 3)
+                && b[pc + 1].code == ByteCode::CMPI && is_test(b[pc + 2].code)) {
+                b.remove(pc, 2);
+                pc += 2;
+                count++;
+            }
+            // eq/not; jz => jnz;  eq/not; jnz => jz;  ne; jz/jnz => jz/jnz
+            else if ((code == ByteCode::EQ || code == ByteCode::NOT || code == ByteCode::NE) && b.is_block(pc, 2)
+                && (b[pc + 1].code == ByteCode::JZ || b[pc + 1].code == ByteCode::JNZ)) {
+                if (code != ByteCode::NE) {
+                    b[pc + 1].code = b[pc + 1].code == ByteCode::JZ ? ByteCode::JNZ : ByteCode::JZ;
+                }
+                b.remove(pc);
+                pc += 1;
+                count++;
+            }
+            // swap; swap =>
+            else if (code == ByteCode::SWAP && b.is_block(pc, 2) && b[pc + 1].code == ByteCode::SWAP) {
+                b.remove(pc, 2);
+                pc += 1;
+                count++;
+            }
+        }
+        return count;
+    }
+
+private:
+
+    static bool is_test(ByteCode::OpCode code) {
+        switch (code)
+        {
+        case ByteCode::EQ: case ByteCode::NE: case ByteCode::LT: case ByteCode::LE: case ByteCode::GT: case ByteCode::GE:
+            return true;
+        default:
+            return false;
+        }
+    }
+};
+
+
+// Removes values that are computed only to be popped.
+class DeadStackOpPass : public BytecodePass {
+public:
+
+    const char* name()const {
+        return "dead-stack-ops";
+    }
+
+    size_t run(CodeBuffer& b) {
+        size_t count = 0;
+        for (Size_t pc = 0; pc + 1 < b.size(); pc++) {
+            if (!b.is_block(pc, 2)) continue;
+            const auto& c = b[pc];
+            const auto& next = b[pc + 1];
+
+            // <push>; pop =>
+            if (next.code == ByteCode::POP && is_push(c.code)) {
+                b.remove(pc, 2);
+                pc += 1;
+                count++;
+            }
+            // <push>; retn => retn, since the frame is dropped anyway
+            else if (next.code == ByteCode::RETN && is_push(c.code)) {
+                b.remove(pc);
+                pc += 1;
+                count++;
+            }
+            // <unary>; pop => pop
+            else if (next.code == ByteCode::POP && is_unary(c.code)) {
+                b.remove(pc);
+                pc += 1;
+                count++;
+            }
+            // loadl x; storel x =>
+            else if (c.code >= ByteCode::LOADL && c.code <= ByteCode::LOADLA
+                && next.code == c.code - ByteCode::LOADL + ByteCode::STOREL && next.arg1.iarg == c.arg1.iarg) {
+                b.remove(pc, 2);
+                pc += 1;
+                count++;
+            }
+        }
+        return count;
+    }
+
+private:
+
+    // codes that only push a value
+    static bool is_push(ByteCode::OpCode code) {
+        switch (code)
+        {
+        case ByteCode::CONST: case ByteCode::CONSTI: case ByteCode::CONSTF: case ByteCode::CONSTA:
+        case ByteCode::LOADL: case ByteCode::LOADLI: case ByteCode::LOADLF: case ByteCode::LOADLA:
+        case ByteCode::LOADG: case ByteCode::DUP: case ByteCode::SHIFT:
+            return true;
+        default:
+            return false;
+        }
+    }
+    // codes that replace the stack top without side effect
+    static bool is_unary(ByteCode::OpCode code) {
+        switch (code)
+        {
+        case ByteCode::NEGI: case ByteCode::NEGF: case ByteCode::NOT:
+        case ByteCode::EQ: case ByteCode::NE: case ByteCode::LT: case ByteCode::LE: case ByteCode::GT: case ByteCode::GE:
+        case ByteCode::C2I: case ByteCode::C2F: case ByteCode::I2C: case ByteCode::I2F: case ByteCode::F2C: case ByteCode::F2I:
+            return true;
+        default:
+            return false;
+        }
+    }
+};
+
+
+// Shortens jumps and removes the codes no jump can reach.
+class JumpPass : public BytecodePass {
+public:
+
+    const char* name()const {
+        return "jumps";
+    }
+
+    size_t run(CodeBuffer& b) {
+        size_t count = 0;
+        for (Size_t pc = 0; pc < b.size(); pc++) {
+            if (b.is_removed(pc)) continue;
+            auto& c = b[pc];
+
+            if (CodeBuffer::is_jump(c.code)) {
+                // jump to a jmp => jump to its target
+                Address target = c.arg1.aarg;
+                for (Size_t hops = 0; target < b.size() && b[target].code == ByteCode::JMP && b[target].arg1.aarg != target && hops < b.size(); hops++) {
+                    target = b[target].arg1.aarg;
+                }
+                if (target != c.arg1.aarg) {
+                    c.arg1 = StackElem(target);
+                    count++;
+                }
+                // jmp to a return => return
+                if (c.code == ByteCode::JMP && target < b.size() && is_return(b[target].code)) {
+                    c = b[target];
+                    count++;
+                }
+                // jump to the next code =>
+                else if (target == next_kept(b, pc + 1)) {
+                    if (c.code == ByteCode::JMP) {
+                        b.remove(pc);
+                    }
+                    else {
+                        c = ByteCode::na_code(ByteCode::POP);   // a conditional jump still consumes its value
+                    }
+                    count++;
+                }
+            }
+            // consti c; jz/jnz => jmp or nothing
+            else if (c.code == ByteCode::CONSTI && b.is_block(pc, 2) && (b[pc + 1].code == ByteCode::JZ || b[pc + 1].code == ByteCode::JNZ)) {
+                bool taken = (c.arg1.iarg == 0) == (b[pc + 1].code == ByteCode::JZ);
+                if (taken) {
+                    c = ByteCode::sa_code_a(ByteCode::JMP, b[pc + 1].arg1.aarg);
+                    b.remove(pc + 1);
+                }
+                else {
+                    b.remove(pc, 2);
+                }
+                pc += 1;
+                count++;
+                continue;
+            }
+
+            // <terminal>; <not a jump target>... =>
+            if (CodeBuffer::is_terminal(b[pc].code) && !b.is_removed(pc)) {
+                Size_t end = pc + 1;
+                while (end < b.size() && !b.is_target(end)) {
+                    if (!b.is_removed(end)) {
+                        b.remove(end);
+                        count++;
+                    }
+                    end++;
+                }
+                pc = end - 1;
+            }
+        }
+        return count;
+    }
+
+private:
+
+    static Size_t next_kept(const CodeBuffer& b, Size_t pc) {
+        while (pc < b.size() && b.is_removed(pc)) pc++;
+        return pc;
+    }
+
+    static bool is_return(ByteCode::OpCode code) {
+        return code == ByteCode::RETN || (code >= ByteCode::RET && code <= ByteCode::RETA);
+    }
+};
+
+
+BytecodeOptimizer::BytecodeOptimizer() {
+    add_pass(std::make_unique<ConstantFoldingPass>());
+    add_pass(std::make_unique<PeepholePass>());
+    add_pass(std::make_unique<DeadStackOpPass>());
+    add_pass(std::make_unique<JumpPass>());
+}
+
+void BytecodeOptimizer::process(IRProgram& irprog) {
+    LineNumberTable* lnt = irprog.fetch_constant(irprog.line_number_table_index)->as<LineNumberTable>();
+
+    for (Size_t i = 0; i < irprog.constant_pool.size(); i++) {
+        if (irprog.constant_pool[i]->get_type() != ConstantPoolObject::FUNCTION) continue;
+
+        Function* f = irprog.constant_pool[i]->as<Function>();
+        codes_before += f->codes.size();
+        CodeBuffer buffer(f, i, lnt);
+        for (unsigned round = 0; round < max_rounds; round++) {
+            size_t rewrites = 0;
+            for (size_t p = 0; p < passes.size(); p++) {
+                size_t r = passes[p]->run(buffer);
+                stat[p].rewrites += r;
+                stat[p].removed_codes += buffer.compact();
+                rewrites += r;
+            }
+            if (rewrites == 0) break;
+        }
+        codes_after += f->codes.size();
+    }
+}
+
+void BytecodeOptimizer::print_statistics(std::ostream& os)const {
+    os << "Optimizer: " << codes_before << " codes -> " << codes_after << " codes\n";
+    for (const auto& s : stat) {
+        os << "  " << std::left << std::setw(18) << s.name << std::right
+            << s.rewrites << " rewrites, " << s.removed_codes << " codes removed\n";
+    }
+}
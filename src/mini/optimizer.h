@@ -0,0 +1,132 @@
+#ifndef MINI_OPTIMIZER_H
+#define MINI_OPTIMIZER_H
+
+#include "ir.h"
+
+#include <vector>
+#include <memory>
+#include <ostream>
+
+namespace mini {
+
+    // The codes of one function while being optimized. A pass rewrites codes in place and marks the ones
+    // to drop; compact() then removes them. A jump or a line number pointing at a dropped code is moved to
+    // the next code kept, so a pass may only drop codes that do nothing at the point they are reached.
+    class CodeBuffer {
+    public:
+
+        CodeBuffer(Function* function, Size_t findex, LineNumberTable* lnt) :
+            function(function), findex(findex), lnt(lnt) {
+            reset();
+        }
+
+        std::vector<ByteCode>& codes() {
+            return function->codes.edit();
+        }
+        Size_t size()const {
+            return function->codes.size();
+        }
+        const ByteCode& operator[](Size_t pc)const {
+            return function->codes[pc];
+        }
+        ByteCode& operator[](Size_t pc) {
+            return function->codes[pc];
+        }
+        bool is_target(Size_t pc)const {
+            return targeted[pc];
+        }
+        bool is_removed(Size_t pc)const {
+            return removed[pc];
+        }
+        // codes [pc, pc+n) exist and can only be entered at pc
+        bool is_block(Size_t pc, Size_t n)const {
+            if (pc + n > size()) return false;
+            for (Size_t i = pc; i < pc + n; i++) {
+                if (removed[i] || (i > pc && targeted[i])) return false;
+            }
+            return true;
+        }
+        void remove(Size_t pc) {
+            removed[pc] = true;
+        }
+        void remove(Size_t pc, Size_t n) {
+            for (Size_t i = pc; i < pc + n; i++) removed[i] = true;
+        }
+
+        // Drop the removed codes; returns the number dropped.
+        Size_t compact();
+
+        static bool is_jump(ByteCode::OpCode code) {
+            return code == ByteCode::JMP || code == ByteCode::JZ || code == ByteCode::JNZ;
+        }
+        // the next code is never executed after this one
+        static bool is_terminal(ByteCode::OpCode code) {
+            switch (code)
+            {
+            case ByteCode::JMP: case ByteCode::HALT: case ByteCode::THROW:
+            case ByteCode::RETN: case ByteCode::RET: case ByteCode::RETI: case ByteCode::RETF: case ByteCode::RETA:
+            case ByteCode::TAILCALL: case ByteCode::TAILCALLA:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+    private:
+
+        void reset();
+
+        Function* function;
+        Size_t findex;          // in constant pool
+        LineNumberTable* lnt;
+        std::vector<bool> targeted;
+        std::vector<bool> removed;
+    };
+
+    class BytecodePass {
+    public:
+
+        virtual ~BytecodePass() {}
+
+        virtual const char* name()const = 0;
+
+        // Rewrite the codes; returns the number of rewrites done.
+        virtual size_t run(CodeBuffer& buffer) = 0;
+    };
+
+    // Runs the passes on every function of an IRProgram after code generation, repeatedly until none of
+    // them finds anything more to do.
+    class BytecodeOptimizer {
+    public:
+
+        struct PassStatistics {
+            std::string name;
+            size_t rewrites = 0;
+            size_t removed_codes = 0;
+        };
+
+        // with the default passes
+        BytecodeOptimizer();
+
+        void add_pass(std::unique_ptr<BytecodePass> pass) {
+            passes.push_back(std::move(pass));
+            stat.push_back({ passes.back()->name() });
+        }
+
+        void process(IRProgram& irprog);
+
+        void print_statistics(std::ostream& os)const;
+
+    private:
+
+        static const unsigned max_rounds = 8;   // per function
+
+        std::vector<std::unique_ptr<BytecodePass>> passes;
+        std::vector<PassStatistics> stat;       // parallel to passes
+        size_t codes_before = 0;
+        size_t codes_after = 0;
+    };
+
+}
+
+#endif
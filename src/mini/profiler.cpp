@@ -0,0 +1,343 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define MINI_SAMPLER
+#endif
+
+using namespace mini;
+
+namespace {
+
+    struct FunctionSymbol {
+        std::string name;
+        std::string file;
+        int line = 0;       // 1-based; 0 if unknown
+    };
+
+    // line: of the code at pc
+    FunctionSymbol symbolize(const IRProgram& irprog, Size_t findex, Size_t pc = 0) {
+        FunctionSymbol s;
+        const FunctionInfo* fi = irprog.fetch_constant(irprog.fetch_constant(findex)->as<Function>()->info_index)->as<FunctionInfo>();
+        s.name = irprog.fetch_string(fi->name_index);
+        s.file = fi->symbol_info.is_absolute() ? "<builtin>" : irprog.fetch_string(fi->symbol_info.location.srcno);
+        try {
+            s.line = int(irprog.line_number_table()->query(findex, pc).line_number) + 1;
+        }
+        catch (const std::runtime_error&) {
+        }
+        return s;
+    }
+
+    std::string opcode_name(unsigned code) {
+        const char* name = ByteCode::name(code);
+        if (name) return name;
+        char buf[8];
+        snprintf(buf, sizeof(buf), "0x%02x", code);
+        return buf;
+    }
+
+    void write_json_string(std::ostream& os, const std::string& s) {
+        os << '"';
+        for (char c : s) {
+            switch (c) {
+            case '"': os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            case '\t': os << "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", unsigned(c));
+                    os << buf;
+                }
+                else {
+                    os << c;
+                }
+            }
+        }
+        os << '"';
+    }
+
+    // indices of the nonzero entries of counts, the largest first
+    template<typename T, typename Key>
+    std::vector<size_t> sorted_indices(const T& counts, size_t size, Key key) {
+        std::vector<size_t> r;
+        for (size_t i = 0; i < size; i++) {
+            if (key(counts[i])) r.push_back(i);
+        }
+        std::stable_sort(r.begin(), r.end(), [&](size_t a, size_t b) { return key(counts[a]) > key(counts[b]); });
+        return r;
+    }
+
+    const char* array_name(unsigned char typebit) {
+        static const char* names[] = { "array(char)", "array(int)", "array(float)", "array(ref)" };
+        return typebit < 4 ? names[typebit] : "array";
+    }
+
+    std::string class_name(const IRProgram& irprog, Size_t layout_index) {
+        const ClassLayout* cl = irprog.fetch_constant(layout_index)->as<ClassLayout>();
+        return "class " + irprog.fetch_string(irprog.fetch_constant(cl->info_index)->as<ClassInfo>()->name_index);
+    }
+
+    double percent(uint64_t part, uint64_t total) {
+        return total ? 100.0 * double(part) / double(total) : 0.0;
+    }
+
+    const char* cache_state(const Profiler::CacheProfile& c) {
+        return c.megamorphic ? "megamorphic" : c.layouts > 1 ? "polymorphic" : "monomorphic";
+    }
+}
+
+void Profiler::print_report(std::ostream& os, const IRProgram& irprog, size_t max_rows)const {
+    auto flags = os.flags();
+    auto precision = os.precision();
+    os << std::fixed << std::setprecision(2);
+
+    os << "Profile: " << instructions << " instructions\n";
+
+    os << "\nOpcodes:\n" << std::setw(14) << "count" << std::setw(9) << "%" << "  opcode\n";
+    auto ops = sorted_indices(opcodes, 256, [](uint64_t c) { return c; });
+    for (size_t i = 0; i < ops.size() && i < max_rows; i++) {
+        os << std::setw(14) << opcodes[ops[i]] << std::setw(9) << percent(opcodes[ops[i]], instructions)
+            << "  " << opcode_name(unsigned(ops[i])) << '\n';
+    }
+
+    os << "\nOpcode pairs:\n" << std::setw(14) << "count" << std::setw(9) << "%" << "  opcodes\n";
+    auto ps = sorted_indices(pairs, pairs.size(), [](uint64_t c) { return c; });
+    for (size_t i = 0; i < ps.size() && i < max_rows; i++) {
+        os << std::setw(14) << pairs[ps[i]] << std::setw(9) << percent(pairs[ps[i]], instructions)
+            << "  " << opcode_name(unsigned(ps[i] >> 8)) << ' ' << opcode_name(unsigned(ps[i] & 0xff)) << '\n';
+    }
+
+    os << "\nFunctions:\n" << std::setw(12) << "calls" << std::setw(14) << "exclusive" << std::setw(9) << "%"
+        << std::setw(14) << "inclusive" << std::setw(9) << "%" << "  function\n";
+    auto fs = sorted_indices(functions, functions.size(), [](const FunctionProfile& f) { return f.exclusive; });
+    for (size_t i = 0; i < fs.size() && i < max_rows; i++) {
+        const FunctionProfile& f = functions[fs[i]];
+        FunctionSymbol s = symbolize(irprog, Size_t(fs[i]));
+        os << std::setw(12) << f.calls
+            << std::setw(14) << f.exclusive << std::setw(9) << percent(f.exclusive, instructions)
+            << std::setw(14) << f.inclusive << std::setw(9) << percent(f.inclusive, instructions)
+            << "  " << s.name << " (" << s.file << ':' << s.line << ")\n";
+    }
+
+    if (!caches.empty()) {
+        std::vector<std::pair<uint64_t, CacheProfile>> sites(caches.begin(), caches.end());
+        uint64_t hits = 0, accesses = 0;
+        size_t megamorphic = 0;
+        for (const auto& [site, c] : sites) {
+            hits += c.hits;
+            accesses += c.hits + c.misses;
+            megamorphic += c.megamorphic;
+        }
+        std::stable_sort(sites.begin(), sites.end(), [](const auto& a, const auto& b) {
+            return a.second.hits + a.second.misses > b.second.hits + b.second.misses;
+        });
+        os << "\nInterface caches: " << sites.size() << " sites, " << accesses << " accesses, "
+            << percent(hits, accesses) << "% hits, " << megamorphic << " megamorphic\n"
+            << std::setw(14) << "accesses" << std::setw(9) << "hits %" << std::setw(9) << "layouts" << "  state        site\n";
+        for (size_t i = 0; i < sites.size() && i < max_rows; i++) {
+            const CacheProfile& c = sites[i].second;
+            FunctionSymbol s = symbolize(irprog, Size_t(sites[i].first >> 32), Size_t(sites[i].first));
+            os << std::setw(14) << c.hits + c.misses << std::setw(9) << percent(c.hits, c.hits + c.misses)
+                << std::setw(9) << c.layouts << "  " << std::left << std::setw(13) << cache_state(c) << std::right
+                << s.name << " (" << s.file << ':' << s.line << ")\n";
+        }
+    }
+
+    os.flags(flags);
+    os.precision(precision);
+}
+
+void Profiler::write_json(std::ostream& os, const IRProgram& irprog)const {
+    os << "{\n  \"instructions\": " << instructions << ",\n";
+
+    os << "  \"opcodes\": [";
+    auto ops = sorted_indices(opcodes, 256, [](uint64_t c) { return c; });
+    for (size_t i = 0; i < ops.size(); i++) {
+        os << (i ? ",\n    " : "\n    ") << "{\"opcode\": \"" << opcode_name(unsigned(ops[i])) << "\", \"count\": " << opcodes[ops[i]] << '}';
+    }
+    os << "\n  ],\n";
+
+    os << "  \"pairs\": [";
+    auto ps = sorted_indices(pairs, pairs.size(), [](uint64_t c) { return c; });
+    for (size_t i = 0; i < ps.size(); i++) {
+        os << (i ? ",\n    " : "\n    ") << "{\"first\": \"" << opcode_name(unsigned(ps[i] >> 8))
+            << "\", \"second\": \"" << opcode_name(unsigned(ps[i] & 0xff)) << "\", \"count\": " << pairs[ps[i]] << '}';
+    }
+    os << "\n  ],\n";
+
+    os << "  \"functions\": [";
+    auto fs = sorted_indices(functions, functions.size(), [](const FunctionProfile& f) { return f.calls; });
+    std::stable_sort(fs.begin(), fs.end(), [this](size_t a, size_t b) { return functions[a].exclusive > functions[b].exclusive; });
+    for (size_t i = 0; i < fs.size(); i++) {
+        const FunctionProfile& f = functions[fs[i]];
+        FunctionSymbol s = symbolize(irprog, Size_t(fs[i]));
+        os << (i ? ",\n    " : "\n    ") << "{\"index\": " << fs[i] << ", \"name\": ";
+        write_json_string(os, s.name);
+        os << ", \"file\": ";
+        write_json_string(os, s.file);
+        os << ", \"line\": " << s.line << ", \"calls\": " << f.calls
+            << ", \"exclusive\": " << f.exclusive << ", \"inclusive\": " << f.inclusive << '}';
+    }
+    os << "\n  ],\n";
+
+    os << "  \"interface_caches\": [";
+    size_t n = 0;
+    for (const auto& [site, c] : caches) {
+        FunctionSymbol s = symbolize(irprog, Size_t(site >> 32), Size_t(site));
+        os << (n++ ? ",\n    " : "\n    ") << "{\"function\": ";
+        write_json_string(os, s.name);
+        os << ", \"file\": ";
+        write_json_string(os, s.file);
+        os << ", \"line\": " << s.line << ", \"pc\": " << Size_t(site) << ", \"hits\": " << c.hits << ", \"misses\": " << c.misses
+            << ", \"layouts\": " << c.layouts << ", \"state\": \"" << cache_state(c) << "\"}";
+    }
+    os << "\n  ]\n}\n";
+}
+
+volatile sig_atomic_t Sampler::requested = 0;
+
+bool Sampler::start(unsigned interval_us) {
+#ifdef MINI_SAMPLER
+    struct sigaction sa = {};
+    sa.sa_handler = [](int) { Sampler::requested = 1; };
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, nullptr) != 0) return false;
+
+    itimerval timer = {};
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) return false;
+    running = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void Sampler::stop() {
+#ifdef MINI_SAMPLER
+    if (!running) return;
+    itimerval timer = {};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    signal(SIGPROF, SIG_IGN);
+    running = false;
+#endif
+    requested = 0;
+}
+
+void Sampler::write_collapsed(std::ostream& os, const IRProgram& irprog)const {
+    std::unordered_map<uint64_t, std::string> names;
+    std::map<std::string, uint64_t> lines;      // stacks at different codes of the same lines are merged
+    for (const auto& s : stacks) {
+        std::string line;
+        for (size_t i = s.first.size(); i-- > 0;) {
+            uint64_t f = s.first[i];
+            auto r = names.find(f);
+            if (r == names.end() && f == truncated) {
+                r = names.emplace(f, "[truncated]").first;
+            }
+            else if (r == names.end()) {
+                FunctionSymbol sym = symbolize(irprog, Size_t(f >> 32), Size_t(f & 0xffffffff));
+                std::string name = sym.name + " (" + sym.file + ':' + std::to_string(sym.line) + ')';
+                std::replace(name.begin(), name.end(), ';', ':');     // the frame separator
+                r = names.emplace(f, std::move(name)).first;
+            }
+            line += r->second;
+            if (i) line += ';';
+        }
+        lines[line] += s.second;
+    }
+    for (const auto& l : lines) {
+        os << l.first << ' ' << l.second << '\n';
+    }
+}
+
+void HeapProfiler::print_report(std::ostream& os, const MemorySection& heap, const IRProgram& irprog, size_t max_rows)const {
+    struct Row {
+        uint64_t objects, bytes;
+        std::string type, site;
+    };
+
+    std::vector<Row> rows;
+    uint64_t total_objects = 0, total_bytes = 0;
+    for (const auto& s : sites) {
+        uint64_t frame = std::get<0>(s.first);
+        Size_t findex = Size_t(frame >> 32), pc = Size_t(frame & 0xffffffff);
+        FunctionSymbol sym = symbolize(irprog, findex, pc);
+
+        std::string type;
+        switch (std::get<1>(s.first)) {
+        case MemoryObject::Type_t::ARRAY: type = array_name(std::get<2>(s.first)); break;
+        case MemoryObject::Type_t::CLOSURE: type = "closure"; break;
+        case MemoryObject::Type_t::CLASS: {
+            // the layout is the operand of the NEW at the site
+            const auto& codes = irprog.fetch_constant(findex)->as<Function>()->codes;
+            type = pc < codes.size() && codes[pc].code == ByteCode::NEW ? class_name(irprog, codes[pc].arg1.aarg) : "class";
+            break;
+        }
+        }
+        rows.push_back({ s.second.objects, s.second.bytes, type, sym.name + " (" + sym.file + ':' + std::to_string(sym.line) + ')' });
+        total_objects += s.second.objects;
+        total_bytes += s.second.bytes;
+    }
+
+    auto flags = os.flags();
+    auto precision = os.precision();
+    os << std::fixed << std::setprecision(2);
+
+    os << "Heap profile: " << total_objects << " objects, " << total_bytes << " bytes allocated\n";
+    auto print_sites = [&](const char* title, uint64_t Row::* key) {
+        std::vector<size_t> order = sorted_indices(rows, rows.size(), [key](const Row& r) { return r.*key; });
+        os << '\n' << title << ":\n" << std::setw(12) << "objects" << std::setw(9) << "%" << std::setw(14) << "bytes"
+            << std::setw(9) << "%" << "  type, site\n";
+        for (size_t i = 0; i < order.size() && i < max_rows; i++) {
+            const Row& r = rows[order[i]];
+            os << std::setw(12) << r.objects << std::setw(9) << percent(r.objects, total_objects)
+                << std::setw(14) << r.bytes << std::setw(9) << percent(r.bytes, total_bytes)
+                << "  " << r.type << ", " << r.site << '\n';
+        }
+    };
+    print_sites("Allocation sites by bytes", &Row::bytes);
+    print_sites("Allocation sites by objects", &Row::objects);
+
+    // objects still in heap, by type
+    std::map<std::string, SiteProfile> live;
+    uint64_t live_objects = 0, live_bytes = 0;
+    for (const MemoryObject* obj : heap.table) {
+        if (!obj) continue;
+        std::string type;
+        switch (obj->type) {
+        case MemoryObject::Type_t::ARRAY: type = array_name(obj->typebit); break;
+        case MemoryObject::Type_t::CLOSURE: type = "closure"; break;
+        case MemoryObject::Type_t::CLASS: type = class_name(irprog, obj->as<ClassObject>()->layout_addr()); break;
+        }
+        SiteProfile& p = live[type];
+        p.objects++;
+        p.bytes += sizeof(MemoryObject) + obj->size;
+        live_objects++;
+        live_bytes += sizeof(MemoryObject) + obj->size;
+    }
+    std::vector<std::pair<std::string, SiteProfile>> histogram(live.begin(), live.end());
+    std::stable_sort(histogram.begin(), histogram.end(), [](const auto& a, const auto& b) { return a.second.bytes > b.second.bytes; });
+    os << "\nLive objects: " << live_objects << " objects, " << live_bytes << " bytes\n" << std::setw(12) << "objects"
+        << std::setw(14) << "bytes" << std::setw(9) << "%" << "  type\n";
+    for (const auto& h : histogram) {
+        os << std::setw(12) << h.second.objects << std::setw(14) << h.second.bytes << std::setw(9) << percent(h.second.bytes, live_bytes)
+            << "  " << h.first << '\n';
+    }
+
+    os.flags(flags);
+    os.precision(precision);
+}
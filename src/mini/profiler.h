@@ -0,0 +1,178 @@
+#ifndef MINI_PROFILER_H
+#define MINI_PROFILER_H
+
+#include "ir.h"
+#include "memory.h"
+
+#include <csignal>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <ostream>
+#include <tuple>
+#include <vector>
+
+namespace mini {
+
+    // Counts of an interpreted run: executions per opcode and per pair of consecutive opcodes, and calls and
+    // instructions per function. Filled by the VM when built with MINI_PROFILE and enabled by
+    // VM::enable_profiler(); without MINI_PROFILE the interpreter has no hook at all.
+    class Profiler {
+    public:
+
+        struct FunctionProfile {
+            uint64_t calls = 0;
+            uint64_t exclusive = 0;     // instructions run in the function itself
+            uint64_t inclusive = 0;     // ... and in its callees; recursive calls are counted once
+        };
+
+        // before each instruction
+        void count(uint16_t code) {
+            instructions++;
+            opcodes[code & 0xff]++;
+            pairs[(last_code << 8) | (code & 0xff)]++;
+            last_code = code & 0xff;
+            if (!frames.empty()) functions[frames.back().function].exclusive++;
+        }
+
+        // A frame of function starts ...
+        void enter(Size_t function) {
+            if (function >= functions.size()) {
+                functions.resize(function + 1);
+                active.resize(function + 1, 0);
+            }
+            functions[function].calls++;
+            active[function]++;
+            frames.push_back({ function, instructions });
+        }
+
+        // ... and ends.
+        void leave() {
+            if (frames.empty()) return;
+            const Frame& f = frames.back();
+            if (--active[f.function] == 0) {
+                functions[f.function].inclusive += instructions - f.start;
+            }
+            frames.pop_back();
+        }
+
+        // End the frames still open, at HALT or after an error.
+        void finish() {
+            while (!frames.empty()) leave();
+        }
+
+        // The inline cache of an interface access site (see InterfaceCache in vm.h).
+        struct CacheProfile {
+            uint64_t hits = 0;
+            uint64_t misses = 0;
+            unsigned layouts = 0;
+            bool megamorphic = false;
+        };
+
+        // the cache of the code at pc of function, when the run ends
+        void record_cache(Size_t function, Size_t pc, const CacheProfile& cache) {
+            caches[(uint64_t(function) << 32) | pc] = cache;
+        }
+
+        // Sorted tables of the hottest opcodes, pairs and functions; names are resolved through irprog.
+        void print_report(std::ostream& os, const IRProgram& irprog, size_t max_rows = 20)const;
+
+        // Every nonzero count, as one JSON object.
+        void write_json(std::ostream& os, const IRProgram& irprog)const;
+
+    private:
+
+        struct Frame {
+            Size_t function;
+            uint64_t start;     // instructions when it was entered
+        };
+
+        uint64_t instructions = 0;
+        uint64_t opcodes[256] = {};
+        std::vector<uint64_t> pairs = std::vector<uint64_t>(256 * 256, 0);     // [previous << 8 | current]
+        uint16_t last_code = ByteCode::NOP;
+        std::vector<FunctionProfile> functions;     // keyed by constant pool index
+        std::vector<Size_t> active;                 // frames of each function on the stack
+        std::vector<Frame> frames;
+        std::map<uint64_t, CacheProfile> caches;    // keyed by function:pc
+    };
+
+    // Samples of the call stack, taken every interval of CPU time. A SIGPROF timer only sets requested; the VM
+    // checks it before each instruction (with MINI_PROFILE) and then walks its frames into record().
+    // Needs setitimer, i.e. a POSIX system.
+    class Sampler {
+    public:
+
+        // set by the signal handler
+        static volatile sig_atomic_t requested;
+
+        // A frame of a sample: the function (constant pool index) and the index of the code it is running.
+        static uint64_t frame(Size_t function, Size_t pc) {
+            return (uint64_t(function) << 32) | pc;
+        }
+
+        // Only the innermost frames of deeper stacks are kept, followed by this one.
+        static constexpr size_t max_depth = 1024;
+        static constexpr uint64_t truncated = ~uint64_t(0);
+
+        ~Sampler() {
+            stop();
+        }
+
+        // Start the timer; false if it is not supported or fails.
+        bool start(unsigned interval_us = 1000);
+
+        void stop();
+
+        // stack: the frames, innermost first
+        void record(const std::vector<uint64_t>& stack) {
+            stacks[stack]++;
+            sample_count++;
+        }
+
+        uint64_t samples()const {
+            return sample_count;
+        }
+
+        // One line per distinct stack, outermost frame first: "f1;f2;...;fn count", as read by flamegraph.pl and
+        // speedscope. A frame is "function (file:line)".
+        void write_collapsed(std::ostream& os, const IRProgram& irprog)const;
+
+    private:
+
+        std::map<std::vector<uint64_t>, uint64_t> stacks;
+        uint64_t sample_count = 0;
+        bool running = false;
+    };
+
+    // Allocations per site: the code that allocated (as Sampler::frame()), the kind of object and the element
+    // type of arrays. Filled by MemorySection::allocate when set by VM::enable_heap_profiler().
+    class HeapProfiler {
+    public:
+
+        struct SiteProfile {
+            uint64_t objects = 0;
+            uint64_t bytes = 0;         // with the headers
+        };
+
+        // site of the allocation being made; set by the VM
+        std::function<uint64_t()> current_site;
+
+        void record(MemoryObject::Type_t type, unsigned char typebit, size_t bytes) {
+            SiteProfile& s = sites[std::make_tuple(current_site(), type, typebit)];
+            s.objects++;
+            s.bytes += bytes;
+        }
+
+        // The top allocation sites by bytes and by count, then the objects in heap by type (class name, closure
+        // or array element type).
+        void print_report(std::ostream& os, const MemorySection& heap, const IRProgram& irprog, size_t max_rows = 20)const;
+
+    private:
+
+        std::map<std::tuple<uint64_t, MemoryObject::Type_t, unsigned char>, SiteProfile> sites;
+    };
+
+}
+
+#endif
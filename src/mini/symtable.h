@@ -4,6 +4,7 @@
 #include "value.h"
 
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 
 namespace mini {
@@ -201,6 +202,9 @@ namespace mini {
             return "new " + type_name;
         }
 
+        // fields set on a struct or a type variable, whose class is not known
+        std::unordered_set<std::string> untyped_field_assignments;
+
     private:
 
         typedef std::unordered_map<std::string, pTypedef> LocalTypeTable;
@@ -0,0 +1,78 @@
+#ifndef MINI_THREADPOOL_H
+#define MINI_THREADPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace mini {
+
+    // Runs tasks on up to max_threads worker threads, in order of submission. A worker is only started
+    // when a task finds none idle. The destructor waits for the tasks left.
+    class ThreadPool {
+    public:
+
+        explicit ThreadPool(unsigned max_threads) : max_threads(max_threads) {}
+
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            cv.notify_all();
+            for (auto& w : workers) {
+                w.join();
+            }
+        }
+
+        template<typename F>
+        std::future<void> submit(F task) {
+            auto job = std::make_shared<std::packaged_task<void()>>(std::move(task));
+            std::future<void> result = job->get_future();
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back([job]() { (*job)(); });
+                if (idle == 0 && workers.size() < max_threads) {
+                    workers.emplace_back([this]() { work(); });
+                }
+            }
+            cv.notify_one();
+            return result;
+        }
+
+    private:
+
+        void work() {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (true) {
+                idle++;
+                cv.wait(lock, [this]() { return stopping || !tasks.empty(); });
+                idle--;
+                if (tasks.empty()) return;      // stopping
+                auto task = std::move(tasks.front());
+                tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
+        }
+
+        unsigned max_threads;
+        unsigned idle = 0;
+        bool stopping = false;
+        std::vector<std::thread> workers;
+        std::deque<std::function<void()>> tasks;
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+}
+
+#endif
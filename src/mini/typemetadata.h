@@ -119,6 +119,7 @@ namespace mini {
         std::unordered_map<std::string, std::shared_ptr<Type>> fields;
         std::unordered_set<std::string> virtual_fields;
         std::vector<std::string> field_names;
+        std::unordered_map<std::string, unsigned> field_assignments;    // sets of the fields first declared here, on any subclass
 
         // (F-omega) constraints on args
 
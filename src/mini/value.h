@@ -23,6 +23,7 @@ namespace mini {
         Source source;      // where the variable comes from (local/global/arg/binding)
         pType prog_type;    // attributed type
         bool has_assigned = false;
+        unsigned assignments = 0;      // number of let/set giving it a value
 
         VarMetaData(const pSymbol& symbol, Index_t scope, Index_t index, Source source) :
             symbol(symbol), scope(scope), index(index), source(source), prog_type(nullptr) {
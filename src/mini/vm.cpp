@@ -3,6 +3,7 @@
 #include "native.h"
 #include <iostream>
 #include <fstream>
+#include <iomanip>
 
 using namespace mini;
 
@@ -12,136 +13,535 @@ int32_t cmp(int32_t a, int32_t b) { return a > b ? 1 : (a < b ? -1 : 0); }
 int32_t cmp(float a, float b) { return a > b ? 1 : (a < b ? -1 : 0); }
 int32_t cmp(Address a, Address b) { return a > b ? 1 : (a < b ? -1 : 0); }
 
-void VM::execute(const ByteCode& code) {
-	switch (code.code)
-	{
-	case ByteCode::OpCode::NOP:break;
-	case ByteCode::OpCode::HALT: terminate_flag = true; break;
-	case ByteCode::OpCode::THROW: {
-		throw RuntimeError(stack.top().aarg);
-		break;
+// Every opcode of the interpreter loop; see bytecode.h.
+#define MINI_OPCODES(X) \
+	X(NOP) X(HALT) X(THROW) \
+	X(LOADL) X(LOADLI) X(LOADLF) X(LOADLA) X(LOADI) X(LOADII) X(LOADIF) X(LOADIA) \
+	X(LOADFIELD) X(LOADFIELDI) X(LOADFIELDF) X(LOADFIELDA) X(LOADINTERFACE) X(LOADG) X(LOADC) \
+	X(STOREL) X(STORELI) X(STORELF) X(STORELA) X(STOREI) X(STOREII) X(STOREIF) X(STOREIA) \
+	X(STOREFIELD) X(STOREFIELDI) X(STOREFIELDF) X(STOREFIELDA) X(STOREINTERFACE) X(STOREG) \
+	X(ALLOC) X(ALLOCI) X(ALLOCF) X(ALLOCA) X(NEW) X(NEWCLOSURE) \
+	X(CALL) X(CALLA) X(CALLNATIVE) X(RETN) X(RET) X(RETI) X(RETF) X(RETA) X(TAILCALL) X(TAILCALLA) X(JMP) X(JZ) X(JNZ) \
+	X(CONST) X(CONSTI) X(CONSTF) X(CONSTA) X(DUP) X(POP) X(SWAP) X(SHIFT) \
+	X(ADDI) X(ADDF) X(SUBI) X(SUBF) X(MULI) X(MULF) X(DIVI) X(DIVF) X(REMI) X(REMF) X(NEGI) X(NEGF) \
+	X(AND) X(OR) X(XOR) X(NOT) \
+	X(CMP) X(CMPI) X(CMPF) X(CMPA) X(EQ) X(NE) X(LT) X(LE) X(GT) X(GE) \
+	X(C2I) X(C2F) X(I2C) X(I2F) X(F2C) X(F2I)
+
+// The quickened opcodes; see vm.h.
+#define MINI_QUICKENED_OPCODES(X) \
+	X(LOADFIELD_OFF) X(LOADFIELDI_OFF) X(LOADFIELDF_OFF) X(LOADFIELDA_OFF) \
+	X(STOREFIELD_OFF) X(STOREFIELDI_OFF) X(STOREFIELDF_OFF) X(STOREFIELDA_OFF) \
+	X(LOADINTERFACE_CACHED) X(STOREINTERFACE_CACHED) X(CALLA_KNOWN) X(TAILCALLA_KNOWN)
+
+// Threaded dispatch needs labels as values (GCC/Clang). Define MINI_SWITCH_DISPATCH to force the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(MINI_SWITCH_DISPATCH)
+#define MINI_THREADED_DISPATCH
+#endif
+
+#ifdef MINI_COUNT_INSTRUCTIONS
+#define COUNT_INSTRUCTION() executed_instructions++
+#else
+#define COUNT_INSTRUCTION() ((void)0)
+#endif
+
+// the code at ip is about to be executed
+#ifdef MINI_PROFILE
+#define PROFILE_INSTRUCTION() do { \
+		if (profiler) profiler->count(unquickened(ip->code)); \
+		if (Sampler::requested) { SAVE_REGISTERS(); take_sample(); } \
+	} while (0)
+#else
+#define PROFILE_INSTRUCTION() ((void)0)
+#endif
+
+#ifdef MINI_THREADED_DISPATCH
+#define OP(name) L_##name:
+#define OP_QUICK(name) L_##name:
+#define OP_FUNCTION_END L_FUNCTION_END:
+#define OP_INVALID L_INVALID:
+#define NEXT() do { COUNT_INSTRUCTION(); PROFILE_INSTRUCTION(); goto *dispatch_table[(ip++)->code]; } while (0)
+#else
+#define OP(name) case ByteCode::OpCode::name:
+#define OP_QUICK(name) case name:
+#define OP_FUNCTION_END case FUNCTION_END:
+#define OP_INVALID default:
+#define NEXT() continue
+#endif
+
+// the instruction being executed; ip has been moved to the next one
+#define CUR_CODE (ip[-1])
+#define TOP (sp[-1])
+#define TOP2 (sp[-2])
+
+// make room for one more element
+#define GROW() do { \
+		if (++sp == sp_limit) { \
+			Size_t sp_index = Size_t(sp - stack.data()); \
+			stack.expand(); \
+			sp = stack.data() + sp_index; sp_limit = stack.limit(); bp = stack.data() + stack.bp; \
+		} \
+	} while (0)
+#define PUSH(value) do { StackElem push_value = (value); *sp = push_value; GROW(); } while (0)
+
+// Write the registers back before calling a member function that works on pc/stack ...
+#define SAVE_REGISTERS() (pc = Size_t(ip - codes_base), stack.sp = Size_t(sp - stack.data()))
+// ... and read them again afterwards, since it may have switched function or grown the stack.
+#define LOAD_REGISTERS() ( \
+		codes_base = functions[cur_function->index].codes.data(), ip = codes_base + pc, \
+		sp = stack.data() + stack.sp, sp_limit = stack.limit(), bp = stack.data() + stack.bp, \
+		arg_offset = cur_function->sz_arg, sz_local = cur_function->sz_local)
+
+// Only allocating codes can trigger a collection; the new object is already on the stack then.
+#define SAFE_POINT() do { if (heap.collect_requested()) collect_garbage(); } while (0)
+
+// After a code that switches function or leaves the machine code, go on in the machine code if there is some.
+#ifdef MINI_JIT
+#define JIT_ENTER() do { if (cur_function->native) { SAVE_REGISTERS(); run_native(); LOAD_REGISTERS(); } } while (0)
+#else
+#define JIT_ENTER() ((void)0)
+#endif
+
+void VM::run() {
+
+	// registers of the interpreter loop
+	Instruction* codes_base = nullptr;		// mutable, as codes are quickened in place
+	Instruction* ip = nullptr;
+	StackElem* sp = nullptr;
+	StackElem* sp_limit = nullptr;
+	StackElem* bp = nullptr;
+	Offset_t arg_offset = 0;
+	Size_t sz_local = 0;
+
+#ifdef MINI_THREADED_DISPATCH
+	void* dispatch_table[256];
+	for (auto& label : dispatch_table) {
+		label = &&L_INVALID;
 	}
+#define X(name) dispatch_table[ByteCode::OpCode::name] = &&L_##name;
+	MINI_OPCODES(X)
+#undef X
+#define X(name) dispatch_table[name] = &&L_##name;
+	MINI_QUICKENED_OPCODES(X)
+#undef X
+	dispatch_table[FUNCTION_END] = &&L_FUNCTION_END;
+#endif
 
-	case ByteCode::OpCode::LOADL: 
-	case ByteCode::OpCode::LOADLI:
-	case ByteCode::OpCode::LOADLF:
-	case ByteCode::OpCode::LOADLA:
-		load_local(code.arg1.iarg); break;
-	case ByteCode::OpCode::LOADI: 
-	case ByteCode::OpCode::LOADII:
-	case ByteCode::OpCode::LOADIF:
-	case ByteCode::OpCode::LOADIA:
-	{
-		Size_t index = stack.pop().iarg;
-		Address addr = stack.pop().aarg;
-		load_index(addr, index, code.code - ByteCode::OpCode::LOADI);
-		break;
+	try {
+		LOAD_REGISTERS();
+
+#ifdef MINI_THREADED_DISPATCH
+		NEXT();
+		{
+#else
+		for (;;) {
+			COUNT_INSTRUCTION();
+			PROFILE_INSTRUCTION();
+			switch ((ip++)->code) {
+#endif
+	OP(NOP) NEXT();
+	OP(HALT) {
+		SAVE_REGISTERS();
+		terminate_flag = true;
+#ifdef MINI_PROFILE
+		if (profiler) finish_profile();
+#endif
+		return;
 	}
-	case ByteCode::OpCode::LOADFIELD: load_field(stack.pop().aarg, code.arg1.iarg); break;
-	case ByteCode::OpCode::LOADINTERFACE: load_interface(stack.pop().aarg, code.arg1.iarg); break;
-	case ByteCode::OpCode::LOADG: load_field(global_addr, code.arg1.iarg); break;
-	case ByteCode::OpCode::LOADC: load_constant(code.arg1.aarg); break;
-	case ByteCode::OpCode::STOREL:
-	case ByteCode::OpCode::STORELI:
-	case ByteCode::OpCode::STORELF:
-	case ByteCode::OpCode::STORELA:
-		store_local(code.arg1.iarg, stack.pop()); break;
-	case ByteCode::OpCode::STOREI:
-	case ByteCode::OpCode::STOREII:
-	case ByteCode::OpCode::STOREIF:
-	case ByteCode::OpCode::STOREIA:
-	{
-		StackElem value = stack.pop();
-		Size_t index = stack.pop().iarg;
-		Address addr = stack.pop().aarg;
-		store_index(addr, index, value, code.code - ByteCode::OpCode::STOREI);
-		break;
+	OP(THROW) throw RuntimeError(TOP.aarg);
+
+	OP(LOADL) OP(LOADLI) OP(LOADLF) OP(LOADLA) {
+		Offset_t index = CUR_CODE.arg1.iarg;
+		if (index < arg_offset) {
+			PUSH(bp[index - arg_offset - 1]);	// bp
+		}
+		else {
+			runtime_assert(Size_t(index - arg_offset) < sz_local, "Local variable does not exist");
+			PUSH(bp[index - arg_offset + frame_header]);
+		}
+		NEXT();
 	}
-	case ByteCode::OpCode::STOREFIELD:
-	{
-		StackElem value = stack.pop();
-		Address addr = stack.pop().aarg;
-		store_field(addr, code.arg1.iarg, value);
-		break;
+	OP(LOADI) OP(LOADII) OP(LOADIF) OP(LOADIA) {
+		TOP2 = load_index(TOP2.aarg, TOP.iarg, CUR_CODE.code - ByteCode::OpCode::LOADI);
+		sp--;
+		NEXT();
 	}
-	case ByteCode::OpCode::STOREINTERFACE:
-	{
-		StackElem value = stack.pop();
-		Address addr = stack.pop().aarg;
-		store_interface(addr, code.arg1.iarg, value);
-		break;
+	OP(LOADFIELD) OP(LOADFIELDI) OP(LOADFIELDF) OP(LOADFIELDA) {
+		Address addr = TOP.aarg;
+		TOP = load_field(addr, CUR_CODE.arg1.iarg, CUR_CODE.code - ByteCode::OpCode::LOADFIELD);
+		quicken_field(CUR_CODE, addr);
+		NEXT();
+	}
+	OP_QUICK(LOADFIELD_OFF) {
+		if (ClassObject* cobj = guard_layout(TOP.aarg, CUR_CODE.field.layout)) {
+			TOP = cobj->fetch(CUR_CODE.field.offset);
+		}
+		else {
+			deoptimize(CUR_CODE);
+			TOP = load_field(TOP.aarg, CUR_CODE.arg1.iarg, 0);
+		}
+		NEXT();
+	}
+	OP_QUICK(LOADFIELDI_OFF) OP_QUICK(LOADFIELDF_OFF) OP_QUICK(LOADFIELDA_OFF) {
+		if (ClassObject* cobj = guard_layout(TOP.aarg, CUR_CODE.field.layout)) {
+			TOP = cobj->fetch4(CUR_CODE.field.offset);
+		}
+		else {
+			deoptimize(CUR_CODE);
+			TOP = load_field(TOP.aarg, CUR_CODE.arg1.iarg, CUR_CODE.code - ByteCode::OpCode::LOADFIELD);
+		}
+		NEXT();
+	}
+	OP(LOADINTERFACE) {
+		TOP = load_interface(TOP.aarg, CUR_CODE.arg1.iarg, CUR_CODE.cache);
+		quicken_interface(CUR_CODE);
+		NEXT();
+	}
+	OP_QUICK(LOADINTERFACE_CACHED) {
+		const InterfaceCache::Entry& e = CUR_CODE.cache->entries[0];
+		if (ClassObject* cobj = guard_layout(TOP.aarg, e.layout)) {
+#ifdef MINI_PROFILE
+			CUR_CODE.cache->hits++;
+#endif
+			if (e.width == 0) TOP = StackElem(bind_method(e.offset, TOP.aarg));
+			else if (e.width == 1) TOP = cobj->fetch(e.offset);
+			else TOP = cobj->fetch4(e.offset);
+		}
+		else {
+			deoptimize(CUR_CODE);
+			TOP = load_interface(TOP.aarg, CUR_CODE.arg1.iarg, CUR_CODE.cache);
+		}
+		NEXT();
+	}
+	OP(LOADG) {
+		if (CUR_CODE.width == 1) {
+			PUSH(global_object->fetch(CUR_CODE.arg1.aarg));
+		}
+		else {
+			PUSH(global_object->fetch4(CUR_CODE.arg1.aarg));
+		}
+		NEXT();
+	}
+	OP(LOADC) {
+		SAVE_REGISTERS();
+		load_constant(CUR_CODE.string);
+		SAFE_POINT();
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(STOREL) OP(STORELI) OP(STORELF) OP(STORELA) {
+		Offset_t index = CUR_CODE.arg1.iarg;
+		if (index < arg_offset) {
+			bp[index - arg_offset - 1] = TOP;	// bp
+		}
+		else {
+			runtime_assert(Size_t(index - arg_offset) < sz_local, "Local variable does not exist");
+			bp[index - arg_offset + frame_header] = TOP;
+		}
+		sp--;
+		NEXT();
+	}
+	OP(STOREI) OP(STOREII) OP(STOREIF) OP(STOREIA) {
+		store_index(sp[-3].aarg, TOP2.iarg, TOP, CUR_CODE.code - ByteCode::OpCode::STOREI);
+		sp -= 3;
+		NEXT();
+	}
+	OP(STOREFIELD) OP(STOREFIELDI) OP(STOREFIELDF) OP(STOREFIELDA) {
+		store_field(TOP2.aarg, CUR_CODE.arg1.iarg, TOP, CUR_CODE.code - ByteCode::OpCode::STOREFIELD);
+		quicken_field(CUR_CODE, TOP2.aarg);
+		sp -= 2;
+		NEXT();
+	}
+	OP_QUICK(STOREFIELD_OFF) {
+		if (ClassObject* cobj = guard_layout(TOP2.aarg, CUR_CODE.field.layout)) {
+			cobj->store(CUR_CODE.field.offset, TOP.carg);
+		}
+		else {
+			deoptimize(CUR_CODE);
+			store_field(TOP2.aarg, CUR_CODE.arg1.iarg, TOP, 0);
+		}
+		sp -= 2;
+		NEXT();
+	}
+	OP_QUICK(STOREFIELDI_OFF) OP_QUICK(STOREFIELDF_OFF) OP_QUICK(STOREFIELDA_OFF) {
+		if (ClassObject* cobj = guard_layout(TOP2.aarg, CUR_CODE.field.layout)) {
+			cobj->store4(CUR_CODE.field.offset, TOP);
+		}
+		else {
+			deoptimize(CUR_CODE);
+			store_field(TOP2.aarg, CUR_CODE.arg1.iarg, TOP, CUR_CODE.code - ByteCode::OpCode::STOREFIELD);
+		}
+		sp -= 2;
+		NEXT();
+	}
+	OP(STOREINTERFACE) {
+		store_interface(TOP2.aarg, CUR_CODE.arg1.iarg, TOP, CUR_CODE.cache);
+		quicken_interface(CUR_CODE);
+		sp -= 2;
+		NEXT();
+	}
+	OP_QUICK(STOREINTERFACE_CACHED) {
+		const InterfaceCache::Entry& e = CUR_CODE.cache->entries[0];		// not a method, as it has been stored to
+		if (ClassObject* cobj = guard_layout(TOP2.aarg, e.layout)) {
+#ifdef MINI_PROFILE
+			CUR_CODE.cache->hits++;
+#endif
+			if (e.width == 1) cobj->store(e.offset, TOP.carg);
+			else cobj->store4(e.offset, TOP);
+		}
+		else {
+			deoptimize(CUR_CODE);
+			store_interface(TOP2.aarg, CUR_CODE.arg1.iarg, TOP, CUR_CODE.cache);
+		}
+		sp -= 2;
+		NEXT();
+	}
+	OP(STOREG) {
+		if (CUR_CODE.width == 1) {
+			global_object->store(CUR_CODE.arg1.aarg, TOP.carg);
+		}
+		else {
+			global_object->store4(CUR_CODE.arg1.aarg, TOP);
+		}
+		sp--;
+		NEXT();
 	}
-	case ByteCode::STOREG: store_field(global_addr, code.arg1.iarg, stack.pop()); break;
-	case ByteCode::ALLOC:
-	case ByteCode::ALLOCI:
-	case ByteCode::ALLOCF:
-	case ByteCode::ALLOCA:
-		allocate_array(stack.pop().iarg, code.code - ByteCode::OpCode::ALLOC); break;
-	case ByteCode::NEW: allocate_class(code.arg1.aarg); break;
-	case ByteCode::NEWCLOSURE: allocate_closure(code.arg1.aarg); break;
-	case ByteCode::OpCode::CALL: call(code.arg1.aarg); break;
-	case ByteCode::OpCode::CALLA: {
-		call_closure(stack.sp_offset(-code.arg1.iarg - 1).aarg); break;
-	}
-	case ByteCode::OpCode::CALLNATIVE: call_native(code.arg1.aarg); break;
-	case ByteCode::OpCode::RETN: ret(false); break;
-	case ByteCode::OpCode::RET:
-	case ByteCode::OpCode::RETI:
-	case ByteCode::OpCode::RETF:
-	case ByteCode::OpCode::RETA:
-		ret(true); break;
-	case ByteCode::OpCode::CONST:
-	case ByteCode::OpCode::CONSTI:
-	case ByteCode::OpCode::CONSTF:
-	case ByteCode::OpCode::CONSTA: stack.push(code.arg1); break;
-	case ByteCode::OpCode::DUP: stack.push(stack.top()); break;
-	case ByteCode::OpCode::POP: stack.pop(); break;
-	case ByteCode::OpCode::SWAP: {
-		auto t = stack.top(); stack.top() = stack.top2(); stack.top2() = t; break;
-	}
-	case ByteCode::OpCode::SHIFT: stack.grow(1); break;
-
-	case ByteCode::OpCode::ADDI: stack.top2().iarg = stack.top2().iarg + stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::SUBI: stack.top2().iarg = stack.top2().iarg - stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::MULI: stack.top2().iarg = stack.top2().iarg * stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::DIVI: stack.top2().iarg = stack.top2().iarg / stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::REMI: stack.top2().iarg = stack.top2().iarg % stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::NEGI: stack.top().iarg = -stack.top().iarg; break;
-	case ByteCode::OpCode::AND: stack.top2().iarg = stack.top2().iarg & stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::OR: stack.top2().iarg = stack.top2().iarg | stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::XOR: stack.top2().iarg = stack.top2().iarg ^ stack.top().iarg; stack.pop(); break;
-	case ByteCode::OpCode::NOT: stack.top().iarg = !stack.top().iarg; break;
-
-	case ByteCode::OpCode::ADDF: stack.top2().farg = stack.top2().farg + stack.top().farg; stack.pop(); break;
-	case ByteCode::OpCode::SUBF: stack.top2().farg = stack.top2().farg - stack.top().farg; stack.pop(); break;
-	case ByteCode::OpCode::MULF: stack.top2().farg = stack.top2().farg * stack.top().farg; stack.pop(); break;
-	case ByteCode::OpCode::DIVF: stack.top2().farg = stack.top2().farg / stack.top().farg; stack.pop(); break;
-	case ByteCode::OpCode::REMF: stack.top2().farg = fmod(stack.top2().farg, stack.top().farg); stack.pop(); break;
-	case ByteCode::OpCode::NEGF: stack.top().farg = -stack.top().farg; break;
-	
-	case ByteCode::OpCode::CMP: stack.top2().iarg = cmp(stack.top2().carg, stack.top().carg); stack.pop(); break;
-	case ByteCode::OpCode::CMPI: stack.top2().iarg = cmp(stack.top2().iarg, stack.top().iarg); stack.pop(); break;
-	case ByteCode::OpCode::CMPF: stack.top2().iarg = cmp(stack.top2().farg, stack.top().farg); stack.pop(); break;
-	case ByteCode::OpCode::CMPA: stack.top2().iarg = cmp(stack.top2().aarg, stack.top().aarg); stack.pop(); break;
-	case ByteCode::OpCode::EQ: stack.top().iarg = stack.top().iarg == 0 ? 1 : 0; break;
-	case ByteCode::OpCode::NE: stack.top().iarg = stack.top().iarg != 0 ? 1 : 0; break;
-	case ByteCode::OpCode::LT: stack.top().iarg = stack.top().iarg < 0 ? 1 : 0; break;
-	case ByteCode::OpCode::LE: stack.top().iarg = stack.top().iarg <= 0 ? 1 : 0; break;
-	case ByteCode::OpCode::GT: stack.top().iarg = stack.top().iarg > 0 ? 1 : 0; break;
-	case ByteCode::OpCode::GE: stack.top().iarg = stack.top().iarg >= 0 ? 1 : 0; break;
-
-	case ByteCode::OpCode::C2I: stack.top().iarg = stack.top().carg; break;
-	case ByteCode::OpCode::C2F: stack.top().farg = stack.top().carg; break;
-	case ByteCode::OpCode::I2C: stack.top().carg = static_cast<char>(stack.top().iarg); break;
-	case ByteCode::OpCode::I2F: stack.top().farg = static_cast<float>(stack.top().iarg); break;
-	case ByteCode::OpCode::F2C: stack.top().carg = static_cast<char>(stack.top().iarg); break;
-	case ByteCode::OpCode::F2I: stack.top().iarg = static_cast<int32_t>(stack.top().farg); break;
 
-	default:
-		runtime_assert(false, "Invalid opcode");
-		break;
+	OP(ALLOC) OP(ALLOCI) OP(ALLOCF) OP(ALLOCA) {
+		SAVE_REGISTERS();
+		allocate_array(stack.pop().iarg, CUR_CODE.code - ByteCode::OpCode::ALLOC);
+		SAFE_POINT();
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(NEW) {
+		SAVE_REGISTERS();
+		allocate_class(CUR_CODE.layout, CUR_CODE.arg1.aarg);
+		SAFE_POINT();
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(NEWCLOSURE) {
+		SAVE_REGISTERS();
+		allocate_closure(CUR_CODE.function);
+		SAFE_POINT();
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(CALL) {
+		SAVE_REGISTERS();
+		call(CUR_CODE.function);
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(CALLA) {
+		SAVE_REGISTERS();
+		call_closure(sp[-CUR_CODE.arg1.iarg - 1].aarg);
+		quicken_call(CUR_CODE, cur_function);
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP_QUICK(CALLA_KNOWN) {
+		SAVE_REGISTERS();
+		ClosureObject* cobj = fetch_closure(sp[-CUR_CODE.arg1.iarg - 1].aarg);
+		const FunctionCode* f = CUR_CODE.function;
+		if (cobj->function_addr() != f->index) {
+			deoptimize(CUR_CODE);
+			f = &functions[cobj->function_addr()];
+		}
+		push_bindings(cobj);
+		call(f);
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(CALLNATIVE) {
+		SAVE_REGISTERS();
+		call_native(CUR_CODE.arg1.aarg);
+		SAFE_POINT();
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(TAILCALL) {
+		SAVE_REGISTERS();
+		tail_call(CUR_CODE.function);
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(TAILCALLA) {
+		SAVE_REGISTERS();
+		tail_call_closure(sp[-CUR_CODE.arg1.iarg - 1].aarg);
+		quicken_call(CUR_CODE, cur_function);
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP_QUICK(TAILCALLA_KNOWN) {
+		SAVE_REGISTERS();
+		ClosureObject* cobj = fetch_closure(sp[-CUR_CODE.arg1.iarg - 1].aarg);
+		const FunctionCode* f = CUR_CODE.function;
+		if (cobj->function_addr() != f->index) {
+			deoptimize(CUR_CODE);
+			f = &functions[cobj->function_addr()];
+		}
+		push_bindings(cobj);
+		tail_call(f);	// the closure itself is dropped with the frame
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(RETN) {
+		SAVE_REGISTERS();
+		ret(false);
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(RET) OP(RETI) OP(RETF) OP(RETA) {
+		SAVE_REGISTERS();
+		ret(true);
+		LOAD_REGISTERS();
+		JIT_ENTER();
+		NEXT();
+	}
+	OP(JMP) ip = CUR_CODE.target; NEXT();
+	OP(JZ) {
+		sp--;
+		if (sp->iarg == 0) ip = CUR_CODE.target;
+		NEXT();
+	}
+	OP(JNZ) {
+		sp--;
+		if (sp->iarg != 0) ip = CUR_CODE.target;
+		NEXT();
+	}
+	OP(CONST) OP(CONSTI) OP(CONSTF) OP(CONSTA) PUSH(CUR_CODE.arg1); NEXT();
+	OP(DUP) PUSH(TOP); NEXT();
+	OP(POP) sp--; NEXT();
+	OP(SWAP) {
+		StackElem t = TOP; TOP = TOP2; TOP2 = t;
+		NEXT();
 	}
+	OP(SHIFT) GROW(); NEXT();
+
+	OP(ADDI) TOP2.iarg = TOP2.iarg + TOP.iarg; sp--; NEXT();
+	OP(SUBI) TOP2.iarg = TOP2.iarg - TOP.iarg; sp--; NEXT();
+	OP(MULI) TOP2.iarg = TOP2.iarg * TOP.iarg; sp--; NEXT();
+	OP(DIVI) TOP2.iarg = TOP2.iarg / TOP.iarg; sp--; NEXT();
+	OP(REMI) TOP2.iarg = TOP2.iarg % TOP.iarg; sp--; NEXT();
+	OP(NEGI) TOP.iarg = -TOP.iarg; NEXT();
+	OP(AND) TOP2.iarg = TOP2.iarg & TOP.iarg; sp--; NEXT();
+	OP(OR) TOP2.iarg = TOP2.iarg | TOP.iarg; sp--; NEXT();
+	OP(XOR) TOP2.iarg = TOP2.iarg ^ TOP.iarg; sp--; NEXT();
+	OP(NOT) TOP.iarg = !TOP.iarg; NEXT();
+
+	OP(ADDF) TOP2.farg = TOP2.farg + TOP.farg; sp--; NEXT();
+	OP(SUBF) TOP2.farg = TOP2.farg - TOP.farg; sp--; NEXT();
+	OP(MULF) TOP2.farg = TOP2.farg * TOP.farg; sp--; NEXT();
+	OP(DIVF) TOP2.farg = TOP2.farg / TOP.farg; sp--; NEXT();
+	OP(REMF) TOP2.farg = fmod(TOP2.farg, TOP.farg); sp--; NEXT();
+	OP(NEGF) TOP.farg = -TOP.farg; NEXT();
+
+	OP(CMP) TOP2.iarg = cmp(TOP2.carg, TOP.carg); sp--; NEXT();
+	OP(CMPI) TOP2.iarg = cmp(TOP2.iarg, TOP.iarg); sp--; NEXT();
+	OP(CMPF) TOP2.iarg = cmp(TOP2.farg, TOP.farg); sp--; NEXT();
+	OP(CMPA) TOP2.iarg = cmp(TOP2.aarg, TOP.aarg); sp--; NEXT();
+	OP(EQ) TOP.iarg = TOP.iarg == 0 ? 1 : 0; NEXT();
+	OP(NE) TOP.iarg = TOP.iarg != 0 ? 1 : 0; NEXT();
+	OP(LT) TOP.iarg = TOP.iarg < 0 ? 1 : 0; NEXT();
+	OP(LE) TOP.iarg = TOP.iarg <= 0 ? 1 : 0; NEXT();
+	OP(GT) TOP.iarg = TOP.iarg > 0 ? 1 : 0; NEXT();
+	OP(GE) TOP.iarg = TOP.iarg >= 0 ? 1 : 0; NEXT();
+
+	OP(C2I) TOP.iarg = TOP.carg; NEXT();
+	OP(C2F) TOP.farg = TOP.carg; NEXT();
+	OP(I2C) TOP.carg = static_cast<char>(TOP.iarg); NEXT();
+	OP(I2F) TOP.farg = static_cast<float>(TOP.iarg); NEXT();
+	OP(F2C) TOP.carg = static_cast<char>(TOP.iarg); NEXT();
+	OP(F2I) TOP.iarg = static_cast<int32_t>(TOP.farg); NEXT();
+
+	OP_FUNCTION_END throw RuntimeError("Function end without return");
+	OP_INVALID throw RuntimeError("Invalid opcode");
+
+#ifndef MINI_THREADED_DISPATCH
+			}
+#endif
+		}
+	}
+	catch (const RuntimeError& e) {
+		// helpers throw before switching function, so ip still belongs to codes_base
+		pc = Size_t(ip - codes_base);
+		handle_error(e);
+		terminate_flag = true;
+		error_flag = 1;
+	}
+#ifdef MINI_PROFILE
+	if (profiler) finish_profile();
+#endif
+}
+
+#undef OP
+#undef OP_QUICK
+#undef OP_FUNCTION_END
+#undef OP_INVALID
+#undef NEXT
+#undef CUR_CODE
+#undef TOP
+#undef TOP2
+#undef GROW
+#undef PUSH
+#undef SAVE_REGISTERS
+#undef LOAD_REGISTERS
+#undef SAFE_POINT
+#undef JIT_ENTER
+#undef PROFILE_INSTRUCTION
+
+#ifdef MINI_PROFILE
+void VM::finish_profile() {
+	profiler->finish();
+	for (const auto& fc : functions) {
+		for (Size_t i = 0; i < fc.codes.size(); i++) {
+			const Instruction& ins = fc.codes[i];
+			uint16_t code = unquickened(ins.code);
+			if (code != ByteCode::OpCode::LOADINTERFACE && code != ByteCode::OpCode::STOREINTERFACE) continue;
+			const InterfaceCache* c = ins.cache;
+			if (c->hits || c->misses) {
+				profiler->record_cache(fc.index, i, { c->hits, c->misses, c->size, c->megamorphic });
+			}
+		}
+	}
+}
+
+void VM::take_sample() {
+	Sampler::requested = 0;
+	if (!sampler) return;
+
+	sample_frames.clear();
+	const FunctionCode* f = cur_function;
+	Size_t p = pc;		// the code about to run; in the callers, the code after the call
+	Size_t b = stack.bp;
+	while (b > 0 && f) {
+		if (sample_frames.size() == Sampler::max_depth) {
+			sample_frames.push_back(Sampler::truncated);
+			break;
+		}
+		sample_frames.push_back(Sampler::frame(f->index, p));
+		memcpy(&f, stack.begin() + b, sizeof(f));
+		p = stack.begin()[b + Stack::pointer_slots].aarg;
+		p = p > 0 ? p - 1 : p;
+		b = stack.begin()[b - 1].aarg;
+	}
+	sampler->record(sample_frames);
 }
+#endif
 
 void VM::handle_error(const RuntimeError& e) {
 	// if the stack is corrupted, a segmentation fault will arise
@@ -163,8 +563,8 @@ void VM::handle_error(const RuntimeError& e) {
 		// if pc \in exception range then terminate_flag <- false and pc is set. But we will see if that's necessary here.
 
 		try {
-			const auto& ln = lnt->query(pc_func, pc > 1 ? pc - 1 : pc);
-			const FunctionInfo* fi = irprog->fetch_constant(cur_function->info_index)->as<FunctionInfo>();
+			const auto& ln = lnt->query(cur_function->index, pc > 1 ? pc - 1 : pc);
+			const FunctionInfo* fi = irprog->fetch_constant(cur_function->function->info_index)->as<FunctionInfo>();
 			std::string filename;
 			if (fi->symbol_info.is_absolute()) {
 				filename = "<builtin>";
@@ -206,53 +606,130 @@ void VM::handle_error(const RuntimeError& e) {
 	}
 }
 
-void VM::build_field_indices_map()
-{
+void VM::collect_garbage() {
+	heap.collect([this](MemorySection& h) {
+		for (const StackElem* p = stack.begin(); p != stack.end(); p++) {
+			h.mark(p->aarg);	// the stack is untyped; scan it conservatively.
+		}
+		h.mark(global_addr);
+		for (const auto& addr : native_roots) {
+			h.mark(addr);
+		}
+	});
+}
+
+void VM::print_gc_statistics(std::ostream& os)const {
+	const auto& stat = heap.statistics();
+	os << "GC: " << stat.collections << " collections, " << std::fixed << std::setprecision(3)
+		<< stat.total_time * 1000 << " ms total, " << stat.max_pause * 1000 << " ms max pause; "
+		<< stat.freed_objects << " objects (" << stat.freed_bytes << " bytes) freed, "
+		<< heap.live_objects() << " objects (" << heap.live_bytes() << " bytes) alive\n";
+}
+
+void VM::decode() {
+	functions.assign(irprog->constant_pool.size(), {});
+	interface_caches.clear();
 	for (Size_t i = 0; i < irprog->constant_pool.size(); i++) {
-		if (irprog->constant_pool[i]->get_type() == ConstantPoolObject::CLASS_INFO) {
-			Size_t field_index = 0;
-			for (const auto& f : irprog->constant_pool[i]->as<ClassInfo>()->field_info) {
-				// TODO if fieldinfo is global then mark it (without increasing field_index)
-				field_indices.insert({ FieldKey{i, f.name_index}.to_key(), FieldLocation{field_index, 0} });
-				field_index++;
+		if (irprog->constant_pool[i]->get_type() != ConstantPoolObject::FUNCTION) continue;
+
+		const Function* f = irprog->constant_pool[i]->as<Function>();
+		FunctionCode& fc = functions[i];
+		fc.function = f;
+		fc.index = i;
+		fc.sz_arg = f->sz_arg + f->sz_bind;
+		fc.sz_local = f->sz_local;
+		fc.codes.resize(f->codes.size() + 1);
+		for (Size_t j = 0; j < f->codes.size(); j++) {
+			decode_instruction(f->codes[j], fc, fc.codes[j]);
+			if (fc.codes[j].code == ByteCode::OpCode::LOADINTERFACE || fc.codes[j].code == ByteCode::OpCode::STOREINTERFACE) {
+				fc.codes[j].cache = &interface_caches.emplace_back();
 			}
 		}
+		fc.codes.back().code = FUNCTION_END;
 	}
 }
 
+void VM::decode_instruction(const ByteCode& bc, FunctionCode& fc, Instruction& ins)const {
 
-void VM::load_local(Size_t index) {
-	Offset_t arg_offset = cur_function->sz_arg + cur_function->sz_bind;
-	if (index < arg_offset) {
-		stack.push(stack.bp_offset(-arg_offset - 1 + index));     // bp
-	}
-	else {
-		runtime_assert(index - arg_offset < cur_function->sz_local, "Local variable does not exist");
-		stack.push(stack.bp_offset(index - arg_offset + 2));    // pcfunc, pc
-	}
-}
+	auto is_a = [this](Address index, ConstantPoolObject::Type_t type) {
+		return index < irprog->constant_pool.size() && irprog->constant_pool[index]->get_type() == type;
+	};
+
+	ins.code = bc.code < FUNCTION_END ? bc.code : INVALID;		// keeps the dispatch table within 256 entries
+	ins.arg1 = bc.arg1;
 
-void VM::store_local(Size_t index, StackElem value) {
-	Offset_t arg_offset = cur_function->sz_arg + cur_function->sz_bind;
-	if (index < arg_offset) {
-		stack.bp_offset(-arg_offset - 1 + index) = value;   // bp
+	// a code with a bad operand becomes INVALID, so the error is raised when (and if) it is executed
+	switch (bc.code)
+	{
+	case ByteCode::OpCode::CALL:
+	case ByteCode::OpCode::TAILCALL:
+	case ByteCode::OpCode::NEWCLOSURE:
+		if (is_a(bc.arg1.aarg, ConstantPoolObject::FUNCTION)) {
+			ins.function = &functions[bc.arg1.aarg];
+		}
+		else {
+			ins.code = INVALID;
+		}
+		break;
+	case ByteCode::OpCode::LOADC:
+		if (is_a(bc.arg1.aarg, ConstantPoolObject::STRING)) {
+			ins.string = irprog->fetch_constant(bc.arg1.aarg)->as<StringConstant>();
+		}
+		else {
+			ins.code = INVALID;
+		}
+		break;
+	case ByteCode::OpCode::NEW:
+		if (is_a(bc.arg1.aarg, ConstantPoolObject::CLASS_LAYOUT)) {
+			ins.layout = irprog->fetch_constant(bc.arg1.aarg)->as<ClassLayout>();
+		}
+		else {
+			ins.code = INVALID;
+		}
+		break;
+	case ByteCode::OpCode::LOADINTERFACE:
+	case ByteCode::OpCode::STOREINTERFACE:
+		if (bc.arg1.aarg >= irprog->interface_fields.size()) {
+			ins.code = INVALID;
+		}
+		break;
+	case ByteCode::OpCode::JMP:
+	case ByteCode::OpCode::JZ:
+	case ByteCode::OpCode::JNZ:
+		if (bc.arg1.aarg < fc.codes.size()) {
+			ins.target = &fc.codes[bc.arg1.aarg];
+		}
+		else {
+			ins.code = INVALID;
+		}
+		break;
+	case ByteCode::OpCode::LOADG:
+	case ByteCode::OpCode::STOREG: {
+		const ClassLayout* cl = irprog->fetch_constant(irprog->global_pool_index)->as<ClassLayout>();
+		if (bc.arg1.aarg < cl->fields.size()) {
+			ins.arg1 = cl->fields[bc.arg1.aarg].offset;
+			ins.width = ClassLayout::width(cl->fields[bc.arg1.aarg].kind);
+		}
+		else {
+			ins.code = INVALID;
+		}
+		break;
 	}
-	else {
-		runtime_assert(index - arg_offset < cur_function->sz_local, "Local variable does not exist");
-		stack.bp_offset(index - arg_offset + 2) = value;    // pcfunc, pc
+	default:
+		break;
 	}
 }
 
-void VM::load_index(Address addr, Size_t index, Size_t typebit) {
-	MemoryObject* obj = heap.fetch(addr);
+StackElem VM::load_index(Address addr, Size_t index, Size_t typebit) {
+	const MemoryObject* obj = heap.fetch(addr);
 
 	if (typebit == 0) {
 		runtime_assert(obj->size > index, "Array index out of range");
-		stack.push(obj->fetch(index)); // fetch can be used to any object
+		return obj->fetch(index); // fetch can be used to any object
 	}
 	else {
 		runtime_assert(obj->size > index * 4, "Array index out of range");
-		stack.push(obj->fetch4(index * 4)); // fetch can be used to any object
+		return obj->fetch4(index * 4); // fetch can be used to any object
 	}
 }
 
@@ -269,25 +746,25 @@ void VM::store_index(Address addr, Size_t index, StackElem value, Size_t typebit
 	}
 }
 
-void VM::load_field(Address addr, Size_t field_index) {
+StackElem VM::load_field(Address addr, Size_t field_index, Size_t typebit) {
 
 	ClassObject* cobj;
-	Size_t sz_field, field_offset;
-	_get_class_and_field(addr, field_index, cobj, field_offset, sz_field);
-	if (sz_field == 1) {
-		stack.push(cobj->fetch(field_offset));
+	Size_t field_offset;
+	_get_class_and_field(addr, field_index, typebit, cobj, field_offset);
+	if (typebit == 0) {
+		return cobj->fetch(field_offset);
 	}
 	else {  // may differentiate 4/8 when adding double support
-		stack.push(cobj->fetch4(field_offset));
+		return cobj->fetch4(field_offset);
 	}
 }
 
-void VM::store_field(Address addr, Size_t field_index, StackElem value) {
+void VM::store_field(Address addr, Size_t field_index, StackElem value, Size_t typebit) {
 
 	ClassObject* cobj;
-	Size_t sz_field, field_offset;
-	_get_class_and_field(addr, field_index, cobj, field_offset, sz_field);
-	if (sz_field == 1) {
+	Size_t field_offset;
+	_get_class_and_field(addr, field_index, typebit, cobj, field_offset);
+	if (typebit == 0) {
 		cobj->store(field_offset, value.carg);
 	}
 	else {  // may differentiate 4/8 when adding double support
@@ -295,24 +772,28 @@ void VM::store_field(Address addr, Size_t field_index, StackElem value) {
 	}
 }
 
-void VM::load_interface(Address addr, Size_t field_id)
+StackElem VM::load_interface(Address addr, Size_t field_id, InterfaceCache* cache)
 {
 	ClassObject* cobj;
 	Size_t sz_field, field_offset;
-	_get_interface_class_and_field(addr, field_id, cobj, field_offset, sz_field);
-	if (sz_field == 1) {
-		stack.push(cobj->fetch(field_offset));
+	_get_interface_class_and_field(addr, field_id, cache, cobj, field_offset, sz_field);
+	if (sz_field == 0) {
+		return StackElem(bind_method(field_offset, addr));
+	}
+	else if (sz_field == 1) {
+		return cobj->fetch(field_offset);
 	}
 	else {  // may differentiate 4/8 when adding double support
-		stack.push(cobj->fetch4(field_offset));
+		return cobj->fetch4(field_offset);
 	}
 }
 
-void VM::store_interface(Address addr, Size_t field_id, StackElem value)
+void VM::store_interface(Address addr, Size_t field_id, StackElem value, InterfaceCache* cache)
 {
 	ClassObject* cobj;
 	Size_t sz_field, field_offset;
-	_get_interface_class_and_field(addr, field_id, cobj, field_offset, sz_field);
+	_get_interface_class_and_field(addr, field_id, cache, cobj, field_offset, sz_field);
+	runtime_assert(sz_field != 0, "Assignment to method");
 	if (sz_field == 1) {
 		cobj->store(field_offset, value.carg);
 	}
@@ -321,54 +802,45 @@ void VM::store_interface(Address addr, Size_t field_id, StackElem value)
 	}
 }
 
-void VM::_get_class_and_field(Address addr, Size_t field_index, ClassObject*& cobj, Size_t& field_offset, Size_t& sz_field) {
+void VM::_get_class_and_field(Address addr, Size_t field_index, Size_t typebit, ClassObject*& cobj, Size_t& field_offset) {
 	MemoryObject* obj = heap.fetch(addr);
 	runtime_assert(obj->type == MemoryObject::Type_t::CLASS, "Load field from non-class type");
 	cobj = obj->as<ClassObject>();
 	const ClassLayout* cl = irprog->fetch_constant(cobj->layout_addr())->as<ClassLayout>();  // get the layout first
-	try {
-		sz_field = cl->offset[field_index + 1] - cl->offset[field_index];
-	}
-	catch (const std::out_of_range&) {
-		throw RuntimeError("Field out of range");
-	}
-	field_offset = cl->offset[field_index];
+	runtime_assert(field_index < cl->fields.size(), "Field out of range");
+	const ClassLayout::Field& f = cl->fields[field_index];
+	runtime_assert(ClassLayout::width(f.kind) == ClassLayout::width(typebit), "Field of another width");
+	field_offset = f.offset;
 }
 
-void VM::_get_interface_class_and_field(Address addr, Size_t field_id, ClassObject*& cobj, Size_t& field_offset, Size_t& sz_field) {
+void VM::_get_interface_class_and_field(Address addr, Size_t field_id, InterfaceCache* cache, ClassObject*& cobj, Size_t& field_offset, Size_t& sz_field) {
 	MemoryObject* obj = heap.fetch(addr);
 	runtime_assert(obj->type == MemoryObject::Type_t::CLASS, "Load field from non-class type");
 	cobj = obj->as<ClassObject>();
-	const ClassLayout* cl = irprog->fetch_constant(cobj->layout_addr())->as<ClassLayout>();  // get the layout first
-
-	FieldLocation field_location;
-	try {
-		field_location = field_indices.at(FieldKey{ cl->info_index, field_id }.to_key());
-	}
-	catch (const std::out_of_range&) {
-		throw RuntimeError("Invalid field key");
-	}
-
-	// if global -> change to global layout
-	if (field_location.is_global) {
-		cobj = heap.fetch(global_addr)->as<ClassObject>();
-		cl = irprog->fetch_constant(cobj->layout_addr())->as<ClassLayout>();
+	Size_t layout = cobj->layout_addr();
+	if (cache) {
+		if (const InterfaceCache::Entry* e = cache->find(layout)) {
+#ifdef MINI_PROFILE
+			cache->hits++;
+#endif
+			field_offset = e->offset;
+			sz_field = e->width;
+			return;
+		}
+#ifdef MINI_PROFILE
+		cache->misses++;
+#endif
 	}
-	Size_t field_index = field_location.field_index;
+	const ClassLayout* cl = irprog->fetch_constant(layout)->as<ClassLayout>();  // get the layout first
 
-	try {
-		sz_field = cl->offset[field_index + 1] - cl->offset[field_index];
-	}
-	catch (const std::out_of_range&) {
-		throw RuntimeError("Field out of range");
-	}
-	field_offset = cl->offset[field_index];
+	runtime_assert(field_id < cl->itable.size() && cl->itable[field_id].width != ClassLayout::absent, "Invalid field key");
+	field_offset = cl->itable[field_id].offset;     // the function of a method
+	sz_field = cl->itable[field_id].width;
+	if (cache) cache->insert({ layout, field_offset, sz_field });
 }
 
-void VM::load_constant(Size_t index) {
+void VM::load_constant(const StringConstant* s) {
 	// This only works with string now
-	const StringConstant* s = irprog->fetch_constant(index)->as<StringConstant>();
-	// cpo->get_type() == ConstantPoolObject::STRING
 	Address addr = heap.allocate(MemoryObject::Type_t::ARRAY, s->value.size());
 	memcpy(heap.fetch(addr)->data, s->value.c_str(), s->value.size());
 	stack.push(addr);
@@ -379,22 +851,20 @@ void VM::allocate_array(Size_t size, Size_t typebit) {
 		stack.push(heap.allocate(MemoryObject::Type_t::ARRAY, size));
 	}
 	else {
-		stack.push(heap.allocate(MemoryObject::Type_t::ARRAY, size * 4));
+		stack.push(heap.allocate(MemoryObject::Type_t::ARRAY, size * 4, typebit));
 	}
 }
 
-void VM::allocate_class(Size_t index) {
-	const ClassLayout* cl = irprog->fetch_constant(index)->as<ClassLayout>();
-	Address addr = heap.allocate(MemoryObject::Type_t::CLASS, cl->offset.back());
+void VM::allocate_class(const ClassLayout* cl, Size_t index) {
+	Address addr = heap.allocate(MemoryObject::Type_t::CLASS, cl->instance_size);
 	heap.fetch(addr)->as<ClassObject>()->set_layout_addr(index);
 	stack.push(addr);
 }
 
-void VM::allocate_closure(Size_t index) {
-	const Function* f = irprog->fetch_constant(index)->as<Function>();
-	Address addr = heap.allocate(MemoryObject::Type_t::CLOSURE, f->sz_bind * 4 + 4);
+void VM::allocate_closure(const FunctionCode* f) {
+	Address addr = heap.allocate(MemoryObject::Type_t::CLOSURE, f->function->sz_bind * 4 + 4);
 	ClosureObject* cobj = heap.fetch(addr)->as<ClosureObject>();
-	cobj->set_function_addr(index);
+	cobj->set_function_addr(f->index);
 	Offset_t nargs = cobj->data_size() / 4;
 	cobj->move_from(&stack.sp_offset(-nargs));
 	//stack.sp -= nargs - 1;
@@ -402,34 +872,238 @@ void VM::allocate_closure(Size_t index) {
 	stack.push(addr);
 }
 
+Address VM::bind_method(Size_t function, Address self) {
+	Address addr = heap.allocate(MemoryObject::Type_t::CLOSURE, 8);
+	ClosureObject* cobj = heap.fetch(addr)->as<ClosureObject>();
+	cobj->set_function_addr(function);
+	StackElem binding(self);
+	cobj->move_from(&binding);
+	return addr;
+}
+
 void VM::call_closure(Address addr) {
+	ClosureObject* cobj = fetch_closure(addr);
+	push_bindings(cobj);
+	call(&functions[cobj->function_addr()]);
+}
+
+ClosureObject* VM::fetch_closure(Address addr) {
 	MemoryObject* obj = heap.fetch(addr);
 	runtime_assert(obj->type == MemoryObject::Type_t::CLOSURE, "Call a non-closure");
-	ClosureObject* cobj = obj->as<ClosureObject>();
+	return obj->as<ClosureObject>();
+}
+
+void VM::push_bindings(const ClosureObject* cobj) {
 	Offset_t nargs = cobj->data_size() / 4;
 	stack.grow(nargs);
 	cobj->move_to(&stack.sp_offset(-nargs));
-	call(cobj->function_addr());
 }
 
-void VM::call(Size_t index) {
+void VM::call(const FunctionCode* f) {
+	count_call(f);
+#ifdef MINI_PROFILE
+	if (profiler) profiler->enter(f->index);
+#endif
 	stack.push_bp();
-	stack.push(pc_func);
+	stack.push_pointer(cur_function);
 	stack.push(pc);
-	cur_function = irprog->fetch_constant(index)->as<Function>();
+	cur_function = f;
 	stack.grow(cur_function->sz_local);
-	pc_func = index;
 	pc = 0;
 }
 
+void VM::tail_call_closure(Address addr) {
+	ClosureObject* cobj = fetch_closure(addr);
+	push_bindings(cobj);
+	tail_call(&functions[cobj->function_addr()]);	// the closure itself is dropped with the frame
+}
+
+void VM::tail_call(const FunctionCode* f) {
+	// the return address and the arguments of the current frame are overwritten by the new ones
+	Size_t base = stack.bp - 1 - cur_function->sz_arg;
+	Size_t old_bp = stack.bp_offset(-1).aarg;
+	const void* ret_function = stack.bp_pointer(0);
+	StackElem ret_pc = stack.bp_offset(Stack::pointer_slots);
+
+	count_call(f);
+#ifdef MINI_PROFILE
+	if (profiler) {
+		profiler->leave();
+		profiler->enter(f->index);
+	}
+#endif
+	memmove(stack.data() + base, stack.data() + stack.sp - f->sz_arg, f->sz_arg * sizeof(StackElem));
+	stack.sp = base + f->sz_arg;
+	stack.bp = old_bp;
+	stack.push_bp();
+	stack.push_pointer(ret_function);
+	stack.push(ret_pc);
+	cur_function = f;
+	stack.grow(cur_function->sz_local);
+	pc = 0;
+}
+
+void VM::count_call(const FunctionCode* f) {
+#ifdef MINI_JIT
+	if (jit_threshold == 0 || f->native) return;
+#ifdef MINI_PROFILE
+	if (profiler || sampler || heap_profiler) return;	// machine code is not profiled
+#endif
+	FunctionCode& fc = functions[f->index];
+	if (++fc.calls == jit_threshold) {
+		auto code = NativeCode::compile(fc);
+		if (code) {
+			fc.native = code.get();
+			native_code.push_back(std::move(code));
+		}
+	}
+#endif
+}
+
+void VM::run_native() {
+	JitFrame frame{ stack.data() + stack.sp, stack.data() + stack.bp, stack.limit(), static_cast<char*>(global_object->data), this };
+	pc = cur_function->native->run(frame, pc);
+	stack.sp = Size_t(frame.sp - stack.data());
+}
+
+const void* VM::transfer(JitFrame& frame, const Instruction& ins) {
+	stack.sp = Size_t(frame.sp - stack.data());
+
+	const FunctionCode* f = nullptr;	// the function to go to
+	Address closure = 0;
+	uint16_t code = unquickened(ins.code);	// the interpreter may have quickened it since it was compiled
+	switch (code)
+	{
+	case ByteCode::OpCode::CALL:
+	case ByteCode::OpCode::TAILCALL:
+		f = ins.function;
+		break;
+	case ByteCode::OpCode::CALLA:
+	case ByteCode::OpCode::TAILCALLA: {
+		closure = stack.sp_offset(-ins.arg1.iarg - 1).aarg;
+		const MemoryObject* obj = heap.fetch(closure);
+		if (obj->type != MemoryObject::Type_t::CLOSURE) return nullptr;
+		f = &functions[obj->as<ClosureObject>()->function_addr()];
+		break;
+	}
+	default:	// returns
+		f = static_cast<const FunctionCode*>(stack.bp_pointer(0));
+		break;
+	}
+	// the interpreter grows the stack if needed
+	if (!f || !f->native || stack.sp + f->sz_arg + frame_header + 1 + f->sz_local >= Size_t(stack.limit() - stack.data())) {
+		return nullptr;
+	}
+
+	pc = Size_t(&ins - cur_function->codes.data()) + 1;
+	switch (code)
+	{
+	case ByteCode::OpCode::CALL: call(f); break;
+	case ByteCode::OpCode::CALLA: call_closure(closure); break;
+	case ByteCode::OpCode::TAILCALL: tail_call(f); break;
+	case ByteCode::OpCode::TAILCALLA: tail_call_closure(closure); break;
+	case ByteCode::OpCode::RETN: ret(false); break;
+	default: ret(true); break;
+	}
+	frame.sp = stack.data() + stack.sp;
+	frame.bp = stack.data() + stack.bp;
+	frame.sp_limit = stack.limit();
+	return cur_function->native->address(pc);
+}
+
+StackElem* VM::allocate_from_native(StackElem* sp, const Instruction& ins) {
+	stack.sp = Size_t(sp - stack.data());
+	if (stack.sp + 1 >= Size_t(stack.limit() - stack.data())) {	// the interpreter grows the stack
+		return nullptr;
+	}
+	switch (ins.code)
+	{
+	case ByteCode::OpCode::NEW: allocate_class(ins.layout, ins.arg1.aarg); break;
+	case ByteCode::OpCode::NEWCLOSURE: allocate_closure(ins.function); break;
+	case ByteCode::OpCode::LOADC: load_constant(ins.string); break;
+	default: allocate_array(stack.pop().iarg, ins.code - ByteCode::OpCode::ALLOC); break;
+	}
+	if (heap.collect_requested()) collect_garbage();
+	return stack.data() + stack.sp;
+}
+
+void VM::print_jit_statistics(std::ostream& os)const {
+	size_t code_size = 0;
+	for (const auto& code : native_code) {
+		code_size += code->size();
+	}
+	os << "JIT: " << native_code.size() << " functions compiled, " << code_size << " bytes of machine code\n";
+}
+
+void VM::print_quickening_statistics(std::ostream& os)const {
+	os << "Quickening: " << quickened_count << " codes quickened, " << deopt_count << " deoptimized\n";
+}
+
+uint16_t VM::unquickened(uint16_t code) {
+	switch (code)
+	{
+	case LOADFIELD_OFF:
+	case LOADFIELDI_OFF:
+	case LOADFIELDF_OFF:
+	case LOADFIELDA_OFF: return ByteCode::OpCode::LOADFIELD + (code - LOADFIELD_OFF);
+	case STOREFIELD_OFF:
+	case STOREFIELDI_OFF:
+	case STOREFIELDF_OFF:
+	case STOREFIELDA_OFF: return ByteCode::OpCode::STOREFIELD + (code - STOREFIELD_OFF);
+	case LOADINTERFACE_CACHED: return ByteCode::OpCode::LOADINTERFACE;
+	case STOREINTERFACE_CACHED: return ByteCode::OpCode::STOREINTERFACE;
+	case CALLA_KNOWN: return ByteCode::OpCode::CALLA;
+	case TAILCALLA_KNOWN: return ByteCode::OpCode::TAILCALLA;
+	default: return code;
+	}
+}
+
+// The codes being run are those of functions, which belong to the VM; hence they may be rewritten.
+
+void VM::quicken_field(Instruction& ins, Address addr) {
+	if (ins.deopts >= max_deopts) return;
+	const ClassObject* cobj = heap.fetch(addr)->as<ClassObject>();		// checked by load_field/store_field
+	const ClassLayout* cl = irprog->fetch_constant(cobj->layout_addr())->as<ClassLayout>();
+
+	ins.field = { cobj->layout_addr(), cl->fields[ins.arg1.aarg].offset };
+	if (ins.code < ByteCode::OpCode::STOREFIELD) {
+		ins.code = LOADFIELD_OFF + (ins.code - ByteCode::OpCode::LOADFIELD);
+	}
+	else {
+		ins.code = STOREFIELD_OFF + (ins.code - ByteCode::OpCode::STOREFIELD);
+	}
+	quickened_count++;
+}
+
+void VM::quicken_interface(Instruction& ins) {
+	if (ins.deopts >= max_deopts || ins.cache->size != 1) return;
+	ins.code = ins.code == ByteCode::OpCode::LOADINTERFACE ? LOADINTERFACE_CACHED : STOREINTERFACE_CACHED;
+	quickened_count++;
+}
+
+void VM::quicken_call(Instruction& ins, const FunctionCode* f) {
+	if (ins.deopts >= max_deopts) return;
+	ins.function = f;
+	ins.code = ins.code == ByteCode::OpCode::CALLA ? CALLA_KNOWN : TAILCALLA_KNOWN;
+	quickened_count++;
+}
+
+void VM::deoptimize(Instruction& ins) {
+	ins.code = unquickened(ins.code);
+	ins.deopts++;
+	deopt_count++;
+}
+
 void VM::ret(bool has_value) {
 	StackElem value;
 	if (has_value) value = stack.pop();
-	Size_t sz_arg = cur_function->sz_arg + cur_function->sz_bind;
+	Size_t sz_arg = cur_function->sz_arg;
+#ifdef MINI_PROFILE
+	if (profiler) profiler->leave();
+#endif
 
-	pc_func = stack.bp_offset(0).aarg;
-	pc = stack.bp_offset(1).aarg;
-	cur_function = irprog->fetch_constant(pc_func)->as<Function>();
+	cur_function = static_cast<const FunctionCode*>(stack.bp_pointer(0));
+	pc = stack.bp_offset(Stack::pointer_slots).aarg;
 	stack.pop_bp();
 	stack.shrink(sz_arg);   // remove argument space
 
@@ -581,6 +1255,12 @@ void write_file(std::ostream& f, const std::string& c) {
 }
 
 void VM::call_native(int index) {
+	// heap arguments popped by a native function are kept alive until it returns
+	struct NativeRootsGuard {
+		std::vector<Address>& roots;
+		~NativeRootsGuard() { roots.clear(); }
+	} guard{ native_roots };
+
 	switch (NativeFunction(index))
 	{
 		// @len
@@ -651,8 +1331,10 @@ void VM::call_native(int index) {
 		  // @format
 	case NativeFunction::FORMAT: {
 		std::string buffer;
-		MemoryObject* obj_data = heap.fetch(stack.pop().aarg);
-		MemoryObject* obj_fmt = heap.fetch(stack.pop().aarg);
+		native_roots.push_back(stack.pop().aarg);
+		native_roots.push_back(stack.pop().aarg);
+		MemoryObject* obj_data = heap.fetch(native_roots[native_roots.size() - 2]);
+		MemoryObject* obj_fmt = heap.fetch(native_roots.back());
 		runtime_assert(obj_fmt->type == MemoryObject::Type_t::ARRAY, "Array required");
 		format(static_cast<char*>(obj_fmt->data), obj_fmt->size, static_cast<StackElem*>(obj_data->data), obj_data->size / 4, heap, buffer);
 		stack.push(_store_string(buffer));
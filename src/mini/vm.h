@@ -2,15 +2,87 @@
 #define MINI_VM_H
 
 #include "ir.h"
+#include "jit.h"
 #include "memory.h"
+#include "profiler.h"
+
+#include <cstring>
+#include <deque>
+#include <fstream>
 
 namespace mini {
 
+    struct FunctionCode;
+
+    // Inline cache of a LOADINTERFACE/STOREINTERFACE site: where the field is in each layout seen there. A
+    // site that has seen more layouts than it holds is megamorphic; the others are looked up every time.
+    struct InterfaceCache {
+        static const unsigned capacity = 4;
+
+        struct Entry {
+            Size_t layout;      // constant pool index
+            Size_t offset;      // in bytes; for a method, its function
+            Size_t width;       // in bytes; 0 for a method
+        };
+
+        Entry entries[capacity];
+        unsigned size = 0;
+        bool megamorphic = false;
+#ifdef MINI_PROFILE
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+#endif
+
+        const Entry* find(Size_t layout)const {
+            for (unsigned i = 0; i < size; i++) {
+                if (entries[i].layout == layout) return &entries[i];
+            }
+            return nullptr;
+        }
+        void insert(const Entry& e) {
+            if (size < capacity) entries[size++] = e;
+            else megamorphic = true;
+        }
+    };
+
+    // A code decoded by VM::load, with the operand resolved where possible.
+    struct Instruction {
+        // LOADFIELD*/STOREFIELD*, once quickened: the layout guarded and the offset of the field in it
+        struct FieldSite {
+            Size_t layout;
+            Size_t offset;
+        };
+
+        uint16_t code;
+        uint8_t width = 0;              // LOADG/STOREG: size of the global in bytes
+        uint8_t deopts = 0;             // times a quickened form of the code failed its guard
+        StackElem arg1;                 // operand of the ByteCode; LOADG/STOREG: offset of the global in bytes
+        union {
+            const FunctionCode* function = nullptr;     // CALL/TAILCALL/NEWCLOSURE; CALLA/TAILCALLA once quickened
+            const ClassLayout* layout;                  // NEW
+            const StringConstant* string;               // LOADC
+            Instruction* target;                        // JMP/JZ/JNZ
+            InterfaceCache* cache;                      // LOADINTERFACE/STOREINTERFACE
+            FieldSite field;                            // LOADFIELD*/STOREFIELD* once quickened
+        };
+    };
+
+    // A function decoded by VM::load. The codes end with a FUNCTION_END sentinel.
+    struct FunctionCode {
+        const Function* function = nullptr;     // null if the constant is not a function
+        Size_t index = 0;                       // in constant pool
+        Offset_t sz_arg = 0;                    // arguments and bindings
+        Size_t sz_local = 0;
+        std::vector<Instruction> codes;
+        Size_t calls = 0;                       // counted until it is compiled
+        const NativeCode* native = nullptr;     // machine code, if compiled
+    };
 
     class Stack {
     public:
 
         static const Size_t max_size = 2097152; // TODO changeable stack size
+        static const Size_t pointer_slots = sizeof(void*) / sizeof(StackElem);    // elements taken by a native pointer
 
         Stack() : sp(0), bp(0), _storage(1, StackElem()) {}
 
@@ -18,11 +90,11 @@ namespace mini {
         void grow(Size_t size) {
             sp += size;
             if (_storage.size() < sp + 1) {
+                if (sp >= max_size) {
+                    throw RuntimeError("Stack overflow");
+                }
                 _storage.resize(sp + 1);
             }
-            if (size >= max_size) {
-                throw RuntimeError("Stack overflow");
-            }
         }
         void shrink(Size_t size) {
             sp -= size;
@@ -42,6 +114,17 @@ namespace mini {
             sp = bp - 1;
             bp = _storage[sp].aarg;
         }
+        // *sp = ptr; sp += pointer_slots
+        void push_pointer(const void* ptr) {
+            Size_t at = sp;
+            grow(pointer_slots);
+            memcpy(reinterpret_cast<char*>(_storage.data() + at), &ptr, sizeof(ptr));
+        }
+        const void* bp_pointer(Offset_t offset)const {
+            const void* ptr;
+            memcpy(&ptr, reinterpret_cast<const char*>(_storage.data() + bp + offset), sizeof(ptr));
+            return ptr;
+        }
 
         // stack[sp + offset] no boundary check
         const StackElem& sp_offset(Offset_t offset)const {
@@ -75,6 +158,35 @@ namespace mini {
             return _storage[sp - 2];
         }
 
+        // the used region [0, sp)
+        const StackElem* begin()const {
+            return _storage.data();
+        }
+        const StackElem* end()const {
+            return _storage.data() + sp;
+        }
+
+        // Raw access for the interpreter loop. The storage is always larger than sp,
+        // but the pointers are invalidated by any call that grows the stack.
+        StackElem* data() {
+            return _storage.data();
+        }
+        StackElem* limit() {
+            return _storage.data() + _storage.size();
+        }
+        // Enlarge the storage when sp reaches limit().
+        void expand() {
+            if (_storage.size() >= max_size) {
+                throw RuntimeError("Stack overflow");
+            }
+            _storage.resize(_storage.size() * 2);
+        }
+        // Allocate the storage for max_size elements at once: then grow() never moves it, and pointers into
+        // it stay valid. Pages are only used when reached.
+        void reserve_all() {
+            _storage.reserve(max_size);
+        }
+
         Size_t sp;
         Size_t bp;
     private:
@@ -85,81 +197,181 @@ namespace mini {
     class VM {
     public:
 
+        // A frame is: [bp-1] previous bp, [bp] caller function, [bp+pointer_slots] caller pc, then the locals.
+        static const Offset_t frame_header = Stack::pointer_slots + 1;
+
         void load(const IRProgram& irprog) {
             this->irprog = &irprog;
-            call(this->irprog->entry_index);
-            build_field_indices_map();
-            allocate_class(this->irprog->global_pool_index);
+            heap.register_layouts(irprog);
+            decode();
+            call(&functions[this->irprog->entry_index]);
+            allocate_class(this->irprog->fetch_constant(this->irprog->global_pool_index)->as<ClassLayout>(), this->irprog->global_pool_index);
             global_addr = stack.pop().aarg;
+            global_object = heap.fetch(global_addr);
         }
 
-        void run() {
-            while (!terminate_flag) {
+        // Run until HALT or an uncaught error.
+        void run();
 
-                try {
-                    execute(fetch());
-                }
-                catch (const RuntimeError& e) {
-                    handle_error(e);
-                    terminate_flag = true;
-                    error_flag = 1;
-                }
-            }
+        void handle_error(const RuntimeError& e);
+
+        // Mark & sweep the heap. Roots are the stack, the global pool and the arguments of native calls.
+        void collect_garbage();
+
+        // Set the bytes allocated before a collection; 0 disables the collector.
+        void set_gc_threshold(size_t bytes) {
+            heap.set_threshold(bytes);
         }
 
-        const ByteCode& fetch() {
-            if (pc < cur_function->codes.size()) {
-                return cur_function->codes[pc++];
-            }
-            else {
-                throw RuntimeError("Function end without return");
+        void print_gc_statistics(std::ostream& os)const;
+
+        // Compile a function to machine code when it is called for the n-th time; 0 (default) disables the JIT.
+        // Without MINI_JIT, functions are never compiled.
+        void set_jit_threshold(Size_t calls) {
+            jit_threshold = calls;
+        }
+
+        void print_jit_statistics(std::ostream& os)const;
+
+        void print_quickening_statistics(std::ostream& os)const;
+
+        // The code a quickened code was rewritten from; any other code is returned as is.
+        static uint16_t unquickened(uint16_t code);
+
+#ifdef MINI_PROFILE
+        // Count the instructions and calls of the program from now on (see profiler.h); call it before load().
+        // Functions are not compiled by the JIT while profiling.
+        void enable_profiler() {
+            profiler = std::make_unique<Profiler>();
+        }
+
+        // null unless enabled
+        const Profiler* get_profiler()const {
+            return profiler.get();
+        }
+
+        // Sample the call stack every interval of CPU time while running (see Sampler); false if the system has
+        // no profiling timer. Functions are not compiled by the JIT while sampling.
+        bool enable_sampler(unsigned interval_us = 1000) {
+            sampler = std::make_unique<Sampler>();
+            if (!sampler->start(interval_us)) {
+                sampler.reset();
+                return false;
             }
+            return true;
+        }
+
+        // null unless enabled
+        Sampler* get_sampler() {
+            return sampler.get();
         }
 
-        void execute(const ByteCode& code);
+        // Record the site of each allocation from now on (see HeapProfiler). Functions are not compiled by the
+        // JIT while profiling the heap.
+        void enable_heap_profiler() {
+            heap_profiler = std::make_unique<HeapProfiler>();
+            heap_profiler->current_site = [this]() { return Sampler::frame(cur_function->index, pc > 0 ? pc - 1 : 0); };
+            heap.set_profiler(heap_profiler.get());
+        }
 
-        void handle_error(const RuntimeError& e);
+        // the top allocation sites, and the objects left after a last collection
+        void print_heap_profile(std::ostream& os) {
+            if (!heap_profiler) return;
+            collect_garbage();
+            heap_profiler->print_report(os, heap, *irprog);
+        }
+#endif
 
-        void build_field_indices_map();
+        // Decode every function of irprog into functions.
+        void decode();
 
-        // local varible -> stack top
-        void load_local(Size_t index);
+        void decode_instruction(const ByteCode& bc, FunctionCode& fc, Instruction& ins)const;
 
-        void store_local(Size_t index, StackElem value);
+#ifdef MINI_COUNT_INSTRUCTIONS
+        uint64_t instruction_count()const {
+            return executed_instructions;
+        }
+#endif
 
         // fetch value at certain index
-        void load_index(Address addr, Size_t index, Size_t typebit);
+        StackElem load_index(Address addr, Size_t index, Size_t typebit);
 
         void store_index(Address addr, Size_t index, StackElem value, Size_t typebit);
 
-        void load_field(Address addr, Size_t field_index);
+        // typebit: of the code, which gives the width of the field
+        StackElem load_field(Address addr, Size_t field_index, Size_t typebit);
+
+        void store_field(Address addr, Size_t field_index, StackElem value, Size_t typebit);
+
+        // cache: of the site, if any
+        StackElem load_interface(Address addr, Size_t field_id, InterfaceCache* cache = nullptr);
+
+        void store_interface(Address addr, Size_t field_id, StackElem value, InterfaceCache* cache = nullptr);
+
+        void _get_class_and_field(Address addr, Size_t field_index, Size_t typebit, ClassObject*& cobj, Size_t& field_offset);
+
+        // for a method, sz_field is 0 and field_offset is its function
+        void _get_interface_class_and_field(Address addr, Size_t field_index, InterfaceCache* cache, ClassObject*& cobj, Size_t& field_offset, Size_t& sz_field);
 
-        void store_field(Address addr, Size_t field_index, StackElem value);
+        // the class object at addr if its layout is layout, else null
+        ClassObject* guard_layout(Address addr, Size_t layout) {
+            MemoryObject* obj = heap.fetch(addr);
+            if (obj->type != MemoryObject::Type_t::CLASS || obj->as<ClassObject>()->layout_addr() != layout) return nullptr;
+            return obj->as<ClassObject>();
+        }
 
-        void load_interface(Address addr, Size_t field_id);
+        // Rewrite LOADFIELD*/STOREFIELD* ins, just run on the object at addr, into its quickened form.
+        void quicken_field(Instruction& ins, Address addr);
 
-        void store_interface(Address addr, Size_t field_id, StackElem value);
+        // Rewrite LOADINTERFACE/STOREINTERFACE ins into its quickened form if its cache has one layout.
+        void quicken_interface(Instruction& ins);
 
-        void _get_class_and_field(Address addr, Size_t field_index, ClassObject*& cobj, Size_t& field_offset, Size_t& sz_field);
+        // Rewrite CALLA/TAILCALLA ins, which just called f, into its quickened form.
+        void quicken_call(Instruction& ins, const FunctionCode* f);
 
-        void _get_interface_class_and_field(Address addr, Size_t field_index, ClassObject*& cobj, Size_t& field_offset, Size_t& sz_field);
+        // Rewrite a quickened ins, whose guard failed, back to its generic code.
+        void deoptimize(Instruction& ins);
 
-        void load_constant(Size_t index);
+        void load_constant(const StringConstant* s);
 
         void allocate_array(Size_t size, Size_t typebit);
         
-        void allocate_class(Size_t index);
+        void allocate_class(const ClassLayout* cl, Size_t index);
+
+        void allocate_closure(const FunctionCode* f);
 
-        void allocate_closure(Size_t index);
+        // the closure of a method, bound to self
+        Address bind_method(Size_t function, Address self);
 
         void call_closure(Address addr);
 
+        // the closure at addr; raises an error if it is not one
+        ClosureObject* fetch_closure(Address addr);
+
+        // push the bindings of cobj, to call its function
+        void push_bindings(const ClosureObject* cobj);
+
         void call_native(int index);
 
-        void call(Size_t index);
+        void call(const FunctionCode* f);
+
+        // replace the current frame by a call of f, whose arguments are on the stack top
+        void tail_call(const FunctionCode* f);
+
+        void tail_call_closure(Address addr);
 
         void ret(bool has_value);
 
+        // Run the machine code of the current function from pc, up to the first code it leaves to the interpreter.
+        void run_native();
+
+        // Called from machine code for a call or a return: do it if the function it goes to is compiled, and
+        // return the machine code to go on with; otherwise return null, leaving it to the interpreter.
+        const void* transfer(JitFrame& frame, const Instruction& ins);
+
+        // Called from machine code for an allocating code; returns the new sp, or null if the stack is full.
+        StackElem* allocate_from_native(StackElem* sp, const Instruction& ins);
+
         void runtime_assert(bool value, const char* msg) {
             if (!value) {
                 throw RuntimeError(msg);
@@ -180,27 +392,75 @@ namespace mini {
 
     private:
 
+        friend class AotRuntime;
+
         bool terminate_flag = false;
 
+        // VM-internal opcodes. They never appear in an IRProgram.
+        static const uint16_t FUNCTION_END = 0xfe;     // sentinel after the last code of a function
+        static const uint16_t INVALID = 0xff;          // any opcode the interpreter does not know
+
+        // Quickened codes. The interpreter rewrites a code in place after its first execution into the form
+        // specialized for what it found, guarded by a check of that; a failed guard rewrites it back
+        // (deoptimize) and runs the generic code. The operands of the original code are kept.
+        static const uint16_t LOADFIELD_OFF = 0xf0;            // layout guarded; field at a known offset
+        static const uint16_t LOADFIELDI_OFF = 0xf1;
+        static const uint16_t LOADFIELDF_OFF = 0xf2;
+        static const uint16_t LOADFIELDA_OFF = 0xf3;
+        static const uint16_t STOREFIELD_OFF = 0xf4;
+        static const uint16_t STOREFIELDI_OFF = 0xf5;
+        static const uint16_t STOREFIELDF_OFF = 0xf6;
+        static const uint16_t STOREFIELDA_OFF = 0xf7;
+        static const uint16_t LOADINTERFACE_CACHED = 0xf8;     // layout guarded; the only entry of the inline cache
+        static const uint16_t STOREINTERFACE_CACHED = 0xf9;
+        static const uint16_t CALLA_KNOWN = 0xfa;              // function of the closure guarded
+        static const uint16_t TAILCALLA_KNOWN = 0xfb;
+
+        // a code deoptimized that many times stays generic
+        static const uint8_t max_deopts = 4;
+
+        size_t quickened_count = 0;
+        size_t deopt_count = 0;
+
         Size_t pc = 0;
-        Size_t pc_func = 0;     // two components of pc
-        const Function* cur_function = nullptr;
+        const FunctionCode* cur_function = nullptr;
+
+        std::vector<FunctionCode> functions;    // keyed by constant pool index
+
+#ifdef MINI_COUNT_INSTRUCTIONS
+        uint64_t executed_instructions = 0;
+#endif
+
+#ifdef MINI_PROFILE
+        std::unique_ptr<Profiler> profiler;
+        std::unique_ptr<Sampler> sampler;
+        std::unique_ptr<HeapProfiler> heap_profiler;
+        std::vector<uint64_t> sample_frames;
+
+        // Walk the frames from the current function, as handle_error() does, into a sample.
+        void take_sample();
+
+        // End the profile of a run, with the state of the inline caches.
+        void finish_profile();
+#endif
 
         Address global_addr;         // global pool address (in heap)
+        MemoryObject* global_object = nullptr;      // objects never move, so the global pool can be cached
         const IRProgram* irprog;
         Stack stack;
         MemorySection heap;
+        std::vector<Address> native_roots;     // heap arguments of the native function being called
 
-        struct FieldKey { 
-            Size_t info_index, field_id;  
-            size_t to_key()const { return (size_t(info_index) << 32) + field_id; }
-        };
-        struct FieldLocation { Size_t field_index, is_global; };
-
-        std::unordered_map<uint64_t, FieldLocation> field_indices;
+        std::deque<InterfaceCache> interface_caches;    // of the decoded codes
         std::unordered_map<int, std::fstream> file_descriptors;
         int current_fd = 3;
         int null_value = 0;
+
+        // count a call of f, compiling it at the threshold
+        void count_call(const FunctionCode* f);
+
+        Size_t jit_threshold = 0;
+        std::vector<std::unique_ptr<NativeCode>> native_code;
     };
 
 }